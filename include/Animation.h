@@ -0,0 +1,67 @@
+#ifndef MASHGRAPH3_ANIMATION_H
+#define MASHGRAPH3_ANIMATION_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "BaseStructures.h"
+#include "Scene.h"
+
+/**
+ * This file defines the animation of scene: keyframes of camera and of figures. One line is one
+ * keyframe, numbers are separated by spaces, '#' starts the comment till the end of line:
+ *
+ *     camera frame [position x y z] [direction x y z] [up x y z] [right x y z] [distance d]
+ *     figure index frame dx dy dz
+ *
+ * The parts of camera, that are not given by keyframe, are the ones of the previous keyframe,
+ * the first keyframe takes them from the camera of scene. Position of camera goes by Catmull-Rom
+ * spline through keyframes, so the path is smooth, direction, up, right and distance are
+ * interpolated linearly. Figure keyframe is the offset of figure (the index in order of scene file)
+ * from its place in scene, it is interpolated linearly. Before the first keyframe and after the
+ * last one the values of these keyframes are taken. Figures have no orientation, so they are only moved.
+ *
+ * The error is reported as "file:line: message".
+ */
+
+class Animation {
+public:
+    /**
+     * Read and parse animation file
+     * @param filename - path to file
+     * @param camera - camera of scene, it gives the parts, that are not given by keyframes
+     * @return - animation
+     */
+    static Animation Load(const std::string &filename, const Camera &camera);
+
+    /**
+     * Parse the text of animation
+     * @param text - the text
+     * @param name - name for error messages
+     * @param camera - like in Load
+     */
+    static Animation Parse(const std::string &text, const std::string &name, const Camera &camera);
+
+    /* Number of frames till the last keyframe including it */
+    int FramesCount() const;
+
+    /* Camera of frame */
+    Camera CameraAt(int frame) const;
+
+    /* Indices of figures, that have keyframes */
+    std::vector<size_t> Figures() const;
+
+    /* Offset of figure from its place in scene at frame, zero for figure without keyframes */
+    Vector FigureOffset(size_t figure, int frame) const;
+
+private:
+    explicit Animation(const Camera &camera);
+
+    /* Camera of scene, it is used, if there are no camera keyframes */
+    Camera scene_camera;
+
+    std::map<int, Camera> camera_keyframes;
+    std::map<size_t, std::map<int, Vector>> figure_keyframes;
+};
+
+#endif //MASHGRAPH3_ANIMATION_H
@@ -12,7 +12,7 @@
  *     ArgumentParser parser;
  *     parser.configure<type>(string, [ default_value ]);
  *
- *     @type can be int, std::string, bool. In case of bool parser just check to existence of option
+ *     @type can be int, float, std::string, bool. In case of bool parser just check to existence of option
  *     @string - the key of some option, for example "--key"
  *     @default_value - the default value of option, if it is not set, the option is required
  *
@@ -71,6 +71,17 @@ public:
     void SetDefault(int default_value, bool has_default_arg);
 };
 
+class FloatValue : public BaseImplValue {
+public:
+    FloatValue();
+
+    ~FloatValue() override;
+
+    int SetData(char **args_list, int current_index) override;
+
+    void SetDefault(float default_value, bool has_default_arg);
+};
+
 class StringValue : public BaseImplValue {
 public:
     StringValue() = default;
@@ -116,6 +127,18 @@ inline void make<int>(
     args[arg] = new_value;
 }
 
+template <>
+inline void make<float>(
+    std::map<std::string, BaseImplValue*> &args,
+    const std::string &arg,
+    const float &default_value,
+    bool has_default_arg) {
+
+    auto new_value = new FloatValue();
+    new_value->SetDefault(default_value, has_default_arg);
+    args[arg] = new_value;
+}
+
 template<>
 inline void make<std::string>(
     std::map<std::string, BaseImplValue*> &args,
@@ -146,6 +169,12 @@ class ArgumentsParser {
 public:
     ArgumentsParser() = default;
 
+    ArgumentsParser(const ArgumentsParser &) = delete;
+    ArgumentsParser &operator=(const ArgumentsParser &) = delete;
+
+    /* Values of options are deleted with parser */
+    ~ArgumentsParser();
+
     template<typename T>
     void configure(const std::string &arg, const T &default_value, bool has_default_arg) {
         Configure::make<T>(_args, arg, default_value, has_default_arg);
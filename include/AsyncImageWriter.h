@@ -0,0 +1,81 @@
+#ifndef MASHGRAPH3_ASYNCIMAGEWRITER_H
+#define MASHGRAPH3_ASYNCIMAGEWRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include "ImageWriter.h"
+
+/**
+ * This file defines the writer, that converts and writes images by a dedicated thread.
+ * Rows are copied to queue, so the caller could reuse its buffer at once, and continue
+ * tracing while the rows are encoded and written. Close() does not wait for the file, so
+ * the next image could be opened and traced while the previous one is written.
+ *
+ * The usage:
+ *     BmpImageWriter bmp;
+ *     AsyncImageWriter writer(bmp);
+ *     writer.Open(...); writer.WriteRow(...); writer.Close(); // the same as for any ImageWriter
+ *     writer.Finish(); // wait for all files, errors of writing are thrown here and by the next Open
+ */
+
+class AsyncImageWriter : public ImageWriter {
+public:
+    /**
+     * @param writer - writer of file format, it is used only by the thread of AsyncImageWriter
+     * @param max_queued_rows - WriteRow waits, if there are more rows in queue
+     */
+    explicit AsyncImageWriter(ImageWriter &writer, size_t max_queued_rows = 4096);
+
+    /* Waits for all queued rows */
+    ~AsyncImageWriter() override;
+
+    /* Throws the error of writing of previous images, it is kept for Finish too */
+    void Open(const std::string &filename, int width, int height) override;
+
+    /* Could be called by several threads */
+    void WriteRow(int y, const Color *row) override;
+
+    void Close() override;
+
+    /* Wait until all queued images are written, throw the first error of writing */
+    void Finish();
+
+private:
+    struct Job {
+        enum Type { OPEN, ROW, CLOSE };
+
+        Type type;
+        std::string filename;
+        int width, height;
+        int y;
+        std::vector<Color> row;
+    };
+
+    void Push(Job &&job);
+
+    /* The loop of writing thread */
+    void Run();
+
+    ImageWriter &writer;
+    size_t max_queued_rows;
+
+    /* Width of the last opened image */
+    int width;
+
+    std::mutex mutex;
+    std::condition_variable queue_changed;
+    std::deque<Job> queue;
+    size_t queued_rows;
+
+    /* Job, that is processed by thread now */
+    bool busy;
+    bool stop;
+
+    std::exception_ptr error;
+    std::thread thread;
+};
+
+#endif //MASHGRAPH3_ASYNCIMAGEWRITER_H
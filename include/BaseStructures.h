@@ -8,6 +8,8 @@
 #define GRADIENT_EPS 1
 #define MAX_TRACE_STEPS_COUNT 20000
 #define MAX_REFLECTIONS 5
+#define MAX_REFLECTIONS_LIMIT 15
+#define TILE_SIZE 32
 
 /**
  * This file defines base structures at this project
@@ -100,6 +102,32 @@ struct Vector {
     float x, y, z;
 };
 
+/**
+ * Axis aligned box, given by left down and right up corners
+ */
+struct BoundingBox {
+    BoundingBox(): min(), max() {}
+    BoundingBox(const Vector &min, const Vector &max): min(min), max(max) {}
+
+    /**
+     * Box, that is bigger on margin at every side
+     * @param margin - distance to add
+     * @return - new BoundingBox
+     */
+    BoundingBox Expand(float margin) const;
+
+    /**
+     * Check, that ray intersects box (or starts inside it)
+     * @param source - ray source
+     * @param direction - ray direction
+     * @param max_distance - only points source + direction * t with t <= max_distance are checked
+     * @return - true, if intersect
+     */
+    bool IntersectRay(const Vector &source, const Vector &direction, float max_distance = INF) const;
+
+    Vector min, max;
+};
+
 /**
  * Structure represent the object - Pixel
  */
@@ -144,4 +172,25 @@ struct Pixel {
     static Pixel LightPink;
 };
 
+/**
+ * Color with float channels, it is used to sum light without clamping.
+ * The channels have the same scale as Pixel (255 is full intensity), but could be bigger
+ */
+struct Color {
+    Color(): r(0), g(0), b(0) {}
+    Color(float r, float g, float b): r(r), g(g), b(b) {}
+    explicit Color(const Pixel &pixel): r(pixel.value.Red), g(pixel.value.Green), b(pixel.value.Blue) {}
+
+    Color operator*(float k) const { return Color(r * k, g * k, b * k); }
+    Color operator/(float k) const { return Color(r / k, g / k, b / k); }
+    Color operator+(const Color &color) const { return Color(r + color.r, g + color.g, b + color.b); }
+
+    Color &operator+=(const Color &color) {
+        r += color.r; g += color.g; b += color.b;
+        return *this;
+    }
+
+    float r, g, b;
+};
+
 #endif //MASHGRAPH3_BASESTRUCTURES_H
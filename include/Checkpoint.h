@@ -0,0 +1,98 @@
+#ifndef MASHGRAPH3_CHECKPOINT_H
+#define MASHGRAPH3_CHECKPOINT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FrameBuffer.h"
+
+struct RenderTile;
+
+/**
+ * This file defines the checkpoint of long render. Traced tiles are appended to file by
+ * a dedicated thread every few seconds, render threads only set the flag of done tile.
+ * After crash, the render could be resumed: the tiles of file are loaded to frame buffer,
+ * and only the rest tiles are traced.
+ *
+ * The file is a log of records, so it is never rewritten:
+ *     header: "RTCHECK\0", uint32 version, uint32 width, uint32 height, uint32 tiles count, uint64 render key
+ *     records: uint32 tile index, uint32 floats count, floats RGB of tile rows, uint32 crc32 of floats
+ * The record, that was not written completely, is dropped on resume.
+ *
+ * The usage:
+ *     Checkpoint checkpoint(filename, seconds);
+ *     checkpoint.Start(buffer, tiles, key, resume);
+ *     if (!checkpoint.Restored(i)) { trace tile i; checkpoint.MarkTileDone(i); }
+ *     checkpoint.Finish(); // the render is complete, the file is removed
+ */
+
+class Checkpoint {
+public:
+    /**
+     * @param filename - path to checkpoint file
+     * @param interval_seconds - period of writing
+     */
+    Checkpoint(const std::string &filename, float interval_seconds);
+
+    Checkpoint(const Checkpoint &) = delete;
+    Checkpoint &operator=(const Checkpoint &) = delete;
+
+    /* Stops the thread, the file is kept */
+    ~Checkpoint();
+
+    /**
+     * Load tiles of previous render, if resume is set, and start the thread of writing
+     * @param buffer - frame buffer of whole image
+     * @param tiles - tiles of image, the file stores their indices
+     * @param render_key - hash of scene and settings, the file of other render is not loaded
+     * @param resume - load file of previous render, otherwise the file is created again
+     * @return - number of loaded tiles
+     */
+    int Start(FrameBuffer &buffer, const std::vector<RenderTile> &tiles, uint64_t render_key, bool resume);
+
+    /* The tile was loaded from file, it must not be traced */
+    bool Restored(int tile) const { return restored[tile]; }
+
+    /* Tile is traced, it is written by the next checkpoint. It could be called by several threads */
+    void MarkTileDone(int tile) { done[tile].store(1, std::memory_order_release); }
+
+    /* Stop the thread and remove the file, the render is complete */
+    void Finish();
+
+private:
+    /* Read records of file to buffer, return size of valid part of file or 0 if the file is not of this render */
+    uint64_t Load(uint64_t render_key);
+
+    /* Append records of done tiles, that were not written */
+    void WriteDoneTiles();
+
+    /* The loop of writing thread */
+    void Run();
+
+    /* Stop and join the thread, the last done tiles are written */
+    void Stop();
+
+    std::string filename;
+    float interval_seconds;
+
+    FrameBuffer *buffer;
+    std::vector<RenderTile> tiles;
+
+    /* Flags of tiles: loaded from file, traced (set by render threads), written to file */
+    std::vector<bool> restored;
+    std::unique_ptr<std::atomic<uint8_t>[]> done;
+    std::vector<bool> written;
+
+    int fd;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable stop_changed;
+    bool stop;
+};
+
+#endif //MASHGRAPH3_CHECKPOINT_H
@@ -0,0 +1,50 @@
+#ifndef MASHGRAPH3_DEFLATE_H
+#define MASHGRAPH3_DEFLATE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * This file defines minimal deflate compressor (RFC 1951) and checksums, that are needed
+ * to write PNG without external libraries.
+ *
+ * Blocks are compressed independently (LZ77 does not look into previous blocks), so several
+ * parts of data could be compressed by different threads, and concatenated:
+ *     zlib header, DeflateBlock(part 1), DeflateBlock(part 2), ..., DeflateFinish, adler32
+ */
+
+namespace Deflate {
+
+/**
+ * Compress data to not final block with fixed Huffman codes. The block is finished by
+ * empty stored block, so it ends at byte border and blocks could be concatenated
+ * @param data - data to compress
+ * @param size - size of data
+ * @param out - compressed bytes are appended here
+ */
+void DeflateBlock(const uint8_t *data, size_t size, std::vector<uint8_t> &out);
+
+/**
+ * Append the final empty block, it finishes the deflate stream
+ * @param out - bytes are appended here
+ */
+void DeflateFinish(std::vector<uint8_t> &out);
+
+/* Adler-32 checksum of zlib stream, start with adler = 1 */
+uint32_t Adler32(uint32_t adler, const uint8_t *data, size_t size);
+
+/**
+ * Adler-32 of concatenation of two parts
+ * @param adler1 - checksum of the first part
+ * @param adler2 - checksum of the second part
+ * @param size2 - size of the second part
+ */
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2);
+
+/* CRC-32 of PNG chunks, start with crc = 0 */
+uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t size);
+
+} // namespace Deflate
+
+#endif //MASHGRAPH3_DEFLATE_H
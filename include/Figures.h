@@ -17,6 +17,9 @@
  */
 class Figure {
 public:
+    /* Scene owns the Figures and deletes them through the base pointer */
+    virtual ~Figure() {}
+
     /**
      * Must return the distance from point to Figure (if distance is 0, it means the point lies at Figure)
      * @param point - Point
@@ -31,6 +34,27 @@ public:
      */
     virtual Vector normal(const Vector &point) = 0;
 
+    /**
+     * Axis aligned box, that contains the Figure
+     * @return box
+     */
+    virtual BoundingBox Bounds() = 0;
+
+    /* Center of the Figure */
+    virtual Vector Position() = 0;
+
+    /**
+     * Move the Figure
+     * @param position - new center
+     */
+    virtual void MoveTo(const Vector &position) = 0;
+
+    /**
+     * Figure is convex, if segment between any two its points lies in it. A ray, that leaves
+     * convex Figure, could not intersect it again
+     */
+    virtual bool IsConvex() = 0;
+
     /**
      * Make figure reflectable
      * @param k - the coefficient with which color sums after reflect
@@ -66,6 +90,9 @@ public:
      */
     virtual Vector normal(const Vector &point) override;
 
+    /* Not convex by default */
+    bool IsConvex() override;
+
     /* Initialize reflect data */
     void MakeReflectable(float k) override;
     bool IsReflectable() override;
@@ -98,6 +125,10 @@ public:
     Sphere(const Vector &point, float radius);
 
     float distance(const Vector &point) override;
+    BoundingBox Bounds() override;
+    Vector Position() override;
+    void MoveTo(const Vector &position) override;
+    bool IsConvex() override;
 
 private:
     Vector center;
@@ -112,18 +143,25 @@ public:
 
     float distance(const Vector &point) override;
     Vector normal(const Vector &point) override;
+    BoundingBox Bounds() override;
+    Vector Position() override;
+    void MoveTo(const Vector &position) override;
+    bool IsConvex() override;
 private:
     Vector center;
     Vector radius;
 };
 
-/* Torus - given by center and two radiuses */
+/* Torus - given by center and two radiuses, it lies in XZ plane */
 class Torus : public FigureBaseImpl {
 public:
     Torus();
     Torus(const Vector &point, float R, float r);
 
     float distance(const Vector &point) override;
+    BoundingBox Bounds() override;
+    Vector Position() override;
+    void MoveTo(const Vector &position) override;
 private:
     Vector center;
     float R, r;
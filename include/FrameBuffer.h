@@ -0,0 +1,146 @@
+#ifndef MASHGRAPH3_FRAMEBUFFER_H
+#define MASHGRAPH3_FRAMEBUFFER_H
+
+#include <cstdint>
+#include <string>
+#include "BaseStructures.h"
+
+/**
+ * This file defines the buffer of rendered image. The colors are stored as floats in one
+ * contiguous block, every row starts at cache line, so tiles of different threads share
+ * cache lines only at their left and right borders.
+ *
+ * The colors are converted to 8 bit only at output by QuantizeRow.
+ *
+ * The buffer could be mapped to file (MapFile), then render threads write tiles in place and
+ * other processes read them from the same file without copy. A path at /dev/shm gives
+ * POSIX shared memory segment. The file layout:
+ *     FrameBufferFileHeader          - at offset 0
+ *     completion bitmap              - at bitmap_offset, bit (tile_y * tiles_x + tile_x) of uint64 words
+ *     rows of floats RGB             - at pixels_offset (page aligned), row_stride bytes per row
+ * The bit of tile is set after its colors are written (release order), so a consumer, that reads
+ * the bit with acquire order, reads the final colors of tile. The state becomes 1, when render is finished
+ * and all tiles are done, or 2, when render is stopped before some tiles (by time budget).
+ */
+
+/**
+ * Header of mapped frame buffer file, all numbers are in native byte order
+ */
+struct FrameBufferFileHeader {
+    /* "RTFRAME" */
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+
+    uint32_t width, height;
+    uint32_t row_stride;
+
+    uint32_t tile_size;
+    uint32_t tiles_x, tiles_y;
+
+    uint64_t bitmap_offset;
+    uint64_t pixels_offset;
+
+    /* Number of done tiles, it is updated with bitmap */
+    uint32_t tiles_done;
+
+    /* 0 - render is in progress, 1 - the image is complete, 2 - render is stopped, not done tiles are partial */
+    uint32_t state;
+};
+
+/**
+ * Float RGB image
+ */
+class FrameBuffer {
+public:
+    FrameBuffer();
+    ~FrameBuffer();
+
+    FrameBuffer(const FrameBuffer &) = delete;
+    FrameBuffer &operator=(const FrameBuffer &) = delete;
+
+    /**
+     * Set resolution, memory is reallocated only if it is not enough. The colors are not cleared
+     * @param width, height - new resolution
+     */
+    void Resize(int width, int height);
+
+    /**
+     * Place buffer to file, that is created (or truncated) and mapped to memory.
+     * The buffer is mapped until the next MapFile or Resize to other resolution
+     * @param filename - path to file
+     * @param width, height - resolution
+     * @param tile_size - side of tiles of completion bitmap
+     */
+    void MapFile(const std::string &filename, int width, int height, int tile_size);
+
+    bool Mapped() const { return mapping != nullptr; }
+
+    /**
+     * Publish colors of tile to readers of mapped file, does nothing if the buffer is not mapped
+     * @param x, y - the left upper pixel of tile
+     */
+    void MarkTileDone(int x, int y);
+
+    /* Mark render of mapped image as finished: complete, if all tiles are done, or stopped otherwise */
+    void MarkFinished();
+
+    /* Set all colors to black */
+    void Clear();
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    /* The first pixel of row y */
+    Color *Row(int y) { return reinterpret_cast<Color*>(data + size_t(y) * stride); }
+    const Color *Row(int y) const { return reinterpret_cast<const Color*>(data + size_t(y) * stride); }
+
+    Color &At(int x, int y) { return Row(y)[x]; }
+
+    /**
+     * Convert row of colors to 8 bit RGB, values are clamped to [0, 255]
+     * @param row - width colors
+     * @param width - number of pixels
+     * @param rgb - 3 * width bytes, the result
+     */
+    static void QuantizeRow(const Color *row, int width, uint8_t *rgb);
+
+private:
+    int width, height;
+
+    /* Floats in one row, with padding to cache line */
+    size_t stride;
+
+    /* Allocated floats */
+    size_t capacity;
+
+    float *data;
+
+    /* Mapped file, nullptr if the buffer is allocated in memory */
+    void *mapping;
+    size_t mapping_size;
+
+    /* Release mapped file or allocated memory */
+    void Release();
+};
+
+/**
+ * The part of FrameBuffer, that is written by one tile. Coordinates are relative to the view
+ */
+class FrameBufferView {
+public:
+    FrameBufferView(FrameBuffer &buffer, int x0, int y0, int width, int height):
+        buffer(buffer), x0(x0), y0(y0), width(width), height(height) {}
+
+    Color &At(int x, int y) { return buffer.At(x0 + x, y0 + y); }
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+private:
+    FrameBuffer &buffer;
+    int x0, y0;
+    int width, height;
+};
+
+#endif //MASHGRAPH3_FRAMEBUFFER_H
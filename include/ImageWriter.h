@@ -0,0 +1,170 @@
+#ifndef MASHGRAPH3_IMAGEWRITER_H
+#define MASHGRAPH3_IMAGEWRITER_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "BaseStructures.h"
+
+/**
+ * This file defines writers of images, that receive the image by rows in any order,
+ * so the image could be written while it is rendered, and never be stored whole in memory.
+ *
+ * The usage:
+ *     std::unique_ptr<ImageWriter> writer = CreateImageWriter(filename, threads);
+ *     writer->Open(filename, width, height);
+ *     writer->WriteRow(y, row); // for every row
+ *     writer->Close();
+ *
+ * The filename "-" means standard output. It could not be seeked, so rows, that come
+ * earlier than their turn, are kept in memory.
+ */
+
+/**
+ * File, that could be written sequentially or at any position
+ */
+class OutputFile {
+public:
+    OutputFile();
+    ~OutputFile();
+
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
+
+    /**
+     * Create (or truncate) file
+     * @param filename - path to file, "-" is standard output
+     */
+    void Open(const std::string &filename);
+
+    /* Standard output is written as a stream, WriteAt and Resize are not allowed then */
+    bool Seekable() const { return seekable; }
+
+    /* Append data to the end of written data */
+    void Write(const uint8_t *data, size_t size);
+
+    /* Write data at offset from file start */
+    void WriteAt(const uint8_t *data, size_t size, uint64_t offset);
+
+    /* Set file size */
+    void Resize(uint64_t size);
+
+    void Close();
+
+private:
+    std::string filename;
+    int fd;
+    bool seekable;
+    uint64_t written;
+};
+
+/**
+ * Abstract writer of image
+ */
+class ImageWriter {
+public:
+    virtual ~ImageWriter() {}
+
+    /**
+     * Create file for image
+     * @param filename - path to result file
+     * @param width, height - image resolution
+     */
+    virtual void Open(const std::string &filename, int width, int height) = 0;
+
+    /**
+     * Write one row of image
+     * @param y - index of row, 0 is the top row
+     * @param row - width colors, they are clamped to [0, 255]
+     */
+    virtual void WriteRow(int y, const Color *row) = 0;
+
+    /* Finish the file, it must be called after all rows are written */
+    virtual void Close() = 0;
+};
+
+/**
+ * Writer of formats without compression, that store every row at fixed position.
+ * Rows are written at their positions, the file gets its full size at Open
+ */
+class RasterImageWriter : public ImageWriter {
+public:
+    RasterImageWriter();
+
+    void Open(const std::string &filename, int width, int height) override;
+    void WriteRow(int y, const Color *row) override;
+    void Close() override;
+
+protected:
+    /* Header of file */
+    virtual std::vector<uint8_t> Header(int width, int height) = 0;
+
+    /* Bytes in one row of file */
+    virtual size_t RowSize(int width) = 0;
+
+    /* Convert colors to row of file */
+    virtual void EncodeRow(const Color *row, int width, uint8_t *out) = 0;
+
+    /* Rows are stored from bottom to top */
+    virtual bool BottomUp() = 0;
+
+    int width, height;
+
+private:
+    /* Write encoded row at its position, or keep it until its turn */
+    void Store(int y, std::vector<uint8_t> &&data);
+
+    OutputFile file;
+    size_t header_size;
+    size_t row_size;
+
+    std::vector<uint8_t> row_buffer;
+
+    /* For not seekable output: the next row in file order, and rows, that came earlier */
+    int next_row;
+    std::map<int, std::vector<uint8_t>> pending_rows;
+};
+
+/**
+ * Writer of 24 bit BMP, the file is the same as EasyBMP writes
+ */
+class BmpImageWriter : public RasterImageWriter {
+protected:
+    std::vector<uint8_t> Header(int width, int height) override;
+    size_t RowSize(int width) override;
+    void EncodeRow(const Color *row, int width, uint8_t *out) override;
+    bool BottomUp() override { return true; }
+};
+
+/**
+ * Writer of binary PPM (P6), 8 bit RGB without any conversion, it is read by most tools
+ */
+class PpmImageWriter : public RasterImageWriter {
+protected:
+    std::vector<uint8_t> Header(int width, int height) override;
+    size_t RowSize(int width) override;
+    void EncodeRow(const Color *row, int width, uint8_t *out) override;
+    bool BottomUp() override { return false; }
+};
+
+/**
+ * Writer of PFM: float RGB, not clamped, 1.0 is white (255 of 8 bit formats)
+ */
+class PfmImageWriter : public RasterImageWriter {
+protected:
+    std::vector<uint8_t> Header(int width, int height) override;
+    size_t RowSize(int width) override;
+    void EncodeRow(const Color *row, int width, uint8_t *out) override;
+    bool BottomUp() override { return true; }
+};
+
+/**
+ * Create writer by extension of file: .bmp, .png, .ppm, .pfm. "-" (standard output) is written as PPM
+ * @param filename - path to result file
+ * @param threads - threads number for compression
+ * @return - new writer
+ */
+std::unique_ptr<ImageWriter> CreateImageWriter(const std::string &filename, int threads);
+
+#endif //MASHGRAPH3_IMAGEWRITER_H
@@ -0,0 +1,72 @@
+#ifndef MASHGRAPH3_LIGHTCACHE_H
+#define MASHGRAPH3_LIGHTCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "BaseStructures.h"
+
+/**
+ * This file defines the cache of shadow rays results. The space is split to cubic cells,
+ * and the visibility of light is stored for (cell, quantized normal, figure, light).
+ * Points of one cell reuse the result of the first traced shadow ray, so the cell size
+ * is the bound of error: shadows borders could move up to cell diagonal.
+ *
+ * The cache is a hash table with open addressing and atomic entries, so it is shared
+ * by render threads without locks. It is valid while lights and figures do not change.
+ */
+
+class LightCache {
+public:
+    /**
+     * @param cell_size - side of cell, 0 disables the cache
+     * @param capacity - maximal number of stored results, it is rounded up to power of 2
+     */
+    LightCache(float cell_size = 0, size_t capacity = 0);
+
+    LightCache(const LightCache &) = delete;
+    LightCache &operator=(const LightCache &) = delete;
+
+    /**
+     * Set new cell size and capacity, all stored results are removed
+     */
+    void Configure(float cell_size, size_t capacity);
+
+    bool Enabled() const { return cell_size > 0; }
+
+    float CellSize() const { return cell_size; }
+
+    /* Remove all stored results */
+    void Clear();
+
+    /**
+     * Key of shadow ray
+     * @param point - point at surface
+     * @param normal - normal at point
+     * @param figure - figure, that contains point (only the address is used)
+     * @param light - index of light
+     */
+    uint64_t Key(const Vector &point, const Vector &normal, const void *figure, int light) const;
+
+    /**
+     * Find stored visibility
+     * @param key - result of Key()
+     * @param visible - the result is written here
+     * @return - true, if found
+     */
+    bool Find(uint64_t key, bool &visible);
+
+    /**
+     * Store visibility, does nothing if the table is full
+     */
+    void Insert(uint64_t key, bool visible);
+
+private:
+    float cell_size;
+
+    /* Entry is (key << 1 | visible), 0 - empty entry */
+    std::vector<std::atomic<uint64_t>> table;
+    uint64_t mask;
+};
+
+#endif //MASHGRAPH3_LIGHTCACHE_H
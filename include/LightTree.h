@@ -0,0 +1,72 @@
+#ifndef MASHGRAPH3_LIGHTTREE_H
+#define MASHGRAPH3_LIGHTTREE_H
+
+#include <vector>
+#include "BaseStructures.h"
+
+/**
+ * This file defines the hierarchy of lights, that allows to choose light sources
+ * with probability proportional to their possible contribution to a shading point.
+ *
+ * The usage:
+ *     LightTree tree;
+ *     tree.Build(points);
+ *     float pdf;
+ *     int light = tree.Sample(point, normal, random, pdf);
+ *
+ * The contribution of chosen light must be divided by pdf, then the sum of the samples
+ * is equal to the sum over all lights in average (unbiased estimate).
+ */
+
+class LightTree {
+public:
+    LightTree() = default;
+
+    /**
+     * Build tree over light positions
+     * @param positions - positions of lights, the result of Sample is index in this vector
+     */
+    void Build(const std::vector<Vector> &positions);
+
+    bool Empty() const { return nodes.empty(); }
+
+    /**
+     * Choose light by importance for point
+     * @param point - shading point
+     * @param normal - normal of surface at point
+     * @param random - random number in [0, 1)
+     * @param pdf - probability of chosen light is written here
+     * @return - index of light, -1 if no light could light the point
+     */
+    int Sample(const Vector &point, const Vector &normal, float random, float &pdf) const;
+
+private:
+    struct Node {
+        BoundingBox bounds;
+
+        /* Number of lights in subtree (all lights have the same power) */
+        float power;
+
+        /* Children indices, -1 for leaf */
+        int left, right;
+
+        /* Index of light for leaf */
+        int light;
+    };
+
+    /**
+     * Build subtree over lights [begin, end) of order
+     * @return - index of node
+     */
+    int BuildNode(std::vector<int> &order, int begin, int end, const std::vector<Vector> &positions);
+
+    /**
+     * Upper bound of light, that node could give to point
+     * @return - 0 if all lights of node are behind the surface
+     */
+    float Importance(const Node &node, const Vector &point, const Vector &normal) const;
+
+    std::vector<Node> nodes;
+};
+
+#endif //MASHGRAPH3_LIGHTTREE_H
@@ -0,0 +1,72 @@
+#ifndef MASHGRAPH3_PNGIMAGEWRITER_H
+#define MASHGRAPH3_PNGIMAGEWRITER_H
+
+#include <future>
+#include <map>
+#include "ImageWriter.h"
+
+/**
+ * This file defines writer of 8 bit RGB PNG. Rows are collected to bands, and every band is
+ * filtered and compressed by separate thread into its own IDAT chunk, while the next bands
+ * are rendered. Bands are written to file in order, so the output could be a pipe.
+ */
+
+class PngImageWriter : public ImageWriter {
+public:
+    /**
+     * @param threads - maximal number of bands, that are compressed at once
+     */
+    explicit PngImageWriter(int threads);
+    ~PngImageWriter() override;
+
+    void Open(const std::string &filename, int width, int height) override;
+    void WriteRow(int y, const Color *row) override;
+    void Close() override;
+
+private:
+    /* Compressed band */
+    struct Chunk {
+        std::vector<uint8_t> data;
+        uint32_t adler;
+        size_t raw_size;
+    };
+
+    /* Band, that receives rows */
+    struct Band {
+        Band(): rows_count(0) {}
+
+        std::vector<uint8_t> pixels;
+        int rows_count;
+    };
+
+    /**
+     * Filter and compress rows of band
+     * @param pixels - 8 bit RGB rows of band
+     * @param width - pixels in row
+     * @param rows - rows in band
+     */
+    static Chunk Compress(std::vector<uint8_t> pixels, int width, int rows);
+
+    /* Write compressed bands, that are ready and go in order. If wait is true, wait for the next band */
+    void WriteReadyBands(bool wait);
+
+    void WriteChunk(const char *type, const uint8_t *data, size_t size);
+
+    int threads;
+    int width, height;
+    int band_rows;
+
+    OutputFile file;
+
+    /* Bands, that receive rows */
+    std::map<int, Band> bands;
+
+    /* Bands, that are compressed */
+    std::map<int, std::future<Chunk>> compressing;
+
+    /* Index of band, that must be written next */
+    int next_band;
+    uint32_t adler;
+};
+
+#endif //MASHGRAPH3_PNGIMAGEWRITER_H
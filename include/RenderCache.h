@@ -0,0 +1,101 @@
+#ifndef MASHGRAPH3_RENDERCACHE_H
+#define MASHGRAPH3_RENDERCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "ImageWriter.h"
+
+/**
+ * This file defines the cache of rendered images. The image is found by Scene::RenderKey, that is
+ * the hash of figures, materials, lights, camera, resolution and settings, so the same render
+ * requested by other pipeline is written from cache without tracing.
+ *
+ * Every image is a file of directory:
+ *     header: "RTIMAGE\0", uint32 version, uint32 width, uint32 height, uint32 crc32 of colors, uint64 key
+ *     colors: float RGB of rows from top, they are written to any format like traced ones
+ * The modification time of file is the time of the last use. When the files take more than the size
+ * limit, the least recently used ones are removed. The counters of hits, misses and evictions of all
+ * processes are kept in file "stats" of directory.
+ *
+ * The usage:
+ *     RenderCache cache(directory, size_limit, verbose);
+ *     if (!cache.Fetch(key, writer, filename)) {
+ *         RecordingImageWriter recorder(writer);
+ *         render to recorder;
+ *         cache.Store(key, recorder);
+ *     }
+ */
+
+class RecordingImageWriter;
+
+class RenderCache {
+public:
+    /**
+     * @param directory - directory of images, it is created if it does not exist
+     * @param size_limit - maximal size of images in bytes
+     * @param verbose - print hits, misses and counters
+     */
+    RenderCache(const std::string &directory, uint64_t size_limit, bool verbose);
+
+    /**
+     * Write cached image of key to file
+     * @return - false, if the image is not cached, nothing is written then
+     */
+    bool Fetch(uint64_t key, ImageWriter &writer, const std::string &filename);
+
+    /**
+     * Put rendered image to cache and remove the least recently used images over size limit
+     * @param recorder - the writer, that recorded rendered image, nothing is stored if it is not complete
+     */
+    void Store(uint64_t key, const RecordingImageWriter &recorder);
+
+private:
+    /* Path of image of key */
+    std::string EntryPath(uint64_t key) const;
+
+    /* Remove the least recently used images, while they take more than size limit, return number of removed ones */
+    int Evict();
+
+    /* Add to counters of stats file and print them */
+    void UpdateStats(int hits, int misses, int evictions);
+
+    std::string directory;
+    uint64_t size_limit;
+    bool verbose;
+};
+
+/**
+ * Writer, that passes everything to other writer and keeps colors of the last written image
+ */
+class RecordingImageWriter : public ImageWriter {
+public:
+    explicit RecordingImageWriter(ImageWriter &writer);
+
+    void Open(const std::string &filename, int width, int height) override;
+
+    /* Could be called by several threads, like WriteRow of AsyncImageWriter */
+    void WriteRow(int y, const Color *row) override;
+
+    void Close() override;
+
+    /* All rows of the last image are written, and it is closed */
+    bool Complete() const { return complete; }
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    /* Rows of the last image from top */
+    const std::vector<Color> &Colors() const { return colors; }
+
+private:
+    ImageWriter &writer;
+
+    int width, height;
+    std::vector<Color> colors;
+    std::atomic<int> rows_written;
+    bool complete;
+};
+
+#endif //MASHGRAPH3_RENDERCACHE_H
@@ -0,0 +1,130 @@
+#ifndef MASHGRAPH3_RENDERFARM_H
+#define MASHGRAPH3_RENDERFARM_H
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+#include "ImageWriter.h"
+#include "FrameBuffer.h"
+#include "Scene.h"
+
+/**
+ * This file defines the render farm: the coordinator splits image to tiles and sends them
+ * to worker processes, that trace them and send colors back. The worker reads messages from
+ * one stream and writes to other, so it could be connected by pipe, Unix socket or SSH.
+ *
+ * The protocol is a sequence of messages, numbers are in native byte order:
+ *     header: uint32 type, uint32 payload size
+ *     HELLO  (worker)      - uint32 version, uint32 width, uint32 height, uint64 render key of scene
+ *     TILE   (coordinator) - uint32 tile index, int32 x0, y0, x1, y1
+ *     RESULT (worker)      - uint32 tile index, floats RGB of tile rows
+ *     QUIT   (coordinator) - empty, the worker exits
+ * The coordinator checks HELLO, so workers must be started with the same scene arguments, and the scene
+ * must not be edited after it was built from them.
+ *
+ * The usage:
+ *     RenderFarm farm(command, workers, timeout, verbose);
+ *     farm.Render(width, height, window, full_output, scene.RenderKey(settings), writer, filename);
+ * and in the worker process:
+ *     RenderFarm::RunWorker(scene, settings, input_fd, output_fd);
+ */
+
+class RenderFarm {
+public:
+    /**
+     * @param command - command line of worker, argv[0] is the path of program
+     * @param workers_count - number of started workers
+     * @param timeout - seconds of worker start and of every tile, hung worker is failed after them, 0 - no limit
+     * @param verbose - print progress messages
+     */
+    RenderFarm(const std::vector<std::string> &command, int workers_count, float timeout, bool verbose);
+
+    RenderFarm(const RenderFarm &) = delete;
+    RenderFarm &operator=(const RenderFarm &) = delete;
+
+    /* Kills workers, that are still running */
+    ~RenderFarm();
+
+    /**
+     * Trace image by workers and write it. Tiles of failed worker are given to other workers
+     * @param width, height - resolution of image
+     * @param window - crop window of image, only it is traced
+     * @param full_output - write the whole image with black pixels outside of window
+     * @param scene_key - Scene::RenderKey of coordinator, workers must report the same
+     * @param writer - writer of file format
+     * @param filename - path to result file
+     */
+    void Render(int width, int height, const RenderTile &window, bool full_output, uint64_t scene_key,
+                ImageWriter &writer, const std::string &filename);
+
+    /**
+     * Serve tiles of coordinator until QUIT or end of input
+     * @param scene - scene with configured camera
+     * @param settings - settings of render
+     * @param input - file descriptor of messages from coordinator
+     * @param output - file descriptor of messages to coordinator
+     * @return - exit code of worker process
+     */
+    static int RunWorker(Scene &scene, const RenderSettings &settings, int input, int output);
+
+private:
+    struct Worker {
+        int pid;
+        int fd;
+
+        /* Tiles, that are sent and not received */
+        std::vector<int> tiles;
+
+        /* Bytes of incomplete message */
+        std::vector<uint8_t> input;
+
+        /* Start of the current step of worker: its start, or tracing of its first tile in flight */
+        std::chrono::steady_clock::time_point step_start;
+
+        bool ready;
+        bool alive;
+    };
+
+    /* Start worker process connected by socket pair */
+    void Spawn(Worker &worker);
+
+    /* Kill worker and return its tiles to queue */
+    void Fail(Worker &worker, const std::string &reason);
+
+    /* Time, when worker, that starts or traces a tile, is failed */
+    std::chrono::steady_clock::time_point Deadline(const Worker &worker) const;
+
+    /* Send tiles from queue to worker, until it has enough of them */
+    void Feed(Worker &worker);
+
+    /**
+     * Handle complete messages of worker input
+     * @return - false, if the protocol is broken
+     */
+    bool HandleMessages(Worker &worker);
+
+    std::vector<std::string> command;
+    float timeout;
+    bool verbose;
+
+    std::vector<Worker> workers;
+
+    /* Image and its tiles, the buffer holds the window */
+    int width, height;
+    RenderTile window;
+    bool full_output;
+    std::vector<Color> full_row;
+    uint64_t scene_key;
+    std::vector<RenderTile> tiles;
+    std::deque<int> queue;
+    std::vector<bool> tile_done;
+    FrameBuffer buffer;
+
+    /* Number of done tiles in every line of tiles, the line is written when it is complete */
+    std::vector<int> done_in_line;
+    int tiles_in_line;
+    ImageWriter *writer;
+};
+
+#endif //MASHGRAPH3_RENDERFARM_H
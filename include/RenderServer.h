@@ -0,0 +1,112 @@
+#ifndef MASHGRAPH3_RENDERSERVER_H
+#define MASHGRAPH3_RENDERSERVER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * This file defines the server, that renders jobs of clients in one long running process,
+ * so scenes, light structures and threads are kept between jobs.
+ *
+ * The job is one line of command line arguments, for example:
+ *     --save-to out.bmp --antialiasing --camera-position-z 20 --priority 5
+ * Jobs with greater --priority are rendered first, jobs of equal priority - in order of arrival.
+ * The line "quit" stops the server after all queued jobs. The server answers by lines:
+ *     queued <id>
+ *     done <id> <milliseconds>
+ *     failed <id> <error message>
+ *
+ * Jobs are read from Unix domain socket (every connection is a client), or from stdin,
+ * then answers are written to stdout.
+ */
+
+class RenderServer {
+public:
+    /* Render job, it throws std::exception on error */
+    using Handler = std::function<void(const std::vector<std::string> &arguments)>;
+
+    explicit RenderServer(const Handler &handler);
+
+    RenderServer(const RenderServer &) = delete;
+    RenderServer &operator=(const RenderServer &) = delete;
+
+    /**
+     * Serve jobs until "quit" (or end of stdin)
+     * @param socket_path - path of Unix domain socket, empty - stdin and stdout
+     */
+    void Run(const std::string &socket_path);
+
+    /**
+     * Split line to arguments by spaces, "quoted text" is one argument
+     */
+    static std::vector<std::string> SplitArguments(const std::string &line);
+
+private:
+    /* Client, the answers are written to its output */
+    struct Connection {
+        Connection(int input, int output, bool owned): input(input), output(output), owned(owned) {}
+        ~Connection();
+
+        void Send(const std::string &line);
+
+        int input, output;
+
+        /* The descriptors are closed with connection */
+        bool owned;
+        std::mutex mutex;
+    };
+
+    struct Job {
+        int priority;
+        uint64_t id;
+        std::vector<std::string> arguments;
+        std::shared_ptr<Connection> connection;
+    };
+
+    /* Greater priority first, then the earlier job */
+    struct JobOrder {
+        bool operator()(const Job &a, const Job &b) const {
+            if (a.priority != b.priority)
+                return a.priority < b.priority;
+            return a.id > b.id;
+        }
+    };
+
+    /* Read lines of client and queue its jobs */
+    void ReadJobs(std::shared_ptr<Connection> connection);
+
+    /* Accept clients of socket */
+    void AcceptConnections(int listen_fd);
+
+    /* Join readers of disconnected clients and forget closed connections, the mutex must be locked */
+    void ReapReaders();
+
+    /* Queue one line of client */
+    void HandleLine(const std::string &line, const std::shared_ptr<Connection> &connection);
+
+    Handler handler;
+
+    std::priority_queue<Job, std::vector<Job>, JobOrder> queue;
+    uint64_t next_id;
+
+    /* Clients, that are connected, and their threads */
+    std::vector<std::weak_ptr<Connection>> connections;
+    std::vector<std::thread> readers;
+    int active_readers;
+
+    /* Readers, that returned and could be joined */
+    std::vector<std::thread::id> finished_readers;
+
+    bool stop;
+    std::mutex mutex;
+    std::condition_variable queue_changed;
+};
+
+#endif //MASHGRAPH3_RENDERSERVER_H
@@ -1,16 +1,25 @@
 #ifndef MASHGRAPH3_SCENE_H
 #define MASHGRAPH3_SCENE_H
 
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <vector>
 #include "BaseStructures.h"
 #include "Figures.h"
 #include "EasyBMP.h"
 #include "ArgumentsParser.h"
+#include "LightTree.h"
+#include "LightCache.h"
+#include "ImageWriter.h"
+#include "FrameBuffer.h"
 
 /**
  * This file defines the Scene class
  */
 
+class Checkpoint;
+
 /**
  * Struct represent to light source
  */
@@ -50,6 +59,238 @@ struct Camera {
     float distance;
 };
 
+/**
+ * Rectangle of image pixels, that is traced by one thread at once: [x0, x1) x [y0, y1)
+ */
+struct RenderTile {
+    RenderTile(): x0(0), y0(0), x1(0), y1(0) {}
+    RenderTile(int x0, int y0, int x1, int y1): x0(x0), y0(y0), x1(x1), y1(y1) {}
+
+    int x0, y0, x1, y1;
+};
+
+/**
+ * Pixels, that are traced by one pass of render: (x, y), such that x % step == offset_x and y % step == offset_y.
+ * The default pass traces all pixels
+ */
+struct RenderPass {
+    RenderPass(int step = 1, int offset_x = 0, int offset_y = 0, int antialiasing_side_number = 1, bool last = true):
+        step(step), offset_x(offset_x), offset_y(offset_y), antialiasing_side_number(antialiasing_side_number), last(last) {}
+
+    bool Contains(int x, int y) const { return x % step == offset_x && y % step == offset_y; }
+
+    int step;
+    int offset_x, offset_y;
+
+    /* Rays per pixel (1 or 4) */
+    int antialiasing_side_number;
+
+    /* Pixels get their final colors by this pass */
+    bool last;
+};
+
+/**
+ * Counters of shadow rays, that were not traced because of cheap tests
+ */
+struct ShadowStats {
+    ShadowStats(): rays(0), back_facing(0), below_threshold(0), no_occluders(0), cache_hits(0), cache_misses(0) {}
+
+    ShadowStats &operator+=(const ShadowStats &stats);
+
+    /* All shadow rays, that were asked */
+    long long rays;
+
+    /* Light is behind the surface, so the figure shadows itself */
+    long long back_facing;
+
+    /* Light adds less than RenderSettings::shadow_threshold */
+    long long below_threshold;
+
+    /* Ray does not cross bounding box of any figure, so light is visible */
+    long long no_occluders;
+
+    /* Results of light cache, that were reused / traced and stored */
+    long long cache_hits;
+    long long cache_misses;
+
+    /* Counters of different threads must not share cache line */
+    char padding[16];
+};
+
+/**
+ * Numbers of traced rays of one thread by reflection depth (0 - rays from camera)
+ */
+struct RayStats {
+    RayStats(): rays() {}
+
+    long long rays[MAX_REFLECTIONS_LIMIT + 1];
+
+    /* Counters of different threads must not share cache line */
+    char padding[64];
+};
+
+/**
+ * Settings of one render, usually filled from command line
+ */
+struct RenderSettings {
+    RenderSettings():
+        threads_number(1),
+        antialiasing(false),
+        shadow_threshold(1),
+        light_samples(0),
+        light_cache_cell(0),
+        light_cache_entries(1 << 22),
+        band_height(0),
+        async_output(false),
+        progressive(false),
+        preview_seconds(2),
+        preview_passes(0),
+        max_reflections(MAX_REFLECTIONS),
+        aa_threshold(0),
+        time_budget(0),
+        checkpoint_seconds(60),
+        resume(false),
+        crop_x(0),
+        crop_y(0),
+        crop_width(0),
+        crop_height(0),
+        crop_full_output(false),
+        incremental(false),
+        temporal(false),
+        preview_scale(1),
+        checkerboard(false),
+        post_antialiasing(false),
+        verbose(true) {}
+
+    /**
+     * Read settings from parsed arguments (--threads, --antialiasing, --shadow-threshold, --light-samples,
+     * --light-cache-cell, --light-cache-entries, --band-height, --async-output, --framebuffer-file,
+     * --progressive, --preview-seconds, --preview-passes, --max-reflections, --aa-threshold, --time-budget,
+     * --checkpoint, --checkpoint-seconds, --resume, --crop, --crop-full, --incremental,
+     * --temporal, --preview-scale, --checkerboard, --post-aa)
+     * @param argumentsParser - parsed command line
+     */
+    explicit RenderSettings(ArgumentsParser &argumentsParser);
+
+    int threads_number;
+    bool antialiasing;
+
+    /* Shadow ray is not traced, if its light adds less than this value to color channel (255 is white) */
+    float shadow_threshold;
+
+    /*
+     * Number of lights, that are chosen by importance for every shading point from the light tree.
+     * 0 means, that all lights are evaluated
+     */
+    int light_samples;
+
+    /*
+     * Side of cell of the light cache, that stores shadow rays results. It is the bound of shadows
+     * borders error. 0 disables the cache
+     */
+    float light_cache_cell;
+    int light_cache_entries;
+
+    /* Rows in one band of streaming render, 0 - the image is rendered whole */
+    int band_height;
+
+    /* Encode and write image by dedicated thread, while tracing continues */
+    bool async_output;
+
+    /*
+     * Path of file, that is mapped as frame buffer, so other processes read traced tiles in place
+     * (look at FrameBuffer.h). Empty - the buffer is in memory. The image is rendered whole then
+     */
+    std::string framebuffer_file;
+
+    /*
+     * Render by passes of increasing density: every 8th pixel, then the gaps, then antialiasing,
+     * and write preview image between passes
+     */
+    bool progressive;
+
+    /* Write preview, if this time passed since the last one (0 - never) */
+    float preview_seconds;
+
+    /* Write preview after every this number of passes (0 - never) */
+    int preview_passes;
+
+    /* Depth of reflections and refractions, up to MAX_REFLECTIONS_LIMIT */
+    int max_reflections;
+
+    /*
+     * Adaptive antialiasing: two diagonal samples are traced first, and the other two only if the
+     * first ones differ by more than this value in some color channel (255 is white). 0 - always 4 samples
+     */
+    float aa_threshold;
+
+    /*
+     * Seconds for the whole render, 0 - no limit. The first progressive pass measures speed, then
+     * reflections depth and antialiasing are chosen to fit, and tiles, that are not traced at deadline,
+     * are filled from the previous passes. It replaces --antialiasing, --max-reflections and --aa-threshold
+     */
+    float time_budget;
+
+    /*
+     * Path of file, to which traced tiles are written periodically, so the render could be resumed
+     * after crash (look at Checkpoint.h). Empty - no checkpoints. The image is rendered whole then
+     */
+    std::string checkpoint_file;
+    float checkpoint_seconds;
+
+    /* Load tiles from checkpoint file and trace only the rest */
+    bool resume;
+
+    /*
+     * Crop window: only these pixels of image are traced with the same projection, and only they are
+     * stored in frame buffer. Width 0 - the whole image
+     */
+    int crop_x, crop_y;
+    int crop_width, crop_height;
+
+    /* Write image of full size with black pixels outside of crop window, instead of the window only */
+    bool crop_full_output;
+
+    /*
+     * Remember the voxels of scene, that rays of every tile passed, so the next render of the same view
+     * after MoveFigure and SetFigureColor traces only the tiles, which rays passed the edited figures.
+     * It works for the whole image in memory without light cache, otherwise the image is traced whole
+     */
+    bool incremental;
+
+    /*
+     * Reuse colors of the previous frame: its hit points are projected by the current camera, and the pixels,
+     * where the same figure without reflection and refraction is seen without occluders, are not traced.
+     * Edits of scene make the next frame traced whole. It works like incremental, which is not used then
+     */
+    bool temporal;
+
+    /*
+     * Trace only every preview_scale-th pixel of every preview_scale-th row, and interpolate the pixels between
+     * them, if they see the same figure at close depth. Only pixels at edges of figures are traced then.
+     * It works for the whole image in memory, progressive render and render farm could not use it,
+     * 1 - every pixel is traced
+     */
+    int preview_scale;
+
+    /*
+     * Trace only pixels of one color of checkerboard, the color is changed by every render. Pixels of the other
+     * color are taken from the previous render by temporal reprojection, or interpolated by neighbours, if they
+     * lie on the same surface, and pixels at edges of figures are traced. It works for the whole image in memory
+     */
+    bool checkerboard;
+
+    /*
+     * Blend pixels at edges with their neighbours across the edge after tracing, like FXAA. Edges are found by
+     * contrast of colors, and by figures and depths of hits, if the image is in memory. Rows are written, when
+     * the whole band is traced. Progressive render applies it to the final image, render farm could not use it
+     */
+    bool post_antialiasing;
+
+    /* Print progress messages to stdout */
+    bool verbose;
+};
+
 /**
  * Class, that represents Scene
  */
@@ -57,7 +298,11 @@ class Scene {
 public:
     Scene(const Vector &left_border, const Vector &right_border);
 
-    ~Scene() = default;
+    Scene(const Scene &) = delete;
+    Scene &operator=(const Scene &) = delete;
+
+    /* Scene owns added figures and deletes them */
+    ~Scene();
 
     /**
      * Add light
@@ -66,22 +311,96 @@ public:
     void AddLight(const Vector &point);
 
     /**
-     * Add new figure
+     * Add new figure, the scene takes ownership of it
      * @param d - new figure
      */
     void AddFigure(Figure *d);
 
+    size_t FiguresCount() const { return figures.size(); }
+
+    /**
+     * Move figure, the next incremental render traces the tiles, which rays passed its old or new place
+     * @param index - index of figure in order of adding
+     * @param offset - Vector, that is added to position
+     */
+    void MoveFigure(size_t index, const Vector &offset);
+
+    /* Center of figure */
+    Vector FigurePosition(size_t index) const;
+
+    /**
+     * Move figure to position, like MoveFigure
+     * @param index - index of figure in order of adding
+     * @param position - new center
+     */
+    void PlaceFigure(size_t index, const Vector &position);
+
+    /**
+     * Change color of figure, the next incremental render traces the tiles, which rays hit it
+     * @param index - index of figure in order of adding
+     * @param color - new default color
+     */
+    void SetFigureColor(size_t index, const Pixel &color);
+
+    size_t LightsCount() const { return lights.size(); }
+
+    int ImageWidth() const { return image_width; }
+    int ImageHeight() const { return image_height; }
+
+    /* Pixels, that are traced by render with settings: the whole image or crop window */
+    RenderTile RenderWindow(const RenderSettings &settings) const;
+
+    /* Pixels of the last render, that were taken from the previous one by temporal reprojection */
+    int ReusedPixels() const { return reused_count; }
+
     /**
      * Initialize camera
      * @param camera
+     * @param pixel_width, pixel_height - result image resolution
      */
-    void ConfigureCamera(Camera& camera, int pixel_height, int pixel_width);
+    void ConfigureCamera(Camera& camera, int pixel_width, int pixel_height);
 
     /**
      * Start Trace Racing
      */
     void StartTraceRacing(ArgumentsParser &argumentsParser);
 
+    void StartTraceRacing(const RenderSettings &settings);
+
+    /**
+     * Render image and write every line of tiles to file, as soon as it is traced.
+     * If settings.band_height is set, the image is rendered by horizontal bands of this rows number,
+     * and only one band is stored in memory, so SaveImage can not be used after it
+     * @param settings - settings of render
+     * @param writer - writer of file format
+     * @param filename - path to result file
+     */
+    void StartTraceRacing(const RenderSettings &settings, ImageWriter &writer, const std::string &filename);
+
+    /**
+     * Render image by passes of increasing density, and write preview to file between passes
+     * (look at RenderSettings::progressive). The final image is the same, as StartTraceRacing renders
+     * @param settings - settings of render
+     * @param writer - writer of file format, previews and the final image are written to the same file
+     * @param filename - path to result file
+     */
+    void StartProgressiveTraceRacing(const RenderSettings &settings, ImageWriter &writer, const std::string &filename);
+
+    /**
+     * Trace rectangle of image, it is used by workers of render farm
+     * @param settings - settings of render, crop window and outputs are replaced
+     * @param region - pixels to trace
+     * @param colors - colors of region rows are written here
+     */
+    void TraceRegion(const RenderSettings &settings, const RenderTile &region, std::vector<Color> &colors);
+
+    /**
+     * Hash of figures, materials, lights, camera and settings, that change colors of pixels.
+     * The renders with the same key give the same image
+     * @param settings - settings of render
+     */
+    uint64_t RenderKey(const RenderSettings &settings) const;
+
     /**
      * Save image
      */
@@ -98,6 +417,79 @@ private:
     std::vector<Light> lights;
     std::vector<Figure*> figures;
 
+    /* Hierarchy of lights for sampling, it is rebuilt on first render after AddLight */
+    LightTree light_tree;
+    bool light_tree_dirty;
+
+    /* Shadow rays results, it is cleared on AddLight and AddFigure */
+    LightCache light_cache;
+
+    /* Bounds of figures (with small margin), the same order as figures */
+    std::vector<BoundingBox> figures_bounds;
+
+    /* Settings of current render */
+    RenderSettings settings;
+
+    /* Shadow counters of every thread of current render */
+    std::vector<ShadowStats> shadow_stats;
+
+    /* Rays counters of every thread of current render */
+    std::vector<RayStats> ray_stats;
+
+    /* Checkpoint of current render, it is empty if checkpoints are not used */
+    std::unique_ptr<Checkpoint> checkpoint;
+
+    /* Footprint of tile, that thread traces, the next steps of ray are mostly in voxels of the last one */
+    struct FootprintRecorder {
+        FootprintRecorder() : footprint(nullptr), last_range() {}
+        uint64_t *footprint;
+        int last_range[6];
+    };
+
+    /*
+     * Incremental render: voxels of scene, that rays of every tile passed and hit (look at MarkFootprint),
+     * and the key of view of the render, that recorded them. Bounds of figures moved and recolored since
+     * that render, and the tiles, that are kept from it. Recorders are empty, if nothing is recorded
+     */
+    std::vector<std::vector<uint64_t>> tile_footprints;
+    uint64_t footprints_key;
+    bool footprints_valid;
+    std::vector<BoundingBox> moved_regions;
+    std::vector<BoundingBox> recolored_regions;
+    std::vector<bool> kept_tiles;
+    std::vector<FootprintRecorder> thread_footprints;
+
+    /* Hit of primary ray, that thread traced last, figure is nullptr for miss */
+    struct PrimaryHit {
+        PrimaryHit() : point(), figure(nullptr) {}
+        Vector point;
+        Figure *figure;
+    };
+
+    /*
+     * Temporal reprojection: hit points, figures and colors of pixels of the previous frame, and the keys of its
+     * settings (SettingsKey) and view (ViewKey). Hits of pixels of the current frame and its pixels, that are reused from history.
+     * Thread hits are empty, if nothing is recorded
+     */
+    std::vector<Vector> history_points;
+    std::vector<Figure*> history_figures;
+    std::vector<Color> history_colors;
+    uint64_t history_key;
+    uint64_t history_view_key;
+    bool history_valid;
+    std::vector<Vector> frame_points;
+    std::vector<Figure*> frame_figures;
+    std::vector<uint8_t> reused_pixels;
+    int reused_count;
+
+    /* Color of checkerboard pixels, that are traced by the next render */
+    int checkerboard_parity;
+    std::vector<PrimaryHit> thread_hits;
+
+    /* Tiles are not traced after this time, if has_deadline is set */
+    std::chrono::steady_clock::time_point deadline;
+    bool has_deadline;
+
     /* The borders of scene (left down corner, right up corner) */
     Vector left_border, right_border;
 
@@ -105,9 +497,19 @@ private:
     Camera camera;
     int image_height, image_width;
 
-    /* Pixel matrix */
-    using PixelMatrix = std::vector<std::vector<Pixel>>;
-    PixelMatrix pixel_matrix;
+    /* Projection screen, it is computed by ConfigureCamera (look at the picture at Scene.cpp) */
+    Vector vector_to_screen, screen_up, screen_right;
+    int half_width, half_height;
+
+    /* Pixels, that are traced by current render: the whole image or crop window */
+    RenderTile window;
+
+    /*
+     * Rendered colors, it stores rows starting from buffer_first_row (all rows of window, if image is rendered whole),
+     * and columns of window starting from buffer_first_column
+     */
+    FrameBuffer frame_buffer;
+    int buffer_first_row, buffer_first_column;
 
     /**
      * Find figure, that intersect ray
@@ -132,6 +534,178 @@ private:
      */
     bool FigureIntersectWith(const Vector &source,
                              const Vector &direction);
+    /**
+     * Split rows of render window to tiles
+     * @param tile_size - side of square tile in pixels
+     * @param first_row, last_row - rows [first_row, last_row) to split
+     */
+    std::vector<RenderTile> MakeTiles(int tile_size, int first_row, int last_row) const;
+
+    /**
+     * Mark voxels, that intersect cube around point, in footprint of current tile of thread
+     * @param point - center of cube
+     * @param radius - half of cube side, the figures farther than it did not change the ray
+     */
+    void MarkFootprint(const Vector &point, float radius);
+
+    /* Mark voxels along ray from source to scene border */
+    void MarkFootprintRay(const Vector &source, const Vector &direction);
+
+    /* Mark voxel of hit point, only the color of hit figure is used */
+    void MarkFootprintHit(const Vector &point);
+
+    /**
+     * Choose tiles of recorded render, which footprints do not intersect edited regions
+     * @param tiles - tiles of render window
+     * @param moved - bounds of moved figures before and after moves, they are checked with passed voxels
+     * @param recolored - bounds of recolored figures, they are checked with hit voxels
+     * @return - number of tiles to trace
+     */
+    int KeepCleanTiles(const std::vector<RenderTile> &tiles, const std::vector<BoundingBox> &moved,
+                       const std::vector<BoundingBox> &recolored);
+
+    /**
+     * Project hit points of history by current camera, and put colors of valid ones to frame buffer
+     * @param same_view - camera is the same as of history, so all pixels are valid
+     * @return - number of reused pixels
+     */
+    int ReprojectHistory(bool same_view);
+
+    /**
+     * Interpolate colors of pixels between traced pixels of lattice with step scale, and mark them and
+     * the lattice as reused, so only pixels at edges of figures are traced then
+     * @return - number of pixels, that are left for tracing
+     */
+    int UpsampleLattice(int scale);
+
+    /**
+     * Take pixels of checkerboard, that are not traced and not reprojected, from their neighbours, and mark
+     * them and the traced ones as reused, so only pixels at edges of figures are traced then
+     * @param parity - traced pixels are the ones with (x + y) % 2 == parity
+     * @return - number of pixels, that are left for tracing
+     */
+    int ReconstructCheckerboard(int parity);
+
+    /**
+     * Pixels of frame see the same figure (or nothing), and their hits lie near the tangent plane of the first
+     * one, so colors between them could be interpolated
+     * @param pixels - indices of pixels in window
+     * @param cell - distance between pixels in pixels
+     */
+    bool SameSurface(const size_t *pixels, int count, int cell) const;
+
+    /**
+     * Antialias rows [first_row, last_row) of frame buffer by their colors and hits (look at post_antialiasing),
+     * frame buffer is not changed
+     * @param colors - antialiased rows one after another
+     */
+    void PostAntialiasing(int first_row, int last_row, std::vector<Color> &colors);
+
+    /* Throw, if there is no figure of index */
+    void CheckFigureIndex(size_t index) const;
+
+    /* Hash of resolution, settings, bounds and lights, it is ViewKey without camera */
+    uint64_t SettingsKey(const RenderSettings &settings) const;
+
+    /* Hash of camera, resolution, settings and lights, it is RenderKey without figures */
+    uint64_t ViewKey(const RenderSettings &settings) const;
+
+    /* Remember settings, reset counters and rebuild light structures if needed */
+    void PrepareRender(const RenderSettings &settings);
+
+    /* Resize frame buffer to store rows [first_row, last_row) */
+    void AllocateFrameBuffer(int first_row, int last_row);
+
+    /**
+     * Trace rows [first_row, last_row) by all threads, they must be in frame buffer
+     * @param pass - pixels to trace
+     * @param on_rows_ready - if set, it is called with rows [first, last) of every traced line of tiles,
+     *                        by the thread, that finished the line
+     */
+    void TraceRows(int first_row, int last_row, const RenderPass &pass,
+                   const std::function<void(int, int)> &on_rows_ready = std::function<void(int, int)>());
+
+    /* Pixels of full render, antialiasing is set by settings */
+    RenderPass FullPass() const;
+
+    /**
+     * Passes of progressive render, every pixel is traced by one of them, and then by one antialiasing pass
+     * @param antialiasing - add antialiasing passes
+     */
+    std::vector<RenderPass> ProgressivePasses(bool antialiasing) const;
+
+    /**
+     * Trace pass of progressive render by all threads, the tiles are skipped after deadline
+     * @param tiles - tiles of whole image
+     * @param pass - pixels to trace
+     * @param pass_index - index of pass in passes of render
+     * @param tile_passes - number of traced passes of every tile, it is updated
+     * @return - number of skipped tiles
+     */
+    int TracePass(const std::vector<RenderTile> &tiles, const RenderPass &pass, int pass_index, std::vector<int> &tile_passes);
+
+    /**
+     * Write whole image, that is traced by some passes. The pixel, that is not traced yet,
+     * gets the color of the nearest traced pixel at the left upper side
+     * @param passes - passes of render
+     * @param tile_passes - number of traced passes of every tile (tiles of MakeTiles for whole image)
+     */
+    void WritePreview(ImageWriter &writer, const std::string &filename,
+                      const std::vector<RenderPass> &passes, const std::vector<int> &tile_passes);
+
+    /**
+     * Choose reflections depth and antialiasing for time budget by speed of the first pass (every 64th pixel).
+     * The rays of the first pass are counted by depth, and time of ray is assumed the same at any depth
+     * @param first_pass_seconds - time of the first pass
+     * @param seconds_left - time for the rest passes
+     * @param antialiasing - the result, add antialiasing passes
+     * @return - true, if reflections depth is reduced, so the first pass must be traced again
+     */
+    bool ChooseQuality(double first_pass_seconds, double seconds_left, bool &antialiasing);
+
+    /* Print counters of render */
+    void FinishRender();
+
+
+    /**
+     * Trace pixels of tile and write them to frame buffer
+     * @param tile - pixels to trace
+     * @param pass - only pixels of this pass are traced
+     */
+    void TraceTile(const RenderTile &tile, const RenderPass &pass);
+
+    /**
+     * Direction of ray from camera through point of image
+     * @param x, y - coordinates of point in pixels, could be fractional
+     */
+    Vector PrimaryRayDirection(float x, float y) const;
+
+    /**
+     * Add light of one source to pixel, if the source is visible from point
+     * @param light - index of light source
+     * @param point - point at surface of figure
+     * @param norm - normal to surface at point
+     * @param figure - figure, that contains point
+     * @param weight - multiplier of light (1 / probability for sampled light)
+     * @param pixel - color, to which light is added
+     */
+    void ShadeByLight(int light,
+                      const Vector &point,
+                      const Vector &norm,
+                      Figure *figure,
+                      float weight,
+                      Color &pixel);
+
+    /**
+     * Cheap test, that shadow ray could be occluded: the ray crosses bounds of some figure.
+     * A convex figure, that ray leaves, is not checked
+     * @param source - point at surface of source_figure
+     * @param direction - direction to light, it looks outside of source_figure
+     * @param source_figure - figure, from which ray starts
+     * @return - false, if the ray surely reaches scene border
+     */
+    bool MayBeOccluded(const Vector &source, const Vector &direction, Figure *source_figure);
+
     /**
      * Check, that point is in scene
      * @param point - checking point
@@ -139,10 +713,15 @@ private:
      */
     bool IsPointIntoScene(const Vector &point);
 
-    /*
-     * Return the Color of ray, that run from source in direction
+    /**
+     * Compute the Color of ray, that run from source in direction
+     * @param source - ray source
+     * @param direction - ray direction
+     * @param pixel - the color is written here (background color, if ray intersects nothing)
+     * @param reflect_count - how many times ray could be reflected or refracted yet
+     * @return - true, if ray intersects figure
      */
-    Pixel GetColorOfRay(const Vector &source, const Vector &direction, int reflect_count = MAX_REFLECTIONS);
+    bool GetColorOfRay(const Vector &source, const Vector &direction, Color &pixel, int reflect_count);
 
 };
 
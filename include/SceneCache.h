@@ -0,0 +1,79 @@
+#ifndef MASHGRAPH3_SCENECACHE_H
+#define MASHGRAPH3_SCENECACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "SceneFile.h"
+
+/**
+ * This file defines the cache of parsed scene files. The scene is stored in binary file, which name
+ * is the hash of scene file content, so the changed file gets a new entry. The binary file is mapped
+ * to memory, and figures are created straight from its columns, nothing is parsed or copied.
+ *
+ * The binary file:
+ *     header: SceneCacheHeader
+ *     columns of figures (SoA, look at SceneFigures), every column is aligned to 64 bytes:
+ *         float columns in order of SceneFloatColumn, then byte columns in order of SceneByteColumn
+ *     lights: x y z floats of every light
+ *
+ * The scene has no hierarchy of figures (figures are checked by their bounds), and bounds are
+ * computed by figures faster than they could be read, so only figures and lights are stored.
+ * The file is written to temporary file and renamed, so processes could share the cache.
+ */
+
+#define SCENE_CACHE_VERSION 1
+
+struct SceneCacheHeader {
+    char magic[8];              // "RTSCENE"
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t source_hash;       // hash of scene file content
+    uint64_t file_size;
+    uint64_t figures_count;
+    uint64_t lights_count;
+    float bounds[6];            // bounds_min, bounds_max
+    float camera[13];           // position, direction, up, right, distance
+    uint32_t camera_parts;      // SCENE_CAMERA_* flags
+    uint64_t float_columns_offset[SCENE_FLOAT_COLUMNS];
+    uint64_t byte_columns_offset[SCENE_BYTE_COLUMNS];
+    uint64_t lights_offset;
+};
+
+class SceneCache {
+public:
+    /**
+     * @param directory - directory of binary scenes, it is created if it does not exist
+     */
+    explicit SceneCache(const std::string &directory);
+
+    /**
+     * Build scene of file. The binary scene of cache is used, if it was made from the same content,
+     * otherwise the file is parsed, and its binary scene is written to cache
+     * @param filename - path to scene file
+     * @param camera - camera of command line, it is changed by the camera of file
+     * @param verbose - print hit or miss
+     * @return - scene with figures and lights
+     */
+    std::unique_ptr<Scene> Load(const std::string &filename, Camera &camera, bool verbose);
+
+    /* FNV-1a hash of data */
+    static uint64_t Hash(const void *data, size_t size);
+
+private:
+    /* Path of binary scene of content hash */
+    std::string EntryPath(uint64_t hash) const;
+
+    /**
+     * Map binary scene and build scene of it
+     * @return - scene, or nullptr if the entry is missed or broken
+     */
+    std::unique_ptr<Scene> LoadEntry(const std::string &path, uint64_t hash, Camera &camera);
+
+    /* Write binary scene of description */
+    void StoreEntry(const std::string &path, uint64_t hash, const SceneDescription &description);
+
+    std::string directory;
+};
+
+#endif //MASHGRAPH3_SCENECACHE_H
@@ -0,0 +1,81 @@
+#ifndef MASHGRAPH3_SCENEGENERATOR_H
+#define MASHGRAPH3_SCENEGENERATOR_H
+
+#include <cstdint>
+#include "BaseStructures.h"
+#include "Scene.h"
+
+/**
+ * This file defines the generator of random scenes. It is used for benchmarks, to see
+ * how the render scales with number of figures and lights.
+ *
+ * The generator is deterministic: the same config (and seed) always gives the same scene
+ * on every platform, because it does not use std distributions (their results are
+ * implementation defined).
+ */
+
+/**
+ * Parameters of the generated scene
+ */
+struct SceneGeneratorConfig {
+    SceneGeneratorConfig();
+
+    uint32_t seed;
+
+    int figures_count;
+    int lights_count;
+
+    /* Figures are placed inside this box */
+    Vector region_min, region_max;
+
+    /* Part of region volume, that filled by figures (0..1) */
+    float density;
+
+    /* Part of reflectable and refractable figures (0..1), the rest ones are diffuse */
+    float reflective_fraction;
+    float refractive_fraction;
+
+    /* Relative weights of figures kinds */
+    float sphere_weight, box_weight, torus_weight;
+};
+
+/**
+ * Generator of random scenes
+ */
+class SceneGenerator {
+public:
+    explicit SceneGenerator(const SceneGeneratorConfig &config);
+
+    /**
+     * Add generated figures and lights to scene
+     * @param scene - scene to fill
+     */
+    void Generate(Scene &scene);
+
+    /**
+     * Parse the shape mix string "sphere:box:torus", for example "2:1:1"
+     * @param mix - string with weights
+     * @param config - config, where weights will be written
+     */
+    static void ParseShapeMix(const std::string &mix, SceneGeneratorConfig &config);
+
+private:
+    /* Next random number in [0, 1) */
+    float Random();
+
+    /* Next random number in [a, b) */
+    float Random(float a, float b);
+
+    /* Random point in region */
+    Vector RandomPoint();
+
+    /* Random saturated color */
+    Pixel RandomColor();
+
+    SceneGeneratorConfig config;
+
+    /* xorshift32 state */
+    uint32_t state;
+};
+
+#endif //MASHGRAPH3_SCENEGENERATOR_H
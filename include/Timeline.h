@@ -0,0 +1,99 @@
+#ifndef MASHGRAPH3_TIMELINE_H
+#define MASHGRAPH3_TIMELINE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * This file defines the timeline of render phases. The timeline is written in Chrome trace
+ * format, it could be opened by about:tracing in Chrome or by ui.perfetto.dev
+ *
+ * The usage:
+ *     Timeline::Instance().Enable();
+ *     {
+ *         TimelineSpan span("name");
+ *         ... // the code, that we want to measure
+ *     }
+ *     Timeline::Instance().WriteToFile("trace.json");
+ *
+ * When timeline is disabled TimelineSpan costs only one check of bool.
+ */
+
+/**
+ * Collects spans from all threads
+ */
+class Timeline {
+public:
+    static Timeline &Instance();
+
+    /* Must be called before any span, that we want to record */
+    void Enable();
+
+    bool Enabled() const { return enabled; }
+
+    /**
+     * Record finished span of current thread
+     * @param name - name of span, must be string literal (pointer is stored)
+     * @param category - category of span, must be string literal
+     * @param start - start time in microseconds
+     * @param end - end time in microseconds
+     * @param arg_x, arg_y - optional coordinates (for example tile position), -1 if not set
+     */
+    void AddSpan(const char *name, const char *category, int64_t start, int64_t end, int arg_x, int arg_y);
+
+    /**
+     * Write all recorded spans in Chrome trace JSON format
+     * @param filename - path to result file
+     */
+    void WriteToFile(const std::string &filename);
+
+    /* Microseconds from start of timeline */
+    int64_t Now() const;
+
+private:
+    Timeline();
+
+    struct Span {
+        const char *name;
+        const char *category;
+        int64_t start, end;
+        int arg_x, arg_y;
+    };
+
+    /* Spans of one thread, only the owner thread appends to it */
+    struct ThreadSpans {
+        int thread_id;
+        std::vector<Span> spans;
+    };
+
+    ThreadSpans &CurrentThreadSpans();
+
+    bool enabled;
+    int64_t origin;
+
+    std::mutex threads_mutex;
+    std::vector<ThreadSpans*> threads;
+};
+
+/**
+ * RAII span: starts in constructor, finishes in destructor
+ */
+class TimelineSpan {
+public:
+    explicit TimelineSpan(const char *name, const char *category = "render", int arg_x = -1, int arg_y = -1);
+    ~TimelineSpan();
+
+    TimelineSpan(const TimelineSpan &) = delete;
+    TimelineSpan &operator=(const TimelineSpan &) = delete;
+private:
+    const char *name;
+    const char *category;
+    int arg_x, arg_y;
+
+    /* -1 if timeline is disabled */
+    int64_t start;
+};
+
+#endif //MASHGRAPH3_TIMELINE_H
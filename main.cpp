@@ -1,16 +1,150 @@
 #include <iostream>
+#include <iomanip>
+#include <chrono>
 #include "ArgumentsParser.h"
 #include "Scene.h"
 #include "Figures.h"
+#include "SceneGenerator.h"
+#include "Timeline.h"
+#include "AsyncImageWriter.h"
+#include "RenderFarm.h"
+#include "RenderServer.h"
+#include "SceneFile.h"
+#include "SceneCache.h"
+#include "RenderCache.h"
+#include "Animation.h"
+#include <list>
+#include <map>
+#include <set>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <omp.h>
 
 using std::cout;
 using std::endl;
 
-int main(int argc, char **argv) {
+/* Fill scene by the default hard-coded figures and lights */
+static void BuildDefaultScene(Scene &scene) {
+    /* Create and configure figures */
+    Box *box2 = new Box(Vector(0, 20, 135), Vector(50, 10, 100));
+    box2->MakeReflectable(0.1);
+    box2->DefaultColor(Pixel::Red);
 
-    ArgumentsParser argumentsParser;
+    Box *box3 = new Box(Vector(0, 50, 50), Vector(20, 20, 5));
+    box3->Refractable(0.5, 1.03);
+
+    Sphere *sphere1 = new Sphere(Vector(80, 70, 105), 40);
+    sphere1->MakeReflectable(0.7);
+    sphere1->DefaultColor(Pixel::Green / 4.0f);
+
+    Sphere *sphere3 = new Sphere(Vector(0, 50, 90), 20);
+    sphere3->DefaultColor(Pixel::LightPink);
+
+    Torus *torus1 = new Torus(Vector(50, 40, 60), 15, 3);
+
+    /* Add figures to scene */
+    scene.AddFigure(box2);
+    scene.AddFigure(sphere1);
+    scene.AddFigure(sphere3);
+    scene.AddFigure(box3);
+    scene.AddFigure(torus1);
+
+    /* Add light sources */
+    scene.AddLight(Vector(200, 200, 200));
+    scene.AddLight(Vector(-30, 30, 30));
+    scene.AddLight(Vector(50, 130, 50));
+}
+
+/* Read generator options from command line */
+static SceneGeneratorConfig ReadGeneratorConfig(ArgumentsParser &argumentsParser) {
+    SceneGeneratorConfig config;
+    config.seed = static_cast<uint32_t>(argumentsParser.Get<int>("--seed"));
+    config.figures_count = argumentsParser.Get<int>("--generate-figures");
+    config.lights_count = argumentsParser.Get<int>("--generate-lights");
+    config.density = argumentsParser.Get<float>("--density");
+    config.reflective_fraction = argumentsParser.Get<float>("--reflective-fraction");
+    config.refractive_fraction = argumentsParser.Get<float>("--refractive-fraction");
+    SceneGenerator::ParseShapeMix(argumentsParser.Get<std::string>("--shape-mix"), config);
+    return config;
+}
+
+/* Parse list of positive numbers like "1,2,4" */
+static std::vector<int> ParseIntList(const std::string &list) {
+    std::vector<int> result;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int value = std::atoi(item.c_str());
+        if (value <= 0) {
+            std::stringstream error;
+            error << "Bad list of numbers: " << list;
+            throw std::runtime_error(error.str());
+        }
+        result.push_back(value);
+    }
+    return result;
+}
+
+/*
+ * Render generated scenes with different number of figures and threads,
+ * print the time of one frame for every pair
+ */
+static int RunBenchmark(ArgumentsParser &argumentsParser, Camera &camera) {
+    std::vector<int> figures_list = ParseIntList(argumentsParser.Get<std::string>("--benchmark-figures"));
+    std::vector<int> threads_list = ParseIntList(argumentsParser.Get<std::string>("--benchmark-threads"));
+    int frames = std::max(1, argumentsParser.Get<int>("--benchmark-frames"));
+
+    int image_width = argumentsParser.Get<int>("--image-width");
+    int image_height = argumentsParser.Get<int>("--image-height");
+
+    RenderSettings settings(argumentsParser);
+    settings.verbose = false;
+
+    cout << "Benchmark: " << image_width << "x" << image_height << ", "
+         << frames << " frame(s) per point, seed " << argumentsParser.Get<int>("--seed")
+         << ", lights " << argumentsParser.Get<int>("--generate-lights")
+         << ", light samples " << settings.light_samples << endl;
+    cout << std::setw(10) << "figures" << std::setw(10) << "threads"
+         << std::setw(14) << "ms/frame" << std::setw(10) << "speedup" << endl;
+
+    for (int figures_count : figures_list) {
+        SceneGeneratorConfig config = ReadGeneratorConfig(argumentsParser);
+        config.figures_count = figures_count;
+
+        Scene scene(Vector(-300, -300, -300), Vector(300, 300, 300));
+        scene.ConfigureCamera(camera, image_width, image_height);
+        SceneGenerator(config).Generate(scene);
+
+        /* Speedup is measured relatively to the first threads number of list */
+        double first_ms = 0;
+        for (int threads : threads_list) {
+            settings.threads_number = threads;
+
+            double best_ms = 0;
+            for (int frame = 0; frame < frames; frame++) {
+                auto start = std::chrono::steady_clock::now();
+                scene.StartTraceRacing(settings);
+                auto end = std::chrono::steady_clock::now();
 
+                double ms = std::chrono::duration<double, std::milli>(end - start).count();
+                if (frame == 0 || ms < best_ms)
+                    best_ms = ms;
+            }
+
+            if (first_ms == 0)
+                first_ms = best_ms;
+
+            cout << std::setw(10) << figures_count << std::setw(10) << threads
+                 << std::setw(14) << std::fixed << std::setprecision(1) << best_ms
+                 << std::setw(10) << std::setprecision(2) << first_ms / best_ms << endl;
+        }
+    }
+
+    return 0;
+}
+
+/* Options of command line, they are the same for jobs of server */
+static void ConfigureArguments(ArgumentsParser &argumentsParser) {
     argumentsParser.configure<std::string>("--save-to");
     argumentsParser.configure<int>("--distance-to-camera", 50);
     argumentsParser.configure<int>("--camera-position-z", 10);
@@ -20,76 +154,536 @@ int main(int argc, char **argv) {
     argumentsParser.configure<int>("--threads", 1);
 
     argumentsParser.configure<bool>("--antialiasing");
-    argumentsParser.configure<bool>("--help");
+    argumentsParser.configure<float>("--shadow-threshold", 1.0f);
+    argumentsParser.configure<int>("--light-samples", 0);
+    argumentsParser.configure<float>("--light-cache-cell", 0.0f);
+    argumentsParser.configure<int>("--light-cache-entries", 1 << 22);
 
-    /* Parsing start */
-    argumentsParser.Parse(argv, argc);
+    argumentsParser.configure<int>("--band-height", 0);
+    argumentsParser.configure<bool>("--async-output");
+    argumentsParser.configure<std::string>("--framebuffer-file", "");
+    argumentsParser.configure<bool>("--progressive");
+    argumentsParser.configure<float>("--preview-seconds", 2.0f);
+    argumentsParser.configure<int>("--preview-passes", 0);
+    argumentsParser.configure<int>("--max-reflections", MAX_REFLECTIONS);
+    argumentsParser.configure<float>("--aa-threshold", 0.0f);
+    argumentsParser.configure<float>("--time-budget", 0.0f);
+    argumentsParser.configure<std::string>("--checkpoint", "");
+    argumentsParser.configure<float>("--checkpoint-seconds", 60.0f);
+    argumentsParser.configure<bool>("--resume");
+    argumentsParser.configure<std::string>("--crop", "");
+    argumentsParser.configure<bool>("--crop-full");
+    argumentsParser.configure<bool>("--incremental");
+    argumentsParser.configure<std::string>("--move-figure", "");
+    argumentsParser.configure<std::string>("--figure-color", "");
+    argumentsParser.configure<std::string>("--animation", "");
+    argumentsParser.configure<int>("--frames", 0);
+    argumentsParser.configure<bool>("--temporal");
+    argumentsParser.configure<int>("--preview-scale", 1);
+    argumentsParser.configure<bool>("--checkerboard");
+    argumentsParser.configure<bool>("--post-aa");
+    argumentsParser.configure<int>("--farm-workers", 0);
+    argumentsParser.configure<float>("--farm-timeout", 60.0f);
+    argumentsParser.configure<bool>("--worker");
+    argumentsParser.configure<std::string>("--render-cache", "");
+    argumentsParser.configure<int>("--render-cache-size", 1024);
+    argumentsParser.configure<bool>("--server");
+    argumentsParser.configure<std::string>("--socket", "");
 
-    if (argumentsParser.Get<bool>("--help")) {
-        cout << "This is TraceRay Application" << endl;
-        cout << "Possible arguments:" << endl;
-        cout << "\t--save-to            - /path/to/result/image.bmp" << endl;
-        cout << "\t--distance-to-camera - Distance from camera to projection screen (default: 50)" << endl;
-        cout << "\t--camera-position-z  - Camera Z position (default: 10)" << endl;
-        cout << "\t--image-width        - Width of result image (default: 512)" << endl;
-        cout << "\t--image-height       - Height of result image (default: 512)" << endl;
-        cout << "\t--threads            - Threads number (default: 1)" << endl;
-        cout << "\t--antialiasing       - Enable antialiasing" << endl;
-        cout << "\t--help               - Show this message" << endl;
-        return 0;
-    }
+    argumentsParser.configure<std::string>("--scene", "");
+    argumentsParser.configure<std::string>("--scene-cache", "");
+    argumentsParser.configure<int>("--generate-figures", 0);
+    argumentsParser.configure<int>("--generate-lights", 3);
+    argumentsParser.configure<int>("--seed", 1);
+    argumentsParser.configure<float>("--density", 0.05f);
+    argumentsParser.configure<float>("--reflective-fraction", 0.2f);
+    argumentsParser.configure<float>("--refractive-fraction", 0.0f);
+    argumentsParser.configure<std::string>("--shape-mix", "1:1:1");
 
-    argumentsParser.CheckArguments();
+    argumentsParser.configure<bool>("--benchmark");
+    argumentsParser.configure<std::string>("--benchmark-figures", "10,100,1000");
+    argumentsParser.configure<std::string>("--benchmark-threads", "1,2,4");
+    argumentsParser.configure<int>("--benchmark-frames", 3);
 
-    /* Configure scene */
-    Scene scene(Vector(-300, -300, -300), Vector(300, 300, 300));
+    argumentsParser.configure<std::string>("--timeline", "");
 
-    /* Configure camera */
+    argumentsParser.configure<bool>("--help");
+}
+
+/* Camera of options --camera-position-z and --distance-to-camera */
+static Camera MakeCamera(ArgumentsParser &argumentsParser) {
     Vector camera_position(40, 50, argumentsParser.Get<int>("--camera-position-z"));
     Vector camera_direction(0, 0, 1);
     Vector camera_up(0, -1, 0);
     Vector camera_right(1, 0, 0);
     float distance_to_screen = argumentsParser.Get<int>("--distance-to-camera");
-    Camera camera(camera_position, camera_direction, camera_up, camera_right, distance_to_screen);
+    return Camera(camera_position, camera_direction, camera_up, camera_right, distance_to_screen);
+}
+
+/**
+ * Build scene of file, generator or the default one
+ * @param camera - camera of command line, it is changed by the camera of scene file
+ * @param verbose - print messages of scene cache
+ */
+static std::unique_ptr<Scene> BuildScene(ArgumentsParser &argumentsParser, Camera &camera, bool verbose) {
+    std::string scene_file = argumentsParser.Get<std::string>("--scene");
+    if (!scene_file.empty()) {
+        if (argumentsParser.Get<int>("--generate-figures") > 0)
+            throw std::runtime_error("--scene and --generate-figures could not be used together");
+
+        std::string cache_directory = argumentsParser.Get<std::string>("--scene-cache");
+        if (!cache_directory.empty())
+            return SceneCache(cache_directory).Load(scene_file, camera, verbose);
+
+        SceneDescription description = SceneFile::Load(scene_file, camera);
+        std::unique_ptr<Scene> scene(new Scene(description.bounds_min, description.bounds_max));
+        description.AddTo(*scene);
+        camera = description.camera;
+        return scene;
+    }
+
+    std::unique_ptr<Scene> scene(new Scene(Vector(-300, -300, -300), Vector(300, 300, 300)));
+    if (argumentsParser.Get<int>("--generate-figures") > 0) {
+        SceneGenerator(ReadGeneratorConfig(argumentsParser)).Generate(*scene);
+    } else {
+        BuildDefaultScene(*scene);
+    }
+    return scene;
+}
+
+/* Parse list of edits like "index,a,b,c;index,a,b,c" */
+static std::vector<std::pair<size_t, Vector>> ParseEdits(const std::string &list, const std::string &option) {
+    std::vector<std::pair<size_t, Vector>> edits;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ';')) {
+        if (item.empty())
+            continue;
+
+        int index = -1;
+        float a = 0, b = 0, c = 0;
+        char comma1 = 0, comma2 = 0, comma3 = 0;
+        std::stringstream edit(item);
+        edit >> index >> comma1 >> a >> comma2 >> b >> comma3 >> c;
+        if (edit.fail() || index < 0 || comma1 != ',' || comma2 != ',' || comma3 != ',') {
+            std::stringstream error;
+            error << "Bad edit of " << option << ": " << item << ", expected index and 3 numbers";
+            throw std::runtime_error(error.str());
+        }
+        edits.emplace_back(size_t(index), Vector(a, b, c));
+    }
+    return edits;
+}
+
+/* Apply --move-figure and --figure-color to scene, the incremental render traces only tiles, that saw them */
+static void EditScene(ArgumentsParser &argumentsParser, Scene &scene) {
+    for (auto &edit : ParseEdits(argumentsParser.Get<std::string>("--move-figure"), "--move-figure"))
+        scene.MoveFigure(edit.first, edit.second);
+
+    for (auto &edit : ParseEdits(argumentsParser.Get<std::string>("--figure-color"), "--figure-color")) {
+        const Vector &color = edit.second;
+        scene.SetFigureColor(edit.first, Pixel(uint8_t(color.x), uint8_t(color.y), uint8_t(color.z)));
+    }
+}
+
+/* Options, that define figures and lights of scene, jobs with the same key share the scene */
+static std::string SceneKey(ArgumentsParser &argumentsParser) {
+    std::stringstream ss;
+    ss << argumentsParser.Get<int>("--generate-figures") << " "
+       << argumentsParser.Get<int>("--generate-lights") << " "
+       << argumentsParser.Get<int>("--seed") << " "
+       << argumentsParser.Get<float>("--density") << " "
+       << argumentsParser.Get<float>("--reflective-fraction") << " "
+       << argumentsParser.Get<float>("--refractive-fraction") << " "
+       << argumentsParser.Get<std::string>("--shape-mix");
+
+    /* The scene file could be changed between jobs, and its camera depends on options of camera */
+    std::string scene_file = argumentsParser.Get<std::string>("--scene");
+    if (!scene_file.empty()) {
+        struct stat file_stat = {};
+        stat(scene_file.c_str(), &file_stat);
+        ss << " " << scene_file << " " << file_stat.st_mtime << " " << file_stat.st_size << " "
+           << argumentsParser.Get<int>("--camera-position-z") << " "
+           << argumentsParser.Get<int>("--distance-to-camera");
+    }
+    return ss.str();
+}
+
+/**
+ * Render image of scene with configured camera to --save-to
+ * @param arguments - command line without program name, workers of render farm are started with it
+ */
+static void RenderImage(ArgumentsParser &argumentsParser, Scene &scene, const std::vector<std::string> &arguments,
+                        bool verbose) {
+    RenderSettings settings(argumentsParser);
+    std::string save_to = argumentsParser.Get<std::string>("--save-to");
+
+    /* The image goes to standard output, so messages must not */
+    settings.verbose = verbose && save_to != "-";
+
+    /* Start Trace Racing, the image is written while it is traced */
+    std::unique_ptr<ImageWriter> file_writer = CreateImageWriter(save_to, settings.threads_number);
+    AsyncImageWriter async_writer(*file_writer);
+    ImageWriter &file_or_async_writer = settings.async_output ? static_cast<ImageWriter&>(async_writer) : *file_writer;
+
+    /*
+     * The render with time budget depends on speed, temporal and checkerboard ones depend on the previous render,
+     * and frame buffer file is an output too, so they are not cached
+     */
+    std::string cache_directory = argumentsParser.Get<std::string>("--render-cache");
+    std::unique_ptr<RenderCache> render_cache;
+    uint64_t render_key = 0;
+    if (!cache_directory.empty() && settings.time_budget <= 0 && settings.framebuffer_file.empty() &&
+        !settings.temporal && !settings.checkerboard) {
+        uint64_t size_limit = uint64_t(std::max(0, argumentsParser.Get<int>("--render-cache-size"))) << 20;
+        render_cache.reset(new RenderCache(cache_directory, size_limit, settings.verbose));
+        render_key = scene.RenderKey(settings);
+        if (render_cache->Fetch(render_key, file_or_async_writer, save_to)) {
+            async_writer.Finish();
+            return;
+        }
+    }
+    RecordingImageWriter recorder(file_or_async_writer);
+    ImageWriter &writer = render_cache ? static_cast<ImageWriter&>(recorder) : file_or_async_writer;
+
+    int farm_workers = argumentsParser.Get<int>("--farm-workers");
+    if (farm_workers > 0) {
+        /* Workers trace tiles by full passes, other modes of render would be silently lost */
+        if (settings.progressive || settings.time_budget > 0 || settings.preview_scale > 1 || settings.checkerboard ||
+            settings.post_antialiasing)
+            throw std::runtime_error("--farm-workers could not be used with --progressive, --time-budget, "
+                                     "--preview-scale, --checkerboard and --post-aa");
+
+        /* Workers are started by the same command line, so they build the same scene */
+        std::vector<std::string> command(1, "/proc/self/exe");
+        command.insert(command.end(), arguments.begin(), arguments.end());
+        command.push_back("--worker");
+
+        RenderFarm farm(command, farm_workers, argumentsParser.Get<float>("--farm-timeout"), settings.verbose);
+        farm.Render(scene.ImageWidth(), scene.ImageHeight(), scene.RenderWindow(settings), settings.crop_full_output,
+                    scene.RenderKey(settings), writer, save_to);
+    } else if (settings.progressive || settings.time_budget > 0)
+        scene.StartProgressiveTraceRacing(settings, writer, save_to);
+    else
+        scene.StartTraceRacing(settings, writer, save_to);
+    async_writer.Finish();
+
+    if (render_cache)
+        render_cache->Store(render_key, recorder);
+}
+
+/* Name of frame file: number is added before extension, "-" is standard output for all frames */
+static std::string FrameFileName(const std::string &filename, int frame) {
+    if (filename == "-")
+        return filename;
+
+    std::stringstream number;
+    number << "_" << std::setw(4) << std::setfill('0') << frame;
+
+    size_t dot = filename.rfind('.');
+    if (dot == std::string::npos || filename.find('/', dot) != std::string::npos)
+        return filename + number.str();
+    return filename.substr(0, dot) + number.str() + filename.substr(dot);
+}
+
+/**
+ * Render frames of --animation to numbered files of --save-to. Scene, frame buffer and threads are the
+ * same for all frames, and the frame is written by writer thread while the next one is traced
+ * @param camera - camera of scene, it is changed by camera keyframes
+ */
+static void RenderAnimation(ArgumentsParser &argumentsParser, Scene &scene, const Camera &camera, bool verbose) {
+    if (argumentsParser.Get<int>("--farm-workers") > 0)
+        throw std::runtime_error("--animation could not be used with --farm-workers");
+
+    Animation animation = Animation::Load(argumentsParser.Get<std::string>("--animation"), camera);
+    int frames = argumentsParser.Get<int>("--frames");
+    if (frames <= 0)
+        frames = animation.FramesCount();
+
+    RenderSettings settings(argumentsParser);
+    std::string save_to = argumentsParser.Get<std::string>("--save-to");
+    verbose = verbose && settings.verbose && save_to != "-";
+    settings.verbose = false;
+
+    std::unique_ptr<ImageWriter> file_writer = CreateImageWriter(save_to, settings.threads_number);
+    AsyncImageWriter writer(*file_writer);
 
     int image_width = argumentsParser.Get<int>("--image-width");
     int image_height = argumentsParser.Get<int>("--image-height");
-    scene.ConfigureCamera(camera, image_width, image_height); // 512x512 - размер итоговой картинки
 
-    /* Create and configure figures */
-    Box *box2 = new Box(Vector(0, 20, 135), Vector(50, 10, 100));
-    box2->MakeReflectable(0.1);
-    box2->DefaultColor(Pixel::Red);
+    /* Places of animated figures in scene, and their offsets, that are applied */
+    std::vector<size_t> figures = animation.Figures();
+    std::vector<Vector> positions, offsets(figures.size());
+    for (size_t figure : figures)
+        positions.push_back(scene.FigurePosition(figure));
 
-    Box *box3 = new Box(Vector(0, 50, 50), Vector(20, 20, 5));
-    box3->Refractable(0.5, 1.03);
+    /* Figures are moved back, so the scene of server is the same for the next job */
+    auto move_back = [&]() {
+        for (size_t i = 0; i < figures.size(); i++) {
+            if (offsets[i].x != 0 || offsets[i].y != 0 || offsets[i].z != 0)
+                scene.PlaceFigure(figures[i], positions[i]);
+        }
+    };
 
-    Sphere *sphere1 = new Sphere(Vector(80, 70, 105), 40);
-    sphere1->MakeReflectable(0.7);
-    sphere1->DefaultColor(Pixel::Green / 4.0f);
+    auto start = std::chrono::steady_clock::now();
+    try {
+        for (int frame = 0; frame < frames; frame++) {
+            auto frame_start = std::chrono::steady_clock::now();
 
-    Sphere *sphere3 = new Sphere(Vector(0, 50, 90), 20);
-    sphere3->DefaultColor(Pixel::LightPink);
+            for (size_t i = 0; i < figures.size(); i++) {
+                Vector offset = animation.FigureOffset(figures[i], frame);
+                if (offset.x != offsets[i].x || offset.y != offsets[i].y || offset.z != offsets[i].z) {
+                    scene.PlaceFigure(figures[i], positions[i] + offset);
+                    offsets[i] = offset;
+                }
+            }
 
-    Torus *torus1 = new Torus(Vector(50, 40, 60), 15, 3);
+            Camera frame_camera = animation.CameraAt(frame);
+            scene.ConfigureCamera(frame_camera, image_width, image_height);
 
-    /* Add figures to scene */
-    scene.AddFigure(box2);
-    scene.AddFigure(sphere1);
-    scene.AddFigure(sphere3);
-    scene.AddFigure(box3);
-    scene.AddFigure(torus1);
+            std::string filename = FrameFileName(save_to, frame);
+            if (settings.progressive || settings.time_budget > 0)
+                scene.StartProgressiveTraceRacing(settings, writer, filename);
+            else
+                scene.StartTraceRacing(settings, writer, filename);
 
-    /* Add light sources */
-    scene.AddLight(Vector(200, 200, 200));
-    scene.AddLight(Vector(-30, 30, 30));
-    scene.AddLight(Vector(50, 130, 50));
+            if (verbose) {
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - frame_start;
+                cout << "Frame " << frame + 1 << "/" << frames << ": " << filename << ", "
+                     << std::fixed << std::setprecision(1) << elapsed.count() << " ms";
+                if (settings.temporal || settings.checkerboard)
+                    cout << ", " << scene.ReusedPixels() << " pixels reused";
+                cout << endl;
+            }
+        }
+        writer.Finish();
+    } catch (...) {
+        move_back();
+        throw;
+    }
+    move_back();
+
+    if (verbose) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        cout << "Rendered " << frames << " frames in " << std::fixed << std::setprecision(2) << elapsed.count()
+             << " s, " << std::setprecision(1) << elapsed.count() * 1000.0 / std::max(1, frames) << " ms per frame" << endl;
+    }
+}
+
+/* The number of scenes, that server keeps built */
+#define SERVER_SCENES_COUNT 8
+
+/*
+ * Render jobs of clients. Options of job line are added to options of server,
+ * and scenes are kept between jobs by SceneKey
+ */
+static int RunServer(int argc, char **argv) {
+    /* Options of server are defaults of jobs, except of the server ones */
+    std::vector<std::string> server_arguments;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        if (argument == "--server")
+            continue;
+        if (argument == "--socket") {
+            i++;
+            continue;
+        }
+        server_arguments.push_back(argument);
+    }
+
+    /* Built scenes with the cameras of their files */
+    std::map<std::string, std::pair<std::unique_ptr<Scene>, Camera>> scenes;
+    std::list<std::string> scenes_order;
+
+    /* Scenes, that were edited by jobs, workers of render farm could not build them from command line */
+    std::set<std::string> edited_scenes;
+
+    auto handler = [&](const std::vector<std::string> &job_arguments) {
+        std::vector<std::string> arguments = server_arguments;
+        arguments.insert(arguments.end(), job_arguments.begin(), job_arguments.end());
+
+        std::vector<char*> job_argv(1, argv[0]);
+        for (auto &argument : arguments)
+            job_argv.push_back(const_cast<char*>(argument.c_str()));
+
+        ArgumentsParser argumentsParser;
+        ConfigureArguments(argumentsParser);
+        argumentsParser.Parse(job_argv.data(), int(job_argv.size()));
+        argumentsParser.CheckArguments();
+
+        Camera camera = MakeCamera(argumentsParser);
+
+        /* The least recently used scene is removed */
+        std::string key = SceneKey(argumentsParser);
+        auto it = scenes.find(key);
+        if (it == scenes.end()) {
+            if (scenes.size() >= SERVER_SCENES_COUNT) {
+                scenes.erase(scenes_order.back());
+                edited_scenes.erase(scenes_order.back());
+                scenes_order.pop_back();
+            }
+
+            TimelineSpan span("scene setup", "setup");
+            Camera scene_camera = camera;
+            std::unique_ptr<Scene> scene = BuildScene(argumentsParser, scene_camera, false);
+            it = scenes.emplace(key, std::make_pair(std::move(scene), scene_camera)).first;
+        } else {
+            scenes_order.remove(key);
+        }
+        scenes_order.push_front(key);
+
+        /* Edits are kept by the scene, so clients change it step by step */
+        Scene &scene = *it->second.first;
+        if (edited_scenes.count(key) > 0 && argumentsParser.Get<int>("--farm-workers") > 0)
+            throw std::runtime_error("--farm-workers could not be used with scene edited by previous jobs");
+        EditScene(argumentsParser, scene);
+        if (!argumentsParser.Get<std::string>("--move-figure").empty() ||
+            !argumentsParser.Get<std::string>("--figure-color").empty())
+            edited_scenes.insert(key);
+        if (!argumentsParser.Get<std::string>("--scene").empty())
+            camera = it->second.second;
+        scene.ConfigureCamera(camera,
+                              argumentsParser.Get<int>("--image-width"), argumentsParser.Get<int>("--image-height"));
+        if (!argumentsParser.Get<std::string>("--animation").empty())
+            RenderAnimation(argumentsParser, scene, camera, false);
+        else
+            RenderImage(argumentsParser, scene, arguments, false);
+    };
+
+    RenderServer server(handler);
+
+    ArgumentsParser argumentsParser;
+    ConfigureArguments(argumentsParser);
+    argumentsParser.Parse(argv, argc);
+    server.Run(argumentsParser.Get<std::string>("--socket"));
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    ArgumentsParser argumentsParser;
+    ConfigureArguments(argumentsParser);
+
+    /* Parsing start */
+    argumentsParser.Parse(argv, argc);
+
+    /* Standard output of worker is the channel of render farm, messages go to stderr */
+    int worker_output = -1;
+    if (argumentsParser.Get<bool>("--worker")) {
+        worker_output = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    if (argumentsParser.Get<bool>("--help")) {
+        cout << "This is TraceRay Application" << endl;
+        cout << "Possible arguments:" << endl;
+        cout << "\t--save-to             - /path/to/result/image.bmp, format is chosen by extension: .bmp, .png, .ppm, .pfm," << endl;
+        cout << "\t                        - writes PPM to standard output" << endl;
+        cout << "\t--distance-to-camera  - Distance from camera to projection screen (default: 50)" << endl;
+        cout << "\t--camera-position-z   - Camera Z position (default: 10)" << endl;
+        cout << "\t--image-width         - Width of result image (default: 512)" << endl;
+        cout << "\t--image-height        - Height of result image (default: 512)" << endl;
+        cout << "\t--threads             - Threads number (default: 1)" << endl;
+        cout << "\t--antialiasing        - Enable antialiasing" << endl;
+        cout << "\t--shadow-threshold    - Skip shadow rays of lights, that add less to color channel (default: 1)" << endl;
+        cout << "\t--light-samples       - Lights chosen by importance for every point (default: 0, all lights)" << endl;
+        cout << "\t--light-cache-cell    - Reuse shadow rays in cells of this size, it bounds shadows error (default: 0, off)" << endl;
+        cout << "\t--light-cache-entries - Maximal number of shadow rays in light cache (default: 4194304)" << endl;
+        cout << "\t--band-height         - Render by bands of this rows number and write them at once (default: 0, whole image)" << endl;
+        cout << "\t--async-output        - Encode and write image by separate thread while tracing" << endl;
+        cout << "\t--framebuffer-file    - Map frame buffer to this file with tiles completion bitmap (default: in memory)" << endl;
+        cout << "\t--progressive         - Render by passes of increasing density and write previews to --save-to" << endl;
+        cout << "\t--preview-seconds     - Write preview, if this time passed since the last one (default: 2, 0 - never)" << endl;
+        cout << "\t--preview-passes      - Write preview after every this number of passes (default: 0, never)" << endl;
+        cout << "\t--max-reflections     - Depth of reflections and refractions (default: 5, maximum: 15)" << endl;
+        cout << "\t--aa-threshold        - Trace 4 antialiasing rays only where 2 diagonal ones differ by more (default: 0, always 4)" << endl;
+        cout << "\t--time-budget         - Seconds for render, reflections and antialiasing are chosen to fit (default: 0, no limit)" << endl;
+        cout << "\t--checkpoint          - Write traced tiles to this file periodically, it is removed after render (default: none)" << endl;
+        cout << "\t--checkpoint-seconds  - Period of checkpoint writing (default: 60)" << endl;
+        cout << "\t--resume              - Load tiles from --checkpoint file and trace only the rest" << endl;
+        cout << "\t--crop                - Trace only window x,y,width,height of image and write it (default: whole image)" << endl;
+        cout << "\t--crop-full           - Write image of full size with black pixels outside of --crop window" << endl;
+        cout << "\t--incremental         - Trace again only tiles, which rays passed figures edited since the previous render" << endl;
+        cout << "\t--move-figure         - Move figures before render: index,dx,dy,dz;... (server keeps them moved)" << endl;
+        cout << "\t--figure-color        - Change colors of figures before render: index,r,g,b;..." << endl;
+        cout << "\t--animation           - Render frames of camera and figures keyframes of this file, the format is described at include/Animation.h" << endl;
+        cout << "\t--frames              - Number of frames of --animation (default: 0, till the last keyframe)" << endl;
+        cout << "\t--temporal            - Reuse pixels of the previous frame by reprojection of its hits, trace only the rest" << endl;
+        cout << "\t--preview-scale       - Trace every 2nd, 4th, ... pixel and interpolate the rest, except of edges of figures (default: 1)" << endl;
+        cout << "\t--checkerboard        - Trace half of pixels by turns, take the rest from the previous frame or neighbours" << endl;
+        cout << "\t--post-aa             - Smooth edges of traced image by blending pixels across them (cheaper than --antialiasing)" << endl;
+        cout << "\t--farm-workers        - Trace tiles by this number of worker processes (default: 0, in this process)" << endl;
+        cout << "\t--farm-timeout        - Seconds of worker start or tile, the worker is failed after them (default: 60, 0 - no limit)" << endl;
+        cout << "\t--worker              - Serve tiles of render farm by stdin and stdout (started by coordinator)" << endl;
+        cout << "\t--render-cache        - Directory of rendered images, the same render is written from it (default: none)" << endl;
+        cout << "\t--render-cache-size   - Size limit of render cache in megabytes (default: 1024)" << endl;
+        cout << "\t--server              - Render jobs (lines of options and --priority) from --socket or stdin" << endl;
+        cout << "\t--socket              - Path of Unix domain socket of server (default: stdin and stdout)" << endl;
+        cout << "\t--scene               - Load scene from text file, the format is described at include/SceneFile.h" << endl;
+        cout << "\t--scene-cache         - Directory of parsed scene files, they are mapped instead of parsing (default: none)" << endl;
+        cout << "\t--generate-figures    - Render random scene with this number of figures (default: 0, built-in scene)" << endl;
+        cout << "\t--generate-lights     - Number of lights in random scene (default: 3)" << endl;
+        cout << "\t--seed                - Seed of random scene (default: 1)" << endl;
+        cout << "\t--density             - Part of volume filled by random figures (default: 0.05)" << endl;
+        cout << "\t--reflective-fraction - Part of reflectable random figures (default: 0.2)" << endl;
+        cout << "\t--refractive-fraction - Part of refractable random figures (default: 0)" << endl;
+        cout << "\t--shape-mix           - Weights of sphere:box:torus in random scene (default: 1:1:1)" << endl;
+        cout << "\t--benchmark           - Render random scenes and print time per frame, image is not saved" << endl;
+        cout << "\t--benchmark-figures   - List of figures numbers for benchmark (default: 10,100,1000)" << endl;
+        cout << "\t--benchmark-threads   - List of threads numbers for benchmark (default: 1,2,4)" << endl;
+        cout << "\t--benchmark-frames    - Frames per benchmark point, the best time is printed (default: 3)" << endl;
+        cout << "\t--timeline            - Write timeline of render phases in Chrome trace format to this file" << endl;
+        cout << "\t--help                - Show this message" << endl;
+        return 0;
+    }
+
+    /* Configure camera */
+    Camera camera = MakeCamera(argumentsParser);
+
+    if (argumentsParser.Get<bool>("--benchmark")) {
+        return RunBenchmark(argumentsParser, camera);
+    }
+
+    if (argumentsParser.Get<bool>("--server")) {
+        return RunServer(argc, argv);
+    }
+
+    argumentsParser.CheckArguments();
+
+    std::string timeline_file = argumentsParser.Get<std::string>("--timeline");
+    if (!timeline_file.empty())
+        Timeline::Instance().Enable();
+
+    /* Configure scene */
+    std::unique_ptr<Scene> scene_holder;
+
+    {
+        TimelineSpan span("scene setup", "setup");
+
+        bool verbose = worker_output < 0 && argumentsParser.Get<std::string>("--save-to") != "-";
+        scene_holder = BuildScene(argumentsParser, camera, verbose);
+        EditScene(argumentsParser, *scene_holder);
+
+        int image_width = argumentsParser.Get<int>("--image-width");
+        int image_height = argumentsParser.Get<int>("--image-height");
+        scene_holder->ConfigureCamera(camera, image_width, image_height); // 512x512 - размер итоговой картинки
+    }
+    Scene &scene = *scene_holder;
+
+    if (worker_output >= 0) {
+        RenderSettings settings(argumentsParser);
+        settings.verbose = false;
+        return RenderFarm::RunWorker(scene, settings, STDIN_FILENO, worker_output);
+    }
 
-    /* Start Trace Racing */
-    scene.StartTraceRacing(argumentsParser);
+    if (!argumentsParser.Get<std::string>("--animation").empty())
+        RenderAnimation(argumentsParser, scene, camera, true);
+    else
+        RenderImage(argumentsParser, scene, std::vector<std::string>(argv + 1, argv + argc), true);
 
-    /* Save the result image */
-    scene.SaveImage(argumentsParser.Get<std::string>("--save-to"));
+    if (!timeline_file.empty())
+        Timeline::Instance().WriteToFile(timeline_file);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,255 @@
+#include "Animation.h"
+#include "SceneFile.h"
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+/* Keyframe of camera with SCENE_CAMERA_* flags of the given parts */
+struct CameraKeyframe {
+    CameraKeyframe() : parts(0) {}
+
+    Camera camera;
+    int parts;
+};
+
+/* Line by line parser, the animation file is small, so tokens are read by stream */
+class AnimationParser {
+public:
+    explicit AnimationParser(const std::string &name) : line(0), name(name) {}
+
+    void Parse(const std::string &text, std::map<int, CameraKeyframe> &cameras,
+               std::map<size_t, std::map<int, Vector>> &figures) {
+        std::stringstream lines(text);
+        std::string text_line;
+        while (std::getline(lines, text_line)) {
+            line++;
+
+            size_t comment = text_line.find('#');
+            if (comment != std::string::npos)
+                text_line.resize(comment);
+
+            std::stringstream tokens(text_line);
+            std::string keyword;
+            if (!(tokens >> keyword))
+                continue;
+
+            if (keyword == "camera") {
+                int frame = ReadFrame(tokens);
+                if (cameras.count(frame) > 0)
+                    Error("camera keyframe of this frame is already defined");
+                cameras[frame] = CameraStatement(tokens);
+            } else if (keyword == "figure") {
+                int index = ReadInteger(tokens, "figure index");
+                int frame = ReadFrame(tokens);
+                std::map<int, Vector> &keyframes = figures[size_t(index)];
+                if (keyframes.count(frame) > 0)
+                    Error("keyframe of this figure and frame is already defined");
+                keyframes[frame] = ReadVector(tokens);
+            } else {
+                Error("unknown statement '" + keyword + "'");
+            }
+
+            std::string rest;
+            if (tokens >> rest)
+                Error("unexpected '" + rest + "' at the end of statement");
+        }
+    }
+
+private:
+    CameraKeyframe CameraStatement(std::stringstream &tokens) {
+        CameraKeyframe keyframe;
+        Camera &camera = keyframe.camera;
+
+        std::string key;
+        while (tokens >> key) {
+            if (key == "position") {
+                camera.position = ReadVector(tokens);
+                keyframe.parts |= SCENE_CAMERA_POSITION;
+            } else if (key == "direction") {
+                camera.direction = ReadDirection(tokens, "direction");
+                keyframe.parts |= SCENE_CAMERA_DIRECTION;
+            } else if (key == "up") {
+                camera.up = ReadDirection(tokens, "up");
+                keyframe.parts |= SCENE_CAMERA_UP;
+            } else if (key == "right") {
+                camera.right = ReadDirection(tokens, "right");
+                keyframe.parts |= SCENE_CAMERA_RIGHT;
+            } else if (key == "distance") {
+                camera.distance = ReadNumber(tokens, "distance");
+                if (!(camera.distance > 0))
+                    Error("distance must be positive");
+                keyframe.parts |= SCENE_CAMERA_DISTANCE;
+            } else {
+                Error("unknown camera parameter '" + key + "'");
+            }
+        }
+        return keyframe;
+    }
+
+    int ReadFrame(std::stringstream &tokens) {
+        return ReadInteger(tokens, "frame");
+    }
+
+    int ReadInteger(std::stringstream &tokens, const char *what) {
+        std::string token;
+        tokens >> token;
+
+        std::stringstream number(token);
+        int value = -1;
+        number >> value;
+        if (token.empty() || number.fail() || !number.eof() || value < 0)
+            Error(std::string("expected ") + what + " (non-negative integer), got '" + token + "'");
+        return value;
+    }
+
+    float ReadNumber(std::stringstream &tokens, const char *what) {
+        std::string token;
+        tokens >> token;
+
+        std::stringstream number(token);
+        float value = 0;
+        number >> value;
+        if (token.empty() || number.fail() || !number.eof())
+            Error(std::string("expected ") + what + ", got '" + token + "'");
+        return value;
+    }
+
+    Vector ReadVector(std::stringstream &tokens) {
+        float x = ReadNumber(tokens, "number");
+        float y = ReadNumber(tokens, "number");
+        float z = ReadNumber(tokens, "number");
+        return Vector(x, y, z);
+    }
+
+    /* Directions are normalized, so they must not be zero */
+    Vector ReadDirection(std::stringstream &tokens, const std::string &what) {
+        Vector direction = ReadVector(tokens);
+        if (!(direction.length() > 0))
+            Error(what + " must be a non-zero vector");
+        return direction;
+    }
+
+    void Error(const std::string &message) {
+        std::stringstream ss;
+        ss << name << ":" << line << ": " << message;
+        throw std::runtime_error(ss.str());
+    }
+
+    int line;
+    std::string name;
+};
+
+Animation::Animation(const Camera &camera) : scene_camera(camera) {}
+
+Animation Animation::Load(const std::string &filename, const Camera &camera) {
+    std::vector<char> text = SceneFile::Read(filename);
+    return Parse(std::string(text.begin(), text.end()), filename, camera);
+}
+
+Animation Animation::Parse(const std::string &text, const std::string &name, const Camera &camera) {
+    std::map<int, CameraKeyframe> cameras;
+    Animation animation(camera);
+    AnimationParser(name).Parse(text, cameras, animation.figure_keyframes);
+
+    /* The parts, that are not given, are kept from the previous keyframe */
+    Camera previous = camera;
+    for (auto &keyframe : cameras) {
+        SceneFile::ApplyCamera(keyframe.second.camera, keyframe.second.parts, previous);
+        animation.camera_keyframes[keyframe.first] = previous;
+    }
+    return animation;
+}
+
+int Animation::FramesCount() const {
+    int last = 0;
+    if (!camera_keyframes.empty())
+        last = camera_keyframes.rbegin()->first;
+    for (auto &figure : figure_keyframes)
+        last = std::max(last, figure.second.rbegin()->first);
+    return last + 1;
+}
+
+/**
+ * Keyframes around frame: the last one before it or at it, and the first one after it
+ * @return - false, if frame is before the first keyframe or at/after the last one, 'from' is the nearest keyframe then
+ */
+template <class T>
+static bool KeyframesAround(const std::map<int, T> &keyframes, int frame,
+                            typename std::map<int, T>::const_iterator &from,
+                            typename std::map<int, T>::const_iterator &to) {
+    to = keyframes.upper_bound(frame);
+    if (to == keyframes.begin()) {
+        from = to;
+        return false;
+    }
+    from = std::prev(to);
+    return to != keyframes.end();
+}
+
+static Vector Lerp(const Vector &a, const Vector &b, float t) {
+    return a + (b - a) * t;
+}
+
+static Vector LerpDirection(const Vector &a, const Vector &b, float t) {
+    Vector result = Lerp(a, b, t);
+    result.normalize();
+    return result;
+}
+
+Camera Animation::CameraAt(int frame) const {
+    if (camera_keyframes.empty())
+        return scene_camera;
+
+    std::map<int, Camera>::const_iterator from, to;
+    if (!KeyframesAround(camera_keyframes, frame, from, to) || from->first == frame)
+        return from->second;
+
+    const Camera &a = from->second, &b = to->second;
+    float t0 = float(from->first), t1 = float(to->first);
+    float s = (float(frame) - t0) / (t1 - t0);
+
+    /* Tangents of Catmull-Rom spline by neighbour keyframes, one-sided at the ends of path */
+    std::map<int, Camera>::const_iterator before = from, after = std::next(to);
+    if (from != camera_keyframes.begin())
+        before = std::prev(from);
+    if (after == camera_keyframes.end())
+        after = to;
+    Vector tangent_a = (b.position - before->second.position) / (t1 - float(before->first));
+    Vector tangent_b = (after->second.position - a.position) / (float(after->first) - t0);
+
+    /* Cubic Hermite basis, h00 = 1 - h01, so the camera between equal keyframes stands exactly still */
+    float s2 = s * s, s3 = s2 * s;
+    float h10 = s3 - 2 * s2 + s;
+    float h01 = -2 * s3 + 3 * s2;
+    float h11 = s3 - s2;
+
+    Camera camera;
+    camera.position = a.position + (b.position - a.position) * h01 + tangent_a * (h10 * (t1 - t0)) +
+                      tangent_b * (h11 * (t1 - t0));
+    camera.direction = LerpDirection(a.direction, b.direction, s);
+    camera.up = LerpDirection(a.up, b.up, s);
+    camera.right = LerpDirection(a.right, b.right, s);
+    camera.distance = a.distance + (b.distance - a.distance) * s;
+    return camera;
+}
+
+std::vector<size_t> Animation::Figures() const {
+    std::vector<size_t> figures;
+    for (auto &figure : figure_keyframes)
+        figures.push_back(figure.first);
+    return figures;
+}
+
+Vector Animation::FigureOffset(size_t figure, int frame) const {
+    auto it = figure_keyframes.find(figure);
+    if (it == figure_keyframes.end())
+        return Vector();
+
+    std::map<int, Vector>::const_iterator from, to;
+    if (!KeyframesAround(it->second, frame, from, to))
+        return from->second;
+
+    float s = float(frame - from->first) / float(to->first - from->first);
+    return Lerp(from->second, to->second, s);
+}
@@ -9,6 +9,7 @@ IntValue::~IntValue() {
 }
 
 int IntValue::SetData(char **args_list, int current_index) {
+    delete (int*)_data;
     _data = new int;
     sscanf(args_list[current_index + 1], "%d", (int*)_data);
     _stored = true;
@@ -21,6 +22,28 @@ void IntValue::SetDefault(int default_value, bool has_default_arg) {
         _stored = true;
 }
 
+/* FloatValue implementation */
+
+FloatValue::FloatValue() : BaseImplValue() {}
+
+FloatValue::~FloatValue() {
+    delete (float*)_data;
+}
+
+int FloatValue::SetData(char **args_list, int current_index) {
+    delete (float*)_data;
+    _data = new float;
+    sscanf(args_list[current_index + 1], "%f", (float*)_data);
+    _stored = true;
+    return current_index + 2;
+}
+
+void FloatValue::SetDefault(float default_value, bool has_default_arg) {
+    _data = new float(default_value);
+    if (has_default_arg)
+        _stored = true;
+}
+
 /* StringValue implementation */
 
 StringValue::~StringValue() {
@@ -28,6 +51,7 @@ StringValue::~StringValue() {
 }
 
 int StringValue::SetData(char **args_list, int current_index) {
+    delete (std::string*)_data;
     _data = new std::string(args_list[current_index + 1]);
     _stored = true;
     return current_index + 2;
@@ -60,6 +84,11 @@ void BoolValue::SetDefault(bool default_value, bool has_default_arg) {
         _stored = true;
 }
 
+ArgumentsParser::~ArgumentsParser() {
+    for (auto &it : _args)
+        delete it.second;
+}
+
 void ArgumentsParser::Parse(char **argv, int argc) {
     for (int i = 1; i < argc;) {
         std::string arg = std::string(argv[i]);
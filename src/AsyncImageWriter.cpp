@@ -0,0 +1,141 @@
+#include "AsyncImageWriter.h"
+#include "Timeline.h"
+
+AsyncImageWriter::AsyncImageWriter(ImageWriter &writer, size_t max_queued_rows) :
+    writer(writer),
+    max_queued_rows(std::max<size_t>(1, max_queued_rows)),
+    width(0),
+    queued_rows(0),
+    busy(false),
+    stop(false)
+{}
+
+AsyncImageWriter::~AsyncImageWriter() {
+    try {
+        Finish();
+    } catch (const std::exception &) {
+        /* Destructor must not throw, the error was reported to nobody */
+    }
+
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        queue_changed.notify_all();
+        thread.join();
+    }
+}
+
+void AsyncImageWriter::Open(const std::string &filename, int width, int height) {
+    if (!thread.joinable())
+        thread = std::thread(&AsyncImageWriter::Run, this);
+
+    /* Do not start the next image, if one of previous could not be written */
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    this->width = width;
+
+    Job job;
+    job.type = Job::OPEN;
+    job.filename = filename;
+    job.width = width;
+    job.height = height;
+    Push(std::move(job));
+}
+
+void AsyncImageWriter::WriteRow(int y, const Color *row) {
+    Job job;
+    job.type = Job::ROW;
+    job.y = y;
+    job.row.assign(row, row + width);
+    Push(std::move(job));
+}
+
+void AsyncImageWriter::Close() {
+    Job job;
+    job.type = Job::CLOSE;
+    Push(std::move(job));
+}
+
+void AsyncImageWriter::Push(Job &&job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (job.type == Job::ROW) {
+        /* Do not let the queue grow without limit, if writing is slower than tracing */
+        queue_changed.wait(lock, [this] { return queued_rows < max_queued_rows; });
+        queued_rows++;
+    }
+    queue.push_back(std::move(job));
+    queue_changed.notify_all();
+}
+
+void AsyncImageWriter::Finish() {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue_changed.wait(lock, [this] { return queue.empty() && !busy; });
+
+    if (error) {
+        std::exception_ptr result = error;
+        error = nullptr;
+        std::rethrow_exception(result);
+    }
+}
+
+void AsyncImageWriter::Run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        queue_changed.wait(lock, [this] { return stop || !queue.empty(); });
+        if (queue.empty())
+            return;
+
+        /* Take all queued jobs at once, and process them without lock */
+        std::deque<Job> jobs;
+        jobs.swap(queue);
+        busy = true;
+        lock.unlock();
+
+        {
+            TimelineSpan span("write rows", "output");
+            for (auto &job : jobs) {
+                try {
+                    /*
+                     * After error the rest jobs are skipped, the error is thrown by the next Open or Finish.
+                     * The file is still closed, so failed images do not leave their descriptors
+                     */
+                    if (error) {
+                        if (job.type == Job::CLOSE)
+                            writer.Close();
+                        continue;
+                    }
+
+                    switch (job.type) {
+                        case Job::OPEN:
+                            writer.Open(job.filename, job.width, job.height);
+                            break;
+                        case Job::ROW:
+                            writer.WriteRow(job.y, job.row.data());
+                            break;
+                        case Job::CLOSE:
+                            writer.Close();
+                            break;
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> error_lock(mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+            }
+        }
+
+        lock.lock();
+        for (auto &job : jobs) {
+            if (job.type == Job::ROW)
+                queued_rows--;
+        }
+        busy = false;
+        queue_changed.notify_all();
+    }
+}
@@ -1,5 +1,6 @@
 #include "BaseStructures.h"
 #include <cmath>
+#include <algorithm>
 
 Pixel Pixel::Red = Pixel(255, 0, 0);
 Pixel Pixel::Green = Pixel(0, 255, 0);
@@ -58,26 +59,57 @@ Vector Vector::operator-() const {
 }
 
 Vector Vector::refract(const Vector &ray, Vector norm, float eta) {
-    bool need_reflect = false;
     float cos_alpha = ray.GetCosAngleWith(norm);
     if (cos_alpha > 0) {
         norm = -norm;
     }
     cos_alpha = std::abs(cos_alpha);
 
-    float sin_alpha = std::sqrt(1 - cos_alpha * cos_alpha);
-
-    float sin_beta = eta * sin_alpha;
-
-    Vector a = ray * eta;
-    Vector b = norm * (eta * cos_alpha - std::sqrt(1 - sin_beta * sin_beta));
-
     Vector a1 = (ray + norm * cos_alpha) * eta;
     Vector b1 = norm * -std::sqrt(1 - a1.length() * a1.length());
 
     return a1 + b1;
 }
 
+/* BoundingBox implementation */
+
+BoundingBox BoundingBox::Expand(float margin) const {
+    Vector shift(margin, margin, margin);
+    return BoundingBox(min - shift, max + shift);
+}
+
+bool BoundingBox::IntersectRay(const Vector &source, const Vector &direction, float max_distance) const {
+    float t_near = 0;
+    float t_far = max_distance;
+
+    const float source_axis[3] = {source.x, source.y, source.z};
+    const float direction_axis[3] = {direction.x, direction.y, direction.z};
+    const float min_axis[3] = {min.x, min.y, min.z};
+    const float max_axis[3] = {max.x, max.y, max.z};
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (std::abs(direction_axis[axis]) < 1e-20) {
+            /* Ray is parallel to slab, it must start between planes */
+            if (source_axis[axis] < min_axis[axis] || source_axis[axis] > max_axis[axis])
+                return false;
+            continue;
+        }
+
+        float inverse = 1.0f / direction_axis[axis];
+        float t1 = (min_axis[axis] - source_axis[axis]) * inverse;
+        float t2 = (max_axis[axis] - source_axis[axis]) * inverse;
+        if (t1 > t2)
+            std::swap(t1, t2);
+
+        t_near = std::max(t_near, t1);
+        t_far = std::min(t_far, t2);
+        if (t_near > t_far)
+            return false;
+    }
+
+    return true;
+}
+
 /* Pixel implementation */
 
 Pixel::Pixel() {
@@ -109,6 +141,8 @@ Pixel &Pixel::operator+=(const Pixel &pixel) {
     value.Red = red;
     value.Green = green;
     value.Blue = blue;
+
+    return *this;
 }
 
 bool Pixel::operator==(const Pixel &pixel) {
@@ -0,0 +1,251 @@
+#include "Checkpoint.h"
+#include "Deflate.h"
+#include "Scene.h"
+#include "Timeline.h"
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+#define CHECKPOINT_VERSION 1
+
+namespace {
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t tiles_count;
+    uint64_t render_key;
+};
+
+struct RecordHeader {
+    uint32_t tile;
+    uint32_t floats_count;
+};
+
+void ThrowCheckpointError(const std::string &message, const std::string &filename) {
+    std::stringstream ss;
+    ss << message << ": " << filename;
+    throw std::runtime_error(ss.str());
+}
+
+/* Read exactly size bytes, false at the end of file */
+bool ReadAll(int fd, void *data, size_t size) {
+    uint8_t *bytes = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        ssize_t result = read(fd, bytes, size);
+        if (result <= 0)
+            return false;
+        bytes += result;
+        size -= result;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        ssize_t result = write(fd, bytes, size);
+        if (result <= 0)
+            return false;
+        bytes += result;
+        size -= result;
+    }
+    return true;
+}
+
+} // namespace
+
+Checkpoint::Checkpoint(const std::string &filename, float interval_seconds) :
+    filename(filename),
+    interval_seconds(interval_seconds),
+    buffer(nullptr),
+    fd(-1),
+    stop(false)
+{}
+
+Checkpoint::~Checkpoint() {
+    Stop();
+    if (fd >= 0)
+        close(fd);
+}
+
+int Checkpoint::Start(FrameBuffer &buffer, const std::vector<RenderTile> &tiles, uint64_t render_key, bool resume) {
+    this->buffer = &buffer;
+    this->tiles = tiles;
+
+    restored.assign(tiles.size(), false);
+    written.assign(tiles.size(), false);
+    done.reset(new std::atomic<uint8_t>[tiles.size()]);
+    for (size_t i = 0; i < tiles.size(); i++)
+        done[i] = 0;
+
+    uint64_t valid_size = resume ? Load(render_key) : 0;
+
+    int loaded = 0;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        if (restored[i]) {
+            written[i] = true;
+            loaded++;
+        }
+    }
+
+    if (valid_size > 0) {
+        /* Continue the log after the last complete record */
+        fd = open(filename.c_str(), O_WRONLY);
+        if (fd < 0 || ftruncate(fd, off_t(valid_size)) != 0 || lseek(fd, off_t(valid_size), SEEK_SET) < 0)
+            ThrowCheckpointError("Error open checkpoint", filename);
+    } else {
+        fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            ThrowCheckpointError("Error create checkpoint", filename);
+
+        CheckpointHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "RTCHECK", 8);
+        header.version = CHECKPOINT_VERSION;
+        header.width = uint32_t(buffer.Width());
+        header.height = uint32_t(buffer.Height());
+        header.tiles_count = uint32_t(tiles.size());
+        header.render_key = render_key;
+        if (!WriteAll(fd, &header, sizeof(header)))
+            ThrowCheckpointError("Error write checkpoint", filename);
+    }
+
+    stop = false;
+    thread = std::thread(&Checkpoint::Run, this);
+
+    return loaded;
+}
+
+uint64_t Checkpoint::Load(uint64_t render_key) {
+    TimelineSpan span("load checkpoint", "setup");
+
+    int input = open(filename.c_str(), O_RDONLY);
+    if (input < 0)
+        return 0;
+
+    CheckpointHeader header;
+    if (!ReadAll(input, &header, sizeof(header)) ||
+        memcmp(header.magic, "RTCHECK", 8) != 0 ||
+        header.version != CHECKPOINT_VERSION ||
+        header.width != uint32_t(buffer->Width()) ||
+        header.height != uint32_t(buffer->Height()) ||
+        header.tiles_count != uint32_t(tiles.size())) {
+        close(input);
+        ThrowCheckpointError("Checkpoint is not of this image", filename);
+    }
+
+    if (header.render_key != render_key) {
+        close(input);
+        ThrowCheckpointError("Checkpoint is made with other scene or settings", filename);
+    }
+
+    uint64_t valid_size = sizeof(header);
+    std::vector<float> floats;
+    while (true) {
+        RecordHeader record;
+        if (!ReadAll(input, &record, sizeof(record)) || record.tile >= tiles.size())
+            break;
+
+        const RenderTile &tile = tiles[record.tile];
+        int width = tile.x1 - tile.x0;
+        if (record.floats_count != uint32_t(3 * width * (tile.y1 - tile.y0)))
+            break;
+
+        floats.resize(record.floats_count);
+        uint32_t crc;
+        size_t floats_size = floats.size() * sizeof(float);
+        if (!ReadAll(input, floats.data(), floats_size) || !ReadAll(input, &crc, sizeof(crc)))
+            break;
+        if (crc != Deflate::Crc32(0, reinterpret_cast<const uint8_t*>(floats.data()), floats_size))
+            break;
+
+        for (int y = tile.y0; y < tile.y1; y++) {
+            const float *source = &floats[3 * width * (y - tile.y0)];
+            memcpy(reinterpret_cast<float*>(&buffer->At(tile.x0, y)), source, 3 * width * sizeof(float));
+        }
+        restored[record.tile] = true;
+        valid_size += sizeof(record) + floats_size + sizeof(crc);
+    }
+
+    close(input);
+    return valid_size;
+}
+
+void Checkpoint::WriteDoneTiles() {
+    TimelineSpan span("write checkpoint", "output");
+
+    std::vector<float> floats;
+    bool any = false;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        /* Colors of tile are final, when its flag is set */
+        if (written[i] || done[i].load(std::memory_order_acquire) == 0)
+            continue;
+
+        const RenderTile &tile = tiles[i];
+        int width = tile.x1 - tile.x0;
+        floats.resize(size_t(3) * width * (tile.y1 - tile.y0));
+        for (int y = tile.y0; y < tile.y1; y++)
+            memcpy(&floats[3 * width * (y - tile.y0)], &buffer->At(tile.x0, y), 3 * width * sizeof(float));
+
+        RecordHeader record;
+        record.tile = uint32_t(i);
+        record.floats_count = uint32_t(floats.size());
+        size_t floats_size = floats.size() * sizeof(float);
+        uint32_t crc = Deflate::Crc32(0, reinterpret_cast<const uint8_t*>(floats.data()), floats_size);
+
+        if (!WriteAll(fd, &record, sizeof(record)) ||
+            !WriteAll(fd, floats.data(), floats_size) ||
+            !WriteAll(fd, &crc, sizeof(crc)))
+            ThrowCheckpointError("Error write checkpoint", filename);
+
+        written[i] = true;
+        any = true;
+    }
+
+    if (any)
+        fdatasync(fd);
+}
+
+void Checkpoint::Run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop) {
+        stop_changed.wait_for(lock, std::chrono::duration<float>(interval_seconds), [this] { return stop; });
+
+        lock.unlock();
+        try {
+            WriteDoneTiles();
+        } catch (const std::exception &e) {
+            /* The render continues without checkpoints */
+            std::cerr << e.what() << std::endl;
+            lock.lock();
+            return;
+        }
+        lock.lock();
+    }
+}
+
+void Checkpoint::Stop() {
+    if (!thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    stop_changed.notify_all();
+    thread.join();
+}
+
+void Checkpoint::Finish() {
+    Stop();
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    unlink(filename.c_str());
+}
@@ -0,0 +1,229 @@
+#include "Deflate.h"
+#include <algorithm>
+#include <cstring>
+
+namespace Deflate {
+
+/* Size of LZ77 window and of hash table */
+#define WINDOW_SIZE 32768
+#define HASH_BITS 15
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+
+/* How many previous positions with the same hash are checked */
+#define MAX_CHAIN 32
+
+static const int LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const int LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const int DISTANCE_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+    4097, 6145, 8193, 12289, 16385, 24577
+};
+static const int DISTANCE_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Writer of bits, deflate puts bits from the lowest */
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t> &out) : out(out), buffer(0), count(0) {}
+
+    void Put(uint32_t value, int bits) {
+        buffer |= uint64_t(value) << count;
+        count += bits;
+        while (count >= 8) {
+            out.push_back(uint8_t(buffer));
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    /* Huffman codes are written from the highest bit */
+    void PutCode(uint32_t code, int bits) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < bits; i++) {
+            reversed = (reversed << 1) | ((code >> i) & 1);
+        }
+        Put(reversed, bits);
+    }
+
+    void AlignToByte() {
+        if (count > 0)
+            Put(0, 8 - count);
+    }
+
+private:
+    std::vector<uint8_t> &out;
+    uint64_t buffer;
+    int count;
+};
+
+/* Fixed Huffman code of literal or length symbol */
+static void PutLiteralSymbol(BitWriter &writer, int symbol) {
+    if (symbol < 144)
+        writer.PutCode(0x30 + symbol, 8);
+    else if (symbol < 256)
+        writer.PutCode(0x190 + symbol - 144, 9);
+    else if (symbol < 280)
+        writer.PutCode(symbol - 256, 7);
+    else
+        writer.PutCode(0xC0 + symbol - 280, 8);
+}
+
+static void PutMatch(BitWriter &writer, int length, int distance) {
+    int length_code = 28;
+    while (LENGTH_BASE[length_code] > length)
+        length_code--;
+    PutLiteralSymbol(writer, 257 + length_code);
+    writer.Put(length - LENGTH_BASE[length_code], LENGTH_EXTRA[length_code]);
+
+    int distance_code = 29;
+    while (DISTANCE_BASE[distance_code] > distance)
+        distance_code--;
+    writer.PutCode(distance_code, 5);
+    writer.Put(distance - DISTANCE_BASE[distance_code], DISTANCE_EXTRA[distance_code]);
+}
+
+static uint32_t Hash(const uint8_t *data) {
+    uint32_t value = uint32_t(data[0]) << 16 | uint32_t(data[1]) << 8 | data[2];
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+void DeflateBlock(const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+    BitWriter writer(out);
+
+    /* Not final block with fixed codes */
+    writer.Put(0, 1);
+    writer.Put(1, 2);
+
+    /* Last position of every hash, and previous position with the same hash in window */
+    std::vector<int64_t> head(size_t(1) << HASH_BITS, -1);
+    std::vector<int64_t> previous(WINDOW_SIZE, -1);
+
+    size_t position = 0;
+    while (position < size) {
+        int best_length = 0;
+        int best_distance = 0;
+
+        if (position + MIN_MATCH <= size) {
+            uint32_t hash = Hash(data + position);
+            int max_length = int(std::min<size_t>(MAX_MATCH, size - position));
+
+            int64_t candidate = head[hash];
+            for (int chain = 0; chain < MAX_CHAIN && candidate >= 0; chain++) {
+                int64_t distance = int64_t(position) - candidate;
+                if (distance > WINDOW_SIZE)
+                    break;
+
+                int length = 0;
+                while (length < max_length && data[candidate + length] == data[position + length])
+                    length++;
+
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = int(distance);
+                    if (length == max_length)
+                        break;
+                }
+
+                candidate = previous[candidate % WINDOW_SIZE];
+            }
+        }
+
+        int step;
+        if (best_length >= MIN_MATCH) {
+            PutMatch(writer, best_length, best_distance);
+            step = best_length;
+        } else {
+            PutLiteralSymbol(writer, data[position]);
+            step = 1;
+        }
+
+        /* Insert all passed positions to hash chains */
+        for (int i = 0; i < step; i++, position++) {
+            if (position + MIN_MATCH <= size) {
+                uint32_t hash = Hash(data + position);
+                previous[position % WINDOW_SIZE] = head[hash];
+                head[hash] = int64_t(position);
+            }
+        }
+    }
+
+    /* End of block */
+    PutLiteralSymbol(writer, 256);
+
+    /* Empty stored block moves the stream to byte border */
+    writer.Put(0, 3);
+    writer.AlignToByte();
+    const uint8_t empty_stored[4] = {0x00, 0x00, 0xFF, 0xFF};
+    out.insert(out.end(), empty_stored, empty_stored + 4);
+}
+
+void DeflateFinish(std::vector<uint8_t> &out) {
+    /* Final empty stored block */
+    const uint8_t final_block[5] = {0x01, 0x00, 0x00, 0xFF, 0xFF};
+    out.insert(out.end(), final_block, final_block + 5);
+}
+
+#define ADLER_BASE 65521u
+
+uint32_t Adler32(uint32_t adler, const uint8_t *data, size_t size) {
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+
+    while (size > 0) {
+        /* 5552 bytes could be summed without overflow */
+        size_t chunk = std::min<size_t>(size, 5552);
+        size -= chunk;
+        for (size_t i = 0; i < chunk; i++) {
+            a += data[i];
+            b += a;
+        }
+        data += chunk;
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+
+    return b << 16 | a;
+}
+
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2) {
+    uint32_t remainder = uint32_t(size2 % ADLER_BASE);
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = uint32_t((uint64_t(remainder) * sum1) % ADLER_BASE);
+
+    sum1 += (adler2 & 0xFFFF) + ADLER_BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - remainder;
+
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum2 >= 2 * ADLER_BASE) sum2 -= 2 * ADLER_BASE;
+    if (sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+
+    return sum2 << 16 | sum1;
+}
+
+uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t size) {
+    static uint32_t table[256];
+    static bool table_ready = [] {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        return true;
+    }();
+    (void)table_ready;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+} // namespace Deflate
@@ -22,13 +22,17 @@ Vector FigureBaseImpl::normal(const Vector &point) {
     return result;
 }
 
+bool FigureBaseImpl::IsConvex() {
+    return false;
+}
+
 void FigureBaseImpl::MakeReflectable(float k) {
     reflect = true;
     reflect_k = k;
 }
 
 FigureBaseImpl::FigureBaseImpl():
-    reflect(false), default_color(Pixel::Gray), reflect_k(0), refract(false), refract_k(0), refract_eta(0) {}
+    reflect(false), reflect_k(0), refract(false), refract_eta(0), refract_k(0), default_color(Pixel::Gray) {}
 
 void FigureBaseImpl::DefaultColor(const Pixel &pixel) {
     default_color = pixel;
@@ -78,6 +82,23 @@ float Sphere::distance(const Vector &point) {
     ) - radius;
 }
 
+BoundingBox Sphere::Bounds() {
+    Vector shift(radius, radius, radius);
+    return BoundingBox(center - shift, center + shift);
+}
+
+Vector Sphere::Position() {
+    return center;
+}
+
+void Sphere::MoveTo(const Vector &position) {
+    center = position;
+}
+
+bool Sphere::IsConvex() {
+    return true;
+}
+
 /* Box implementation */
 
 Box::Box() : center(), radius() {}
@@ -118,17 +139,29 @@ Vector Box::normal(const Vector &point) {
         center.y - point.y - radius.y
     ));
 
-    float z = std::abs(std::max(
-        point.z - center.z - radius.z,
-        center.z - point.z - radius.z
-    ));
-
+    /* The normal looks outside of box */
     if (x < EPS)
-        return Vector(1, 0, 0);
+        return Vector(point.x > center.x ? 1 : -1, 0, 0);
     if (y < EPS)
-        return Vector(0, 1, 0);
+        return Vector(0, point.y > center.y ? 1 : -1, 0);
+
+    return Vector(0, 0, point.z > center.z ? 1 : -1);
+}
+
+BoundingBox Box::Bounds() {
+    return BoundingBox(center - radius, center + radius);
+}
+
+Vector Box::Position() {
+    return center;
+}
 
-    return Vector(0, 0, 1);
+void Box::MoveTo(const Vector &position) {
+    center = position;
+}
+
+bool Box::IsConvex() {
+    return true;
 }
 
 /* Torus implementation */
@@ -147,4 +180,15 @@ float Torus::distance(const Vector &point) {
     return std::sqrt((k - R) * (k - R) + p_y * p_y) - r;
 }
 
+BoundingBox Torus::Bounds() {
+    Vector shift(R + r, r, R + r);
+    return BoundingBox(center - shift, center + shift);
+}
+
+Vector Torus::Position() {
+    return center;
+}
 
+void Torus::MoveTo(const Vector &position) {
+    center = position;
+}
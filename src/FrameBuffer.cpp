@@ -0,0 +1,173 @@
+#include "FrameBuffer.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CACHE_LINE_SIZE 64
+
+#define FRAME_FILE_VERSION 1
+
+/* States of mapped image */
+#define FRAME_STATE_COMPLETE 1
+#define FRAME_STATE_STOPPED 2
+
+/* Pixels start at page border, so rows are aligned to cache lines in memory of every process */
+#define FRAME_FILE_ALIGNMENT 4096
+
+FrameBuffer::FrameBuffer() :
+    width(0),
+    height(0),
+    stride(0),
+    capacity(0),
+    data(nullptr),
+    mapping(nullptr),
+    mapping_size(0)
+{}
+
+FrameBuffer::~FrameBuffer() {
+    Release();
+}
+
+void FrameBuffer::Release() {
+    if (mapping != nullptr)
+        munmap(mapping, mapping_size);
+    else
+        free(data);
+
+    data = nullptr;
+    capacity = 0;
+    mapping = nullptr;
+    mapping_size = 0;
+}
+
+void FrameBuffer::Resize(int width, int height) {
+    static_assert(sizeof(Color) == 3 * sizeof(float), "Color must be 3 floats without padding");
+
+    const size_t floats_in_line = CACHE_LINE_SIZE / sizeof(float);
+
+    /* Mapped file has fixed resolution */
+    if (mapping != nullptr && (width != this->width || height != this->height))
+        Release();
+
+    this->width = width;
+    this->height = height;
+    stride = (size_t(width) * 3 + floats_in_line - 1) / floats_in_line * floats_in_line;
+
+    size_t required = stride * size_t(height);
+    if (required <= capacity)
+        return;
+
+    Release();
+
+    void *memory = nullptr;
+    if (posix_memalign(&memory, CACHE_LINE_SIZE, required * sizeof(float)) != 0)
+        throw std::bad_alloc();
+
+    data = static_cast<float*>(memory);
+    capacity = required;
+}
+
+void FrameBuffer::MapFile(const std::string &filename, int width, int height, int tile_size) {
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Atomic counters must be stored as plain integers");
+    static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "Atomic bitmap must be stored as plain integers");
+
+    Release();
+
+    const size_t floats_in_line = CACHE_LINE_SIZE / sizeof(float);
+
+    this->width = width;
+    this->height = height;
+    stride = (size_t(width) * 3 + floats_in_line - 1) / floats_in_line * floats_in_line;
+
+    uint32_t tiles_x = uint32_t((width + tile_size - 1) / tile_size);
+    uint32_t tiles_y = uint32_t((height + tile_size - 1) / tile_size);
+    size_t bitmap_words = (size_t(tiles_x) * tiles_y + 63) / 64;
+
+    size_t bitmap_offset = (sizeof(FrameBufferFileHeader) + 7) / 8 * 8;
+    size_t pixels_offset = (bitmap_offset + bitmap_words * sizeof(uint64_t) + FRAME_FILE_ALIGNMENT - 1)
+                           / FRAME_FILE_ALIGNMENT * FRAME_FILE_ALIGNMENT;
+    size_t size = pixels_offset + stride * size_t(height) * sizeof(float);
+
+    /* Truncation clears the previous content, so all tiles are not done and all colors are black */
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, off_t(size)) != 0) {
+        if (fd >= 0)
+            close(fd);
+        std::stringstream ss;
+        ss << "Error create frame buffer file: " << filename;
+        throw std::runtime_error(ss.str());
+    }
+
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        std::stringstream ss;
+        ss << "Error map frame buffer file: " << filename;
+        throw std::runtime_error(ss.str());
+    }
+
+    mapping = memory;
+    mapping_size = size;
+    data = reinterpret_cast<float*>(static_cast<uint8_t*>(memory) + pixels_offset);
+    capacity = stride * size_t(height);
+
+    FrameBufferFileHeader *header = static_cast<FrameBufferFileHeader*>(memory);
+    memcpy(header->magic, "RTFRAME", 8);
+    header->version = FRAME_FILE_VERSION;
+    header->header_size = sizeof(FrameBufferFileHeader);
+    header->width = uint32_t(width);
+    header->height = uint32_t(height);
+    header->row_stride = uint32_t(stride * sizeof(float));
+    header->tile_size = uint32_t(tile_size);
+    header->tiles_x = tiles_x;
+    header->tiles_y = tiles_y;
+    header->bitmap_offset = bitmap_offset;
+    header->pixels_offset = pixels_offset;
+}
+
+void FrameBuffer::MarkTileDone(int x, int y) {
+    if (mapping == nullptr)
+        return;
+
+    FrameBufferFileHeader *header = static_cast<FrameBufferFileHeader*>(mapping);
+    size_t tile = size_t(y / header->tile_size) * header->tiles_x + x / header->tile_size;
+
+    auto bitmap = reinterpret_cast<std::atomic<uint64_t>*>(static_cast<uint8_t*>(mapping) + header->bitmap_offset);
+    bitmap[tile / 64].fetch_or(uint64_t(1) << (tile % 64), std::memory_order_release);
+
+    reinterpret_cast<std::atomic<uint32_t>*>(&header->tiles_done)->fetch_add(1, std::memory_order_release);
+}
+
+void FrameBuffer::MarkFinished() {
+    if (mapping == nullptr)
+        return;
+
+    FrameBufferFileHeader *header = static_cast<FrameBufferFileHeader*>(mapping);
+    uint32_t tiles_done = reinterpret_cast<std::atomic<uint32_t>*>(&header->tiles_done)->load(std::memory_order_acquire);
+    uint32_t state = tiles_done >= header->tiles_x * header->tiles_y ? FRAME_STATE_COMPLETE : FRAME_STATE_STOPPED;
+    reinterpret_cast<std::atomic<uint32_t>*>(&header->state)->store(state, std::memory_order_release);
+}
+
+void FrameBuffer::Clear() {
+    if (data != nullptr)
+        memset(data, 0, stride * size_t(height) * sizeof(float));
+}
+
+void FrameBuffer::QuantizeRow(const Color *row, int width, uint8_t *rgb) {
+    const float *channels = reinterpret_cast<const float*>(row);
+    int count = 3 * width;
+
+    /* The loop has no branches, so it is vectorized */
+#pragma omp simd
+    for (int i = 0; i < count; i++) {
+        float value = std::min(255.0f, std::max(0.0f, channels[i]));
+        rgb[i] = static_cast<uint8_t>(value);
+    }
+}
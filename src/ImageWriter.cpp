@@ -0,0 +1,269 @@
+#include "ImageWriter.h"
+#include "FrameBuffer.h"
+#include "PngImageWriter.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+static void ThrowWriteError(const std::string &filename) {
+    std::stringstream ss;
+    ss << "Error write to file: " << filename;
+    throw std::runtime_error(ss.str());
+}
+
+/* Put little endian numbers to header */
+static void PutWord(uint8_t *data, uint16_t value) {
+    data[0] = uint8_t(value);
+    data[1] = uint8_t(value >> 8);
+}
+
+static void PutDword(uint8_t *data, uint32_t value) {
+    PutWord(data, uint16_t(value));
+    PutWord(data + 2, uint16_t(value >> 16));
+}
+
+/* OutputFile implementation */
+
+OutputFile::OutputFile() : fd(-1), seekable(false), written(0) {}
+
+OutputFile::~OutputFile() {
+    if (fd > STDOUT_FILENO)
+        close(fd);
+}
+
+void OutputFile::Open(const std::string &filename) {
+    /* The previous file could be left open by error of writing, its error does not matter now */
+    if (fd > STDOUT_FILENO)
+        close(fd);
+    fd = -1;
+
+    this->filename = filename;
+    written = 0;
+
+    /*
+     * Standard output is always a stream: even redirected to a file it may already hold
+     * previous frames, that must not be overwritten or truncated
+     */
+    if (filename == "-") {
+        fd = STDOUT_FILENO;
+        seekable = false;
+        return;
+    }
+
+    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        ThrowWriteError(filename);
+    seekable = true;
+}
+
+void OutputFile::Write(const uint8_t *data, size_t size) {
+    if (seekable) {
+        WriteAt(data, size, written);
+        return;
+    }
+
+    while (size > 0) {
+        ssize_t result = write(fd, data, size);
+        if (result <= 0)
+            ThrowWriteError(filename);
+
+        data += result;
+        size -= result;
+        written += result;
+    }
+}
+
+void OutputFile::WriteAt(const uint8_t *data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t result = pwrite(fd, data, size, off_t(offset));
+        if (result <= 0)
+            ThrowWriteError(filename);
+
+        data += result;
+        size -= result;
+        offset += result;
+    }
+    written = std::max(written, offset);
+}
+
+void OutputFile::Resize(uint64_t size) {
+    if (ftruncate(fd, off_t(size)) != 0)
+        ThrowWriteError(filename);
+}
+
+void OutputFile::Close() {
+    if (fd < 0)
+        return;
+
+    int result = fd > STDOUT_FILENO ? close(fd) : 0;
+    fd = -1;
+    if (result != 0)
+        ThrowWriteError(filename);
+}
+
+/* RasterImageWriter implementation */
+
+RasterImageWriter::RasterImageWriter() : width(0), height(0), header_size(0), row_size(0), next_row(0) {}
+
+void RasterImageWriter::Open(const std::string &filename, int width, int height) {
+    this->width = width;
+    this->height = height;
+    row_size = RowSize(width);
+    row_buffer.assign(row_size, 0);
+    next_row = BottomUp() ? height - 1 : 0;
+    pending_rows.clear();
+
+    file.Open(filename);
+
+    std::vector<uint8_t> header = Header(width, height);
+    header_size = header.size();
+    file.Write(header.data(), header.size());
+
+    /* Rows could come in any order, so the file gets its full size at once */
+    if (file.Seekable())
+        file.Resize(header_size + uint64_t(row_size) * height);
+}
+
+void RasterImageWriter::WriteRow(int y, const Color *row) {
+    if (file.Seekable()) {
+        EncodeRow(row, width, row_buffer.data());
+
+        int position = BottomUp() ? height - 1 - y : y;
+        file.WriteAt(row_buffer.data(), row_size, header_size + uint64_t(row_size) * position);
+        return;
+    }
+
+    std::vector<uint8_t> data(row_size);
+    EncodeRow(row, width, data.data());
+    Store(y, std::move(data));
+}
+
+void RasterImageWriter::Store(int y, std::vector<uint8_t> &&data) {
+    if (y != next_row) {
+        pending_rows[y] = std::move(data);
+        return;
+    }
+
+    file.Write(data.data(), data.size());
+    next_row += BottomUp() ? -1 : 1;
+
+    /* Write rows, that waited for this one */
+    auto it = pending_rows.find(next_row);
+    while (it != pending_rows.end()) {
+        file.Write(it->second.data(), it->second.size());
+        pending_rows.erase(it);
+        next_row += BottomUp() ? -1 : 1;
+        it = pending_rows.find(next_row);
+    }
+}
+
+void RasterImageWriter::Close() {
+    if (!pending_rows.empty()) {
+        file.Close();
+        throw std::runtime_error("Image is closed before all rows are written");
+    }
+
+    file.Close();
+}
+
+/* BmpImageWriter implementation */
+
+std::vector<uint8_t> BmpImageWriter::Header(int width, int height) {
+    const size_t header_size = 54;
+    size_t pixels_size = RowSize(width) * height;
+
+    /* The same header, as EasyBMP writes */
+    std::vector<uint8_t> header(header_size, 0);
+    header[0] = 'B';
+    header[1] = 'M';
+    PutDword(&header[2], uint32_t(header_size + pixels_size));
+    PutDword(&header[10], uint32_t(header_size));
+    PutDword(&header[14], 40);
+    PutDword(&header[18], uint32_t(width));
+    PutDword(&header[22], uint32_t(height));
+    PutWord(&header[26], 1);
+    PutWord(&header[28], 24);
+    PutDword(&header[34], uint32_t(pixels_size));
+    PutDword(&header[38], DefaultXPelsPerMeter);
+    PutDword(&header[42], DefaultYPelsPerMeter);
+    return header;
+}
+
+size_t BmpImageWriter::RowSize(int width) {
+    /* Rows are padded to 4 bytes */
+    return (size_t(width) * 3 + 3) / 4 * 4;
+}
+
+void BmpImageWriter::EncodeRow(const Color *row, int width, uint8_t *out) {
+    FrameBuffer::QuantizeRow(row, width, out);
+
+    /* BMP stores BGR */
+    for (int x = 0; x < width; x++) {
+        std::swap(out[3 * x], out[3 * x + 2]);
+    }
+    memset(out + 3 * width, 0, RowSize(width) - 3 * width);
+}
+
+/* PpmImageWriter implementation */
+
+std::vector<uint8_t> PpmImageWriter::Header(int width, int height) {
+    std::stringstream ss;
+    ss << "P6\n" << width << " " << height << "\n255\n";
+    std::string header = ss.str();
+    return std::vector<uint8_t>(header.begin(), header.end());
+}
+
+size_t PpmImageWriter::RowSize(int width) {
+    return size_t(width) * 3;
+}
+
+void PpmImageWriter::EncodeRow(const Color *row, int width, uint8_t *out) {
+    FrameBuffer::QuantizeRow(row, width, out);
+}
+
+/* PfmImageWriter implementation */
+
+std::vector<uint8_t> PfmImageWriter::Header(int width, int height) {
+    /* Negative scale means little endian floats */
+    std::stringstream ss;
+    ss << "PF\n" << width << " " << height << "\n-1.0\n";
+    std::string header = ss.str();
+    return std::vector<uint8_t>(header.begin(), header.end());
+}
+
+size_t PfmImageWriter::RowSize(int width) {
+    return size_t(width) * 3 * sizeof(float);
+}
+
+void PfmImageWriter::EncodeRow(const Color *row, int width, uint8_t *out) {
+    const float *channels = reinterpret_cast<const float*>(row);
+    float *result = reinterpret_cast<float*>(out);
+    for (int i = 0; i < 3 * width; i++) {
+        result[i] = channels[i] / 255.0f;
+    }
+}
+
+std::unique_ptr<ImageWriter> CreateImageWriter(const std::string &filename, int threads) {
+    std::string extension;
+    size_t dot = filename.rfind('.');
+    if (dot != std::string::npos && filename.find('/', dot) == std::string::npos) {
+        extension = filename.substr(dot + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    }
+
+    if (filename == "-" || extension == "ppm")
+        return std::unique_ptr<ImageWriter>(new PpmImageWriter());
+    if (extension == "bmp")
+        return std::unique_ptr<ImageWriter>(new BmpImageWriter());
+    if (extension == "png")
+        return std::unique_ptr<ImageWriter>(new PngImageWriter(threads));
+    if (extension == "pfm")
+        return std::unique_ptr<ImageWriter>(new PfmImageWriter());
+
+    std::stringstream ss;
+    ss << "Unknown image format: " << filename << ", expected .bmp, .png, .ppm or .pfm";
+    throw std::runtime_error(ss.str());
+}
@@ -0,0 +1,96 @@
+#include "LightCache.h"
+#include <cmath>
+
+/* Maximal number of entries, that are checked for one key */
+#define LIGHT_CACHE_MAX_PROBES 16
+
+/* Mixer of splitmix64, it spreads bits of key over all table */
+static uint64_t Mix(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ull;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebull;
+    value ^= value >> 31;
+    return value;
+}
+
+LightCache::LightCache(float cell_size, size_t capacity) : cell_size(0), mask(0) {
+    Configure(cell_size, capacity);
+}
+
+void LightCache::Configure(float cell_size, size_t capacity) {
+    this->cell_size = cell_size;
+
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    if (cell_size <= 0)
+        size = 0;
+
+    std::vector<std::atomic<uint64_t>> new_table(size);
+    table.swap(new_table);
+    mask = size > 0 ? size - 1 : 0;
+}
+
+void LightCache::Clear() {
+    for (auto &entry : table)
+        entry.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LightCache::Key(const Vector &point, const Vector &normal, const void *figure, int light) const {
+    auto cell = [this](float coordinate) {
+        return static_cast<uint64_t>(static_cast<int64_t>(std::floor(coordinate / cell_size)));
+    };
+    /* Normal components are rounded to 5 levels: -1, -0.5, 0, 0.5, 1 */
+    auto direction = [](float coordinate) {
+        return static_cast<uint64_t>(static_cast<int64_t>(std::lround(coordinate * 2)) + 2);
+    };
+
+    uint64_t key = Mix(cell(point.x));
+    key = Mix(key ^ cell(point.y));
+    key = Mix(key ^ cell(point.z));
+    key = Mix(key ^ (direction(normal.x) | direction(normal.y) << 4 | direction(normal.z) << 8));
+    key = Mix(key ^ static_cast<uint64_t>(reinterpret_cast<uintptr_t>(figure)));
+    key = Mix(key ^ static_cast<uint64_t>(static_cast<uint32_t>(light)));
+
+    /* Key is stored with shift, and must not be 0 (it is empty entry) */
+    key >>= 1;
+    return key != 0 ? key : 1;
+}
+
+bool LightCache::Find(uint64_t key, bool &visible) {
+    if (table.empty())
+        return false;
+
+    for (uint64_t i = 0; i < LIGHT_CACHE_MAX_PROBES; i++) {
+        uint64_t entry = table[(key + i) & mask].load(std::memory_order_relaxed);
+        if (entry == 0)
+            return false;
+
+        if ((entry >> 1) == key) {
+            visible = (entry & 1) != 0;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void LightCache::Insert(uint64_t key, bool visible) {
+    if (table.empty())
+        return;
+
+    uint64_t value = key << 1 | (visible ? 1 : 0);
+    for (uint64_t i = 0; i < LIGHT_CACHE_MAX_PROBES; i++) {
+        std::atomic<uint64_t> &entry = table[(key + i) & mask];
+
+        uint64_t expected = 0;
+        if (entry.compare_exchange_strong(expected, value, std::memory_order_relaxed))
+            return;
+
+        /* Other thread has already stored this key */
+        if ((expected >> 1) == key)
+            return;
+    }
+}
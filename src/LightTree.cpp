@@ -0,0 +1,112 @@
+#include "LightTree.h"
+#include <algorithm>
+#include <cmath>
+
+void LightTree::Build(const std::vector<Vector> &positions) {
+    nodes.clear();
+    if (positions.empty())
+        return;
+
+    nodes.reserve(2 * positions.size());
+
+    std::vector<int> order(positions.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = static_cast<int>(i);
+
+    BuildNode(order, 0, static_cast<int>(order.size()), positions);
+}
+
+int LightTree::BuildNode(std::vector<int> &order, int begin, int end, const std::vector<Vector> &positions) {
+    int index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+
+    Vector min = positions[order[begin]];
+    Vector max = min;
+    for (int i = begin + 1; i < end; i++) {
+        const Vector &p = positions[order[i]];
+        min = Vector(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vector(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+
+    nodes[index].bounds = BoundingBox(min, max);
+    nodes[index].power = float(end - begin);
+    nodes[index].left = nodes[index].right = -1;
+    nodes[index].light = order[begin];
+
+    if (end - begin == 1)
+        return index;
+
+    /* Split by median along the longest axis */
+    Vector size = max - min;
+    int middle = (begin + end) / 2;
+    auto key = [&](int light) {
+        const Vector &p = positions[light];
+        if (size.x >= size.y && size.x >= size.z)
+            return p.x;
+        if (size.y >= size.z)
+            return p.y;
+        return p.z;
+    };
+    std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                     [&](int a, int b) { return key(a) < key(b); });
+
+    int left = BuildNode(order, begin, middle, positions);
+    int right = BuildNode(order, middle, end, positions);
+
+    nodes[index].left = left;
+    nodes[index].right = right;
+    nodes[index].light = -1;
+
+    return index;
+}
+
+float LightTree::Importance(const Node &node, const Vector &point, const Vector &normal) const {
+    /* Bounding sphere of node */
+    Vector center = (node.bounds.min + node.bounds.max) / 2;
+    float radius = (node.bounds.max - node.bounds.min).length() / 2;
+
+    Vector to_center = center - point;
+    float distance = to_center.length();
+    if (distance <= radius)
+        return node.power;
+
+    /* Minimal angle between normal and direction to any point of sphere */
+    float cos_angle = std::max(-1.0f, std::min(1.0f, Vector::dot(to_center, normal) / distance));
+    float angle = std::acos(cos_angle) - std::asin(radius / distance);
+    if (angle <= 0)
+        return node.power;
+    if (angle >= float(M_PI / 2))
+        return 0;
+
+    return node.power * std::cos(angle);
+}
+
+int LightTree::Sample(const Vector &point, const Vector &normal, float random, float &pdf) const {
+    pdf = 1;
+    if (nodes.empty())
+        return -1;
+
+    int index = 0;
+    while (nodes[index].left >= 0) {
+        const Node &node = nodes[index];
+        float left = Importance(nodes[node.left], point, normal);
+        float right = Importance(nodes[node.right], point, normal);
+        if (left + right <= 0)
+            return -1;
+
+        /* Choose child and reuse the random number for next levels */
+        float p_left = left / (left + right);
+        if (random < p_left) {
+            index = node.left;
+            pdf *= p_left;
+            random = random / p_left;
+        } else {
+            index = node.right;
+            pdf *= 1 - p_left;
+            random = (random - p_left) / (1 - p_left);
+        }
+        random = std::min(random, 0.99999994f);
+    }
+
+    return nodes[index].light;
+}
@@ -0,0 +1,225 @@
+#include "PngImageWriter.h"
+#include "Deflate.h"
+#include "FrameBuffer.h"
+#include "Timeline.h"
+#include <cstdlib>
+#include <stdexcept>
+
+/* Rows in one compressed band */
+#define PNG_BAND_ROWS 64
+
+/* Put big endian number */
+static void PutBigEndian(uint8_t *data, uint32_t value) {
+    data[0] = uint8_t(value >> 24);
+    data[1] = uint8_t(value >> 16);
+    data[2] = uint8_t(value >> 8);
+    data[3] = uint8_t(value);
+}
+
+/* Paeth predictor of PNG */
+static uint8_t Paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return uint8_t(a);
+    if (pb <= pc)
+        return uint8_t(b);
+    return uint8_t(c);
+}
+
+/**
+ * Filter row by PNG filter
+ * @param type - 0 None, 1 Sub, 2 Up, 3 Average, 4 Paeth
+ * @param row - bytes of row
+ * @param previous - bytes of previous row, nullptr for the first row of band
+ * @param size - bytes in row
+ * @param out - filtered bytes
+ * @return - sum of absolute values of filtered bytes (as signed), less is better
+ */
+static long FilterRow(int type, const uint8_t *row, const uint8_t *previous, size_t size, uint8_t *out) {
+    const int bpp = 3;
+    long cost = 0;
+    for (size_t i = 0; i < size; i++) {
+        int left = i >= bpp ? row[i - bpp] : 0;
+        int up = previous != nullptr ? previous[i] : 0;
+        int up_left = (previous != nullptr && i >= bpp) ? previous[i - bpp] : 0;
+
+        int predicted = 0;
+        switch (type) {
+            case 1: predicted = left; break;
+            case 2: predicted = up; break;
+            case 3: predicted = (left + up) / 2; break;
+            case 4: predicted = Paeth(left, up, up_left); break;
+            default: break;
+        }
+
+        out[i] = uint8_t(row[i] - predicted);
+        cost += std::abs(int(int8_t(out[i])));
+    }
+    return cost;
+}
+
+PngImageWriter::PngImageWriter(int threads) :
+    threads(std::max(1, threads)),
+    width(0),
+    height(0),
+    band_rows(PNG_BAND_ROWS),
+    next_band(0),
+    adler(1)
+{}
+
+PngImageWriter::~PngImageWriter() {
+    /* Threads of compression use only their arguments, but they must finish before the writer */
+    for (auto &it : compressing) {
+        if (it.second.valid())
+            it.second.wait();
+    }
+}
+
+void PngImageWriter::Open(const std::string &filename, int width, int height) {
+    this->width = width;
+    this->height = height;
+    bands.clear();
+    compressing.clear();
+    next_band = 0;
+    adler = 1;
+
+    file.Open(filename);
+
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    file.Write(signature, sizeof(signature));
+
+    /* 8 bit RGB, without interlace */
+    uint8_t header[13] = {};
+    PutBigEndian(header, uint32_t(width));
+    PutBigEndian(header + 4, uint32_t(height));
+    header[8] = 8;
+    header[9] = 2;
+    WriteChunk("IHDR", header, sizeof(header));
+
+    /* zlib header: deflate with 32K window, the fastest level */
+    const uint8_t zlib_header[2] = {0x78, 0x01};
+    WriteChunk("IDAT", zlib_header, sizeof(zlib_header));
+}
+
+void PngImageWriter::WriteRow(int y, const Color *row) {
+    int band_index = y / band_rows;
+    int rows_in_band = std::min(band_rows, height - band_index * band_rows);
+    size_t row_size = size_t(width) * 3;
+
+    Band &band = bands[band_index];
+    if (band.pixels.empty())
+        band.pixels.resize(row_size * rows_in_band);
+
+    FrameBuffer::QuantizeRow(row, width, &band.pixels[row_size * (y - band_index * band_rows)]);
+    band.rows_count++;
+
+    if (band.rows_count < rows_in_band)
+        return;
+
+    /* Band is full, compress it by separate thread */
+    if (compressing.size() >= size_t(threads))
+        WriteReadyBands(true);
+
+    compressing[band_index] = std::async(std::launch::async, &PngImageWriter::Compress,
+                                         std::move(band.pixels), width, rows_in_band);
+    bands.erase(band_index);
+
+    WriteReadyBands(false);
+}
+
+PngImageWriter::Chunk PngImageWriter::Compress(std::vector<uint8_t> pixels, int width, int rows) {
+    TimelineSpan span("compress PNG band", "output");
+
+    size_t row_size = size_t(width) * 3;
+
+    /* Every row starts with byte of filter type */
+    std::vector<uint8_t> filtered((row_size + 1) * rows);
+    std::vector<uint8_t> candidate(row_size);
+
+    for (int y = 0; y < rows; y++) {
+        const uint8_t *row = &pixels[row_size * y];
+        /* The first row of band does not use previous one, so bands are independent */
+        const uint8_t *previous = y > 0 ? &pixels[row_size * (y - 1)] : nullptr;
+        uint8_t *out = &filtered[(row_size + 1) * y];
+
+        long best_cost = -1;
+        for (int type = 0; type <= 4; type++) {
+            if (previous == nullptr && type >= 2)
+                break;
+
+            long cost = FilterRow(type, row, previous, row_size, candidate.data());
+            if (best_cost < 0 || cost < best_cost) {
+                best_cost = cost;
+                out[0] = uint8_t(type);
+                std::copy(candidate.begin(), candidate.end(), out + 1);
+            }
+        }
+    }
+
+    Chunk chunk;
+    chunk.raw_size = filtered.size();
+    chunk.adler = Deflate::Adler32(1, filtered.data(), filtered.size());
+    Deflate::DeflateBlock(filtered.data(), filtered.size(), chunk.data);
+    return chunk;
+}
+
+void PngImageWriter::WriteReadyBands(bool wait) {
+    while (true) {
+        auto it = compressing.find(next_band);
+        if (it == compressing.end())
+            return;
+
+        if (!wait && it->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+
+        Chunk chunk = it->second.get();
+        compressing.erase(it);
+
+        WriteChunk("IDAT", chunk.data.data(), chunk.data.size());
+        adler = Deflate::Adler32Combine(adler, chunk.adler, chunk.raw_size);
+        next_band++;
+        wait = false;
+    }
+}
+
+void PngImageWriter::Close() {
+    int bands_count = (height + band_rows - 1) / band_rows;
+    while (next_band < bands_count) {
+        if (compressing.find(next_band) == compressing.end()) {
+            file.Close();
+            throw std::runtime_error("PNG is closed before all rows are written");
+        }
+        WriteReadyBands(true);
+    }
+
+    /* Final deflate block and adler32 of all filtered data */
+    std::vector<uint8_t> tail;
+    Deflate::DeflateFinish(tail);
+    uint8_t checksum[4];
+    PutBigEndian(checksum, adler);
+    tail.insert(tail.end(), checksum, checksum + 4);
+    WriteChunk("IDAT", tail.data(), tail.size());
+
+    WriteChunk("IEND", nullptr, 0);
+    file.Close();
+}
+
+void PngImageWriter::WriteChunk(const char *type, const uint8_t *data, size_t size) {
+    uint8_t header[8];
+    PutBigEndian(header, uint32_t(size));
+    std::copy(type, type + 4, header + 4);
+    file.Write(header, sizeof(header));
+
+    uint32_t crc = Deflate::Crc32(0, header + 4, 4);
+    if (size > 0) {
+        file.Write(data, size);
+        crc = Deflate::Crc32(crc, data, size);
+    }
+
+    uint8_t footer[4];
+    PutBigEndian(footer, crc);
+    file.Write(footer, sizeof(footer));
+}
@@ -0,0 +1,257 @@
+#include "RenderCache.h"
+#include "Deflate.h"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RENDER_CACHE_VERSION 1
+
+struct RenderCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t crc;
+    uint64_t key;
+};
+
+static const char ENTRY_EXTENSION[] = ".rtimage";
+
+static bool ReadAt(int fd, void *data, size_t size, uint64_t offset) {
+    uint8_t *bytes = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        ssize_t result = pread(fd, bytes, size, off_t(offset));
+        if (result <= 0)
+            return false;
+        bytes += result;
+        size -= result;
+        offset += result;
+    }
+    return true;
+}
+
+RenderCache::RenderCache(const std::string &directory, uint64_t size_limit, bool verbose) :
+    directory(directory), size_limit(size_limit), verbose(verbose) {
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::stringstream ss;
+        ss << "Error create render cache directory: " << directory;
+        throw std::runtime_error(ss.str());
+    }
+}
+
+std::string RenderCache::EntryPath(uint64_t key) const {
+    std::stringstream ss;
+    ss << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ENTRY_EXTENSION;
+    return ss.str();
+}
+
+bool RenderCache::Fetch(uint64_t key, ImageWriter &writer, const std::string &filename) {
+    std::string path = EntryPath(key);
+
+    std::vector<Color> colors;
+    RenderCacheHeader header = {};
+
+    int fd = open(path.c_str(), O_RDONLY);
+    bool valid = fd >= 0 && ReadAt(fd, &header, sizeof(header), 0) &&
+                 memcmp(header.magic, "RTIMAGE", 8) == 0 && header.version == RENDER_CACHE_VERSION &&
+                 header.key == key && header.width > 0 && header.height > 0 &&
+                 header.width <= 65536 && header.height <= 65536;
+    if (valid) {
+        colors.resize(size_t(header.width) * header.height);
+        size_t size = colors.size() * sizeof(Color);
+        valid = ReadAt(fd, colors.data(), size, sizeof(header)) &&
+                Deflate::Crc32(0, reinterpret_cast<const uint8_t*>(colors.data()), size) == header.crc;
+    }
+
+    /* Modification time is the time of the last use */
+    if (valid)
+        futimens(fd, nullptr);
+    if (fd >= 0)
+        close(fd);
+
+    if (!valid) {
+        /* The broken image is replaced by the next render */
+        if (fd >= 0)
+            unlink(path.c_str());
+        if (verbose)
+            std::cout << "Render cache miss: " << path << std::endl;
+        UpdateStats(0, 1, 0);
+        return false;
+    }
+
+    writer.Open(filename, int(header.width), int(header.height));
+    for (uint32_t y = 0; y < header.height; y++)
+        writer.WriteRow(int(y), &colors[size_t(y) * header.width]);
+    writer.Close();
+
+    if (verbose)
+        std::cout << "Render cache hit: " << path << std::endl;
+    UpdateStats(1, 0, 0);
+    return true;
+}
+
+void RenderCache::Store(uint64_t key, const RecordingImageWriter &recorder) {
+    if (!recorder.Complete())
+        return;
+
+    const std::vector<Color> &colors = recorder.Colors();
+    size_t size = colors.size() * sizeof(Color);
+
+    RenderCacheHeader header = {};
+    memcpy(header.magic, "RTIMAGE", 8);
+    header.version = RENDER_CACHE_VERSION;
+    header.width = uint32_t(recorder.Width());
+    header.height = uint32_t(recorder.Height());
+    header.crc = Deflate::Crc32(0, reinterpret_cast<const uint8_t*>(colors.data()), size);
+    header.key = key;
+
+    /* Other process could read the image, so it appears at once by rename */
+    std::string path = EntryPath(key);
+    std::stringstream temporary;
+    temporary << path << ".tmp." << getpid();
+
+    OutputFile file;
+    file.Open(temporary.str());
+    file.Write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+    file.Write(reinterpret_cast<const uint8_t*>(colors.data()), size);
+    file.Close();
+
+    if (rename(temporary.str().c_str(), path.c_str()) != 0) {
+        unlink(temporary.str().c_str());
+        std::stringstream ss;
+        ss << "Error write render cache: " << path;
+        throw std::runtime_error(ss.str());
+    }
+
+    int evicted = Evict();
+    if (evicted > 0) {
+        if (verbose)
+            std::cout << "Render cache: " << evicted << " least recently used images are removed" << std::endl;
+        UpdateStats(0, 0, evicted);
+    }
+}
+
+int RenderCache::Evict() {
+    struct Entry {
+        struct timespec used;
+        uint64_t size;
+        std::string path;
+    };
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return 0;
+
+    std::vector<Entry> entries;
+    uint64_t total_size = 0;
+    const size_t extension_size = strlen(ENTRY_EXTENSION);
+    while (struct dirent *item = readdir(dir)) {
+        std::string name = item->d_name;
+        if (name.size() <= extension_size || name.compare(name.size() - extension_size, extension_size, ENTRY_EXTENSION) != 0)
+            continue;
+
+        Entry entry;
+        entry.path = directory + "/" + name;
+        struct stat file_stat = {};
+        if (stat(entry.path.c_str(), &file_stat) != 0)
+            continue;
+        entry.used = file_stat.st_mtim;
+        entry.size = uint64_t(file_stat.st_size);
+        total_size += entry.size;
+        entries.push_back(entry);
+    }
+    closedir(dir);
+
+    if (total_size <= size_limit)
+        return 0;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+    });
+
+    int evicted = 0;
+    for (auto &entry : entries) {
+        if (total_size <= size_limit)
+            break;
+        if (unlink(entry.path.c_str()) == 0) {
+            total_size -= entry.size;
+            evicted++;
+        }
+    }
+    return evicted;
+}
+
+void RenderCache::UpdateStats(int hits, int misses, int evictions) {
+    std::string path = directory + "/stats";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return;
+
+    /* Processes, that share the cache, update counters one by one */
+    flock(fd, LOCK_EX);
+
+    char text[256] = {};
+    uint64_t total_hits = 0, total_misses = 0, total_evictions = 0;
+    ssize_t length = pread(fd, text, sizeof(text) - 1, 0);
+    if (length > 0)
+        sscanf(text, "hits %" SCNu64 " misses %" SCNu64 " evictions %" SCNu64,
+               &total_hits, &total_misses, &total_evictions);
+
+    total_hits += hits;
+    total_misses += misses;
+    total_evictions += evictions;
+
+    int size = snprintf(text, sizeof(text), "hits %" PRIu64 "\nmisses %" PRIu64 "\nevictions %" PRIu64 "\n",
+                        total_hits, total_misses, total_evictions);
+    if (ftruncate(fd, 0) == 0 && pwrite(fd, text, size_t(size), 0) != size)
+        std::cerr << "Error write render cache stats: " << path << std::endl;
+
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if (verbose) {
+        uint64_t requests = total_hits + total_misses;
+        std::stringstream rate;
+        rate << std::fixed << std::setprecision(1) << (requests > 0 ? 100.0 * total_hits / requests : 0.0);
+        std::cout << "Render cache: " << total_hits << " hits, " << total_misses << " misses ("
+                  << rate.str() << "% hit rate), " << total_evictions << " evictions" << std::endl;
+    }
+}
+
+/* RecordingImageWriter implementation */
+
+RecordingImageWriter::RecordingImageWriter(ImageWriter &writer) :
+    writer(writer), width(0), height(0), rows_written(0), complete(false) {}
+
+void RecordingImageWriter::Open(const std::string &filename, int width, int height) {
+    this->width = width;
+    this->height = height;
+    colors.assign(size_t(width) * height, Color());
+    rows_written = 0;
+    complete = false;
+
+    writer.Open(filename, width, height);
+}
+
+void RecordingImageWriter::WriteRow(int y, const Color *row) {
+    std::copy(row, row + width, colors.begin() + size_t(y) * width);
+    rows_written++;
+
+    writer.WriteRow(y, row);
+}
+
+void RecordingImageWriter::Close() {
+    writer.Close();
+    complete = rows_written == height;
+}
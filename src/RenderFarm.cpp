@@ -0,0 +1,416 @@
+#include "RenderFarm.h"
+#include "Timeline.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FARM_PROTOCOL_VERSION 2
+
+/* Side of tiles, that are sent to workers */
+#define FARM_TILE_SIZE 64
+
+/* Tiles, that are sent to worker at once, so it does not wait for the next one */
+#define FARM_TILES_IN_FLIGHT 2
+
+namespace {
+
+enum MessageType : uint32_t {
+    HELLO = 1,
+    TILE = 2,
+    RESULT = 3,
+    QUIT = 4
+};
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t size;
+};
+
+struct HelloMessage {
+    uint32_t version;
+    uint32_t width, height;
+    uint64_t scene_key;
+};
+
+struct TileMessage {
+    uint32_t tile;
+    int32_t x0, y0, x1, y1;
+};
+
+bool WriteAll(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        ssize_t result = write(fd, bytes, size);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        bytes += result;
+        size -= result;
+    }
+    return true;
+}
+
+bool ReadAll(int fd, void *data, size_t size) {
+    uint8_t *bytes = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        ssize_t result = read(fd, bytes, size);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        bytes += result;
+        size -= result;
+    }
+    return true;
+}
+
+bool SendMessage(int fd, uint32_t type, const void *payload, size_t size, const void *tail = nullptr, size_t tail_size = 0) {
+    MessageHeader header;
+    header.type = type;
+    header.size = uint32_t(size + tail_size);
+    return WriteAll(fd, &header, sizeof(header)) && WriteAll(fd, payload, size) &&
+           (tail_size == 0 || WriteAll(fd, tail, tail_size));
+}
+
+} // namespace
+
+RenderFarm::RenderFarm(const std::vector<std::string> &command, int workers_count, float timeout, bool verbose) :
+    command(command),
+    timeout(timeout),
+    verbose(verbose),
+    workers(std::max(1, workers_count)),
+    width(0),
+    height(0),
+    full_output(false),
+    scene_key(0),
+    tiles_in_line(0),
+    writer(nullptr)
+{}
+
+RenderFarm::~RenderFarm() {
+    for (auto &worker : workers) {
+        if (worker.alive) {
+            close(worker.fd);
+            kill(worker.pid, SIGKILL);
+            waitpid(worker.pid, nullptr, 0);
+        }
+    }
+}
+
+void RenderFarm::Spawn(Worker &worker) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+        throw std::runtime_error("Error create socket pair for worker");
+
+    std::vector<char*> arguments;
+    for (auto &argument : command)
+        arguments.push_back(const_cast<char*>(argument.c_str()));
+    arguments.push_back(nullptr);
+
+    int pid = fork();
+    if (pid < 0)
+        throw std::runtime_error("Error start worker process");
+
+    if (pid == 0) {
+        /* Worker reads tiles from stdin and writes results to stdout */
+        dup2(sockets[1], STDIN_FILENO);
+        dup2(sockets[1], STDOUT_FILENO);
+        close(sockets[0]);
+        close(sockets[1]);
+        execv(arguments[0], arguments.data());
+        _exit(127);
+    }
+
+    close(sockets[1]);
+    worker.pid = pid;
+    worker.fd = sockets[0];
+    worker.tiles.clear();
+    worker.input.clear();
+    worker.step_start = std::chrono::steady_clock::now();
+    worker.ready = false;
+    worker.alive = true;
+}
+
+void RenderFarm::Fail(Worker &worker, const std::string &reason) {
+    if (!worker.alive)
+        return;
+
+    if (verbose)
+        std::cout << "Worker " << worker.pid << " failed: " << reason << ", "
+                  << worker.tiles.size() << " tiles are given to other workers" << std::endl;
+
+    close(worker.fd);
+    kill(worker.pid, SIGKILL);
+    waitpid(worker.pid, nullptr, 0);
+    worker.alive = false;
+
+    for (int tile : worker.tiles)
+        queue.push_front(tile);
+    worker.tiles.clear();
+}
+
+void RenderFarm::Feed(Worker &worker) {
+    while (worker.alive && worker.ready && worker.tiles.size() < FARM_TILES_IN_FLIGHT && !queue.empty()) {
+        int index = queue.front();
+        queue.pop_front();
+
+        const RenderTile &tile = tiles[index];
+        TileMessage message;
+        message.tile = uint32_t(index);
+        message.x0 = tile.x0;
+        message.y0 = tile.y0;
+        message.x1 = tile.x1;
+        message.y1 = tile.y1;
+
+        /* Tile of idle worker is traced at once, the next ones - after the previous tile */
+        if (worker.tiles.empty())
+            worker.step_start = std::chrono::steady_clock::now();
+        worker.tiles.push_back(index);
+        if (!SendMessage(worker.fd, TILE, &message, sizeof(message)))
+            Fail(worker, "connection is closed");
+    }
+}
+
+bool RenderFarm::HandleMessages(Worker &worker) {
+    size_t position = 0;
+    while (worker.input.size() - position >= sizeof(MessageHeader)) {
+        MessageHeader header;
+        memcpy(&header, &worker.input[position], sizeof(header));
+        if (worker.input.size() - position - sizeof(header) < header.size)
+            break;
+
+        const uint8_t *payload = &worker.input[position + sizeof(header)];
+
+        if (header.type == HELLO && header.size == sizeof(HelloMessage)) {
+            HelloMessage hello;
+            memcpy(&hello, payload, sizeof(hello));
+            if (hello.version != FARM_PROTOCOL_VERSION || hello.width != uint32_t(width) ||
+                hello.height != uint32_t(height))
+                return false;
+            if (hello.scene_key != scene_key) {
+                Fail(worker, "scene of worker differs");
+                return true;
+            }
+            worker.ready = true;
+        } else if (header.type == RESULT && header.size >= sizeof(uint32_t)) {
+            uint32_t index;
+            memcpy(&index, payload, sizeof(index));
+
+            auto it = std::find(worker.tiles.begin(), worker.tiles.end(), int(index));
+            if (it == worker.tiles.end())
+                return false;
+
+            const RenderTile &tile = tiles[index];
+            int tile_width = tile.x1 - tile.x0;
+            size_t floats_size = size_t(3) * tile_width * (tile.y1 - tile.y0) * sizeof(float);
+            if (header.size != sizeof(index) + floats_size)
+                return false;
+
+            const uint8_t *colors = payload + sizeof(index);
+            for (int y = tile.y0; y < tile.y1; y++)
+                memcpy(reinterpret_cast<float*>(&buffer.At(tile.x0 - window.x0, y - window.y0)),
+                       colors + size_t(y - tile.y0) * tile_width * 3 * sizeof(float), tile_width * 3 * sizeof(float));
+
+            worker.tiles.erase(it);
+            worker.step_start = std::chrono::steady_clock::now();
+            tile_done[index] = true;
+
+            /* Write rows, when their line of tiles is complete */
+            int line = (tile.y0 - window.y0) / FARM_TILE_SIZE;
+            if (++done_in_line[line] == tiles_in_line) {
+                TimelineSpan span("write rows", "output", 0, tile.y0);
+                for (int y = tile.y0; y < tile.y1; y++) {
+                    const Color *row = buffer.Row(y - window.y0);
+                    if (!full_row.empty()) {
+                        std::copy(row, row + (window.x1 - window.x0), full_row.begin() + window.x0);
+                        row = full_row.data();
+                    }
+                    writer->WriteRow(full_output ? y : y - window.y0, row);
+                }
+            }
+        } else {
+            return false;
+        }
+
+        position += sizeof(header) + header.size;
+    }
+
+    worker.input.erase(worker.input.begin(), worker.input.begin() + position);
+    return true;
+}
+
+std::chrono::steady_clock::time_point RenderFarm::Deadline(const Worker &worker) const {
+    return worker.step_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(timeout));
+}
+
+void RenderFarm::Render(int width, int height, const RenderTile &window, bool full_output, uint64_t scene_key,
+                        ImageWriter &writer, const std::string &filename) {
+    TimelineSpan span("render farm", "trace");
+
+    this->width = width;
+    this->height = height;
+    this->window = window;
+    this->full_output = full_output;
+    this->scene_key = scene_key;
+    this->writer = &writer;
+
+    tiles.clear();
+    for (int y = window.y0; y < window.y1; y += FARM_TILE_SIZE) {
+        for (int x = window.x0; x < window.x1; x += FARM_TILE_SIZE)
+            tiles.emplace_back(x, y, std::min(x + FARM_TILE_SIZE, window.x1), std::min(y + FARM_TILE_SIZE, window.y1));
+    }
+    queue.clear();
+    for (size_t i = 0; i < tiles.size(); i++)
+        queue.push_back(int(i));
+    tile_done.assign(tiles.size(), false);
+
+    int window_width = window.x1 - window.x0, window_height = window.y1 - window.y0;
+    tiles_in_line = (window_width + FARM_TILE_SIZE - 1) / FARM_TILE_SIZE;
+    done_in_line.assign((window_height + FARM_TILE_SIZE - 1) / FARM_TILE_SIZE, 0);
+
+    buffer.Resize(window_width, window_height);
+    full_row.clear();
+    if (full_output && window_width < width)
+        full_row.assign(width, Color());
+
+    /* Writing to closed socket of failed worker must not kill the coordinator */
+    signal(SIGPIPE, SIG_IGN);
+
+    for (auto &worker : workers)
+        Spawn(worker);
+    if (verbose)
+        std::cout << "Render farm: " << workers.size() << " workers, " << tiles.size() << " tiles" << std::endl;
+
+    /* Only crop window is written, or the whole image with black pixels outside of window */
+    if (full_output) {
+        writer.Open(filename, width, height);
+        std::vector<Color> black_row(width, Color());
+        for (int y = 0; y < height; y++) {
+            if (y < window.y0 || y >= window.y1)
+                writer.WriteRow(y, black_row.data());
+        }
+    } else {
+        writer.Open(filename, window_width, window_height);
+    }
+
+    size_t done = 0;
+    while (done < tiles.size()) {
+        std::vector<pollfd> fds;
+        std::vector<Worker*> polled;
+        for (auto &worker : workers) {
+            if (!worker.alive)
+                continue;
+            pollfd fd;
+            fd.fd = worker.fd;
+            fd.events = POLLIN;
+            fd.revents = 0;
+            fds.push_back(fd);
+            polled.push_back(&worker);
+        }
+
+        if (fds.empty())
+            throw std::runtime_error("Render farm: all workers failed");
+
+        /* Wait until the nearest deadline of worker, that starts or traces a tile */
+        int wait_ms = -1;
+        auto now = std::chrono::steady_clock::now();
+        if (timeout > 0) {
+            for (Worker *worker : polled) {
+                if (worker->ready && worker->tiles.empty())
+                    continue;
+                auto left = Deadline(*worker) - now;
+                int ms = int(std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1));
+                wait_ms = wait_ms < 0 ? ms : std::min(wait_ms, ms);
+            }
+        }
+
+        if (poll(fds.data(), fds.size(), wait_ms) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Render farm: error wait for workers");
+        }
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            Worker &worker = *polled[i];
+            if (fds[i].revents == 0)
+                continue;
+
+            uint8_t data[65536];
+            ssize_t result = read(worker.fd, data, sizeof(data));
+            if (result <= 0) {
+                Fail(worker, "connection is closed");
+                continue;
+            }
+
+            worker.input.insert(worker.input.end(), data, data + result);
+            if (!HandleMessages(worker)) {
+                Fail(worker, "wrong message");
+                continue;
+            }
+        }
+
+        /* Hung worker does not close its socket, so it is failed by time */
+        now = std::chrono::steady_clock::now();
+        for (auto &worker : workers) {
+            if (timeout > 0 && worker.alive && !(worker.ready && worker.tiles.empty()) && now >= Deadline(worker))
+                Fail(worker, worker.ready ? "tile is not traced in time" : "worker is not started in time");
+        }
+
+        done = size_t(std::count(tile_done.begin(), tile_done.end(), true));
+
+        /* Tiles of failed workers are given to the others */
+        for (auto &worker : workers)
+            Feed(worker);
+    }
+
+    writer.Close();
+
+    for (auto &worker : workers) {
+        if (!worker.alive)
+            continue;
+        SendMessage(worker.fd, QUIT, nullptr, 0);
+        close(worker.fd);
+        waitpid(worker.pid, nullptr, 0);
+        worker.alive = false;
+    }
+}
+
+int RenderFarm::RunWorker(Scene &scene, const RenderSettings &settings, int input, int output) {
+    HelloMessage hello = {};
+    hello.version = FARM_PROTOCOL_VERSION;
+    hello.width = uint32_t(scene.ImageWidth());
+    hello.height = uint32_t(scene.ImageHeight());
+    hello.scene_key = scene.RenderKey(settings);
+    if (!SendMessage(output, HELLO, &hello, sizeof(hello)))
+        return 1;
+
+    std::vector<Color> colors;
+    while (true) {
+        MessageHeader header;
+        if (!ReadAll(input, &header, sizeof(header)))
+            return 0;
+
+        if (header.type == QUIT)
+            return 0;
+
+        TileMessage message;
+        if (header.type != TILE || header.size != sizeof(message) || !ReadAll(input, &message, sizeof(message)))
+            return 1;
+
+        RenderTile region(message.x0, message.y0, message.x1, message.y1);
+        scene.TraceRegion(settings, region, colors);
+
+        if (!SendMessage(output, RESULT, &message.tile, sizeof(message.tile), colors.data(), colors.size() * sizeof(Color)))
+            return 1;
+    }
+}
@@ -0,0 +1,272 @@
+#include "RenderServer.h"
+#include "Timeline.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+RenderServer::Connection::~Connection() {
+    if (owned) {
+        close(input);
+        if (output != input)
+            close(output);
+    }
+}
+
+void RenderServer::Connection::Send(const std::string &line) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::string data = line + "\n";
+    const char *bytes = data.c_str();
+    size_t size = data.size();
+    while (size > 0) {
+        ssize_t result = write(output, bytes, size);
+        if (result < 0 && errno == EINTR)
+            continue;
+        /* Client is gone, the answer is dropped */
+        if (result <= 0)
+            return;
+        bytes += result;
+        size -= result;
+    }
+}
+
+RenderServer::RenderServer(const Handler &handler) :
+    handler(handler),
+    next_id(1),
+    active_readers(0),
+    stop(false)
+{}
+
+std::vector<std::string> RenderServer::SplitArguments(const std::string &line) {
+    std::vector<std::string> arguments;
+    std::string current;
+    bool in_argument = false;
+    bool quoted = false;
+
+    for (char c : line) {
+        if (c == '"') {
+            quoted = !quoted;
+            in_argument = true;
+        } else if (!quoted && (c == ' ' || c == '\t' || c == '\r')) {
+            if (in_argument)
+                arguments.push_back(current);
+            current.clear();
+            in_argument = false;
+        } else {
+            current += c;
+            in_argument = true;
+        }
+    }
+    if (in_argument)
+        arguments.push_back(current);
+
+    return arguments;
+}
+
+void RenderServer::HandleLine(const std::string &line, const std::shared_ptr<Connection> &connection) {
+    std::vector<std::string> arguments = SplitArguments(line);
+    if (arguments.empty())
+        return;
+
+    if (arguments.size() == 1 && arguments[0] == "quit") {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        queue_changed.notify_all();
+        return;
+    }
+
+    Job job;
+    job.priority = 0;
+    job.connection = connection;
+
+    /* Priority is the option of server, it is not passed to render */
+    for (size_t i = 0; i < arguments.size(); i++) {
+        if (arguments[i] == "--priority" && i + 1 < arguments.size()) {
+            job.priority = std::atoi(arguments[i + 1].c_str());
+            i++;
+        } else {
+            job.arguments.push_back(arguments[i]);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job.id = next_id++;
+        connection->Send("queued " + std::to_string(job.id));
+        queue.push(std::move(job));
+    }
+    queue_changed.notify_all();
+}
+
+void RenderServer::ReadJobs(std::shared_ptr<Connection> connection) {
+    std::string buffer;
+    char data[4096];
+    while (true) {
+        ssize_t result = read(connection->input, data, sizeof(data));
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            break;
+
+        buffer.append(data, size_t(result));
+        size_t end;
+        while ((end = buffer.find('\n')) != std::string::npos) {
+            HandleLine(buffer.substr(0, end), connection);
+            buffer.erase(0, end + 1);
+        }
+    }
+    if (!buffer.empty())
+        HandleLine(buffer, connection);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    active_readers--;
+    finished_readers.push_back(std::this_thread::get_id());
+    queue_changed.notify_all();
+}
+
+void RenderServer::ReapReaders() {
+    for (auto id : finished_readers) {
+        for (size_t i = 0; i < readers.size(); i++) {
+            if (readers[i].get_id() == id) {
+                readers[i].join();
+                readers.erase(readers.begin() + i);
+                break;
+            }
+        }
+    }
+    finished_readers.clear();
+
+    /* Connection lives, while its reader or queued jobs hold it */
+    connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                     [](const std::weak_ptr<Connection> &weak) { return weak.expired(); }),
+                      connections.end());
+}
+
+void RenderServer::AcceptConnections(int listen_fd) {
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stop) {
+            close(fd);
+            return;
+        }
+
+        /* Long running server accepts many clients, so the finished ones are not kept */
+        ReapReaders();
+
+        std::shared_ptr<Connection> connection = std::make_shared<Connection>(fd, fd, true);
+        connections.push_back(connection);
+        active_readers++;
+        readers.emplace_back(&RenderServer::ReadJobs, this, connection);
+    }
+}
+
+void RenderServer::Run(const std::string &socket_path) {
+    /* Answer to client, that disconnected, must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = -1;
+    std::thread acceptor;
+
+    if (socket_path.empty()) {
+        std::shared_ptr<Connection> connection = std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO, false);
+        connections.push_back(connection);
+        active_readers = 1;
+        readers.emplace_back(&RenderServer::ReadJobs, this, connection);
+    } else {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error("Socket path is too long: " + socket_path);
+        strcpy(address.sun_path, socket_path.c_str());
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socket_path.c_str());
+        if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(listen_fd, 16) != 0) {
+            if (listen_fd >= 0)
+                close(listen_fd);
+            throw std::runtime_error("Error listen socket: " + socket_path);
+        }
+
+        std::cerr << "Render server is listening " << socket_path << std::endl;
+        acceptor = std::thread(&RenderServer::AcceptConnections, this, listen_fd);
+    }
+
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            /* Stdin server stops at the end of input, socket server - only by "quit" */
+            queue_changed.wait(lock, [&] {
+                return !queue.empty() || stop || (socket_path.empty() && active_readers == 0);
+            });
+            bool stdin_closed = socket_path.empty() && active_readers == 0;
+
+            if (queue.empty() && (stop || stdin_closed))
+                break;
+
+            job = queue.top();
+            queue.pop();
+        }
+
+        TimelineSpan span("server job", "server");
+        auto start = std::chrono::steady_clock::now();
+        try {
+            handler(job.arguments);
+
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::stringstream ss;
+            ss << "done " << job.id << " " << ms;
+            job.connection->Send(ss.str());
+        } catch (const std::exception &e) {
+            std::stringstream ss;
+            ss << "failed " << job.id << " " << e.what();
+            job.connection->Send(ss.str());
+        }
+    }
+
+    /* Wake up readers and acceptor, they are blocked in read and accept */
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        for (auto &weak : connections) {
+            std::shared_ptr<Connection> connection = weak.lock();
+            if (connection && connection->owned)
+                shutdown(connection->input, SHUT_RDWR);
+        }
+    }
+
+    if (listen_fd >= 0) {
+        shutdown(listen_fd, SHUT_RDWR);
+        acceptor.join();
+        close(listen_fd);
+        unlink(socket_path.c_str());
+    }
+
+    /* Reader of stdin could be blocked forever after "quit", the process exits anyway */
+    bool blocked_stdin = socket_path.empty() && active_readers > 0;
+    for (auto &reader : readers) {
+        if (blocked_stdin)
+            reader.detach();
+        else
+            reader.join();
+    }
+}
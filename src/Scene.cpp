@@ -1,32 +1,230 @@
 #include "Scene.h"
+#include "Checkpoint.h"
+#include "Timeline.h"
 #include <sstream>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <omp.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <array>
+#include <typeinfo>
+
+/* Margin of figures bounds, the ray marching stops at EPS from surface */
+#define BOUNDS_MARGIN 0.1f
+
+/*
+ * Side of voxels grid of scene, that is used to find tiles affected by edits of figures, and side of coarse
+ * grid, that is marked by long steps of rays. Footprint of tile: passed fine voxels, passed coarse voxels,
+ * hit fine voxels
+ */
+#define FOOTPRINT_GRID 32
+#define FOOTPRINT_COARSE_SHIFT 2
+#define FOOTPRINT_COARSE_GRID (FOOTPRINT_GRID >> FOOTPRINT_COARSE_SHIFT)
+#define FOOTPRINT_WORDS (FOOTPRINT_GRID * FOOTPRINT_GRID * FOOTPRINT_GRID / 64)
+#define FOOTPRINT_COARSE_WORDS (FOOTPRINT_COARSE_GRID * FOOTPRINT_COARSE_GRID * FOOTPRINT_COARSE_GRID / 64)
+#define FOOTPRINT_HITS (FOOTPRINT_WORDS + FOOTPRINT_COARSE_WORDS)
+static_assert(FOOTPRINT_GRID <= 64 && 64 % FOOTPRINT_COARSE_GRID == 0, "Row of footprint voxels must be in one word");
+
+/* Maximal difference of color channel of reprojected pixel and its neighbours, shadow and color edges are traced */
+#define TEMPORAL_COLOR_THRESHOLD 8.0f
+
+/*
+ * Post antialiasing: edge is found, if the contrast of luma of pixel and its neighbours is at least
+ * POST_AA_THRESHOLD of their maximal luma and at least POST_AA_MIN_CONTRAST, or if the neighbours see other
+ * figure or their depths differ by POST_AA_DEPTH_RATIO. The end of edge is searched by POST_AA_SEARCH_STEPS
+ */
+#define POST_AA_THRESHOLD 0.125f
+#define POST_AA_MIN_CONTRAST 8.0f
+#define POST_AA_DEPTH_RATIO 0.05f
+#define POST_AA_SEARCH_STEPS 16
+
+/* Maximal distance of pixels from tangent plane of the first one, in sizes of cell between them at its depth */
+#define UPSAMPLE_PLANE_TOLERANCE 0.5f
+
+/* Hash of point coordinates, it is the seed of random numbers at this point */
+static uint32_t HashPoint(const Vector &point) {
+    uint32_t hash = 2166136261u;
+    const float coordinates[3] = {point.x, point.y, point.z};
+    for (float coordinate : coordinates) {
+        uint32_t bits;
+        memcpy(&bits, &coordinate, sizeof(bits));
+        hash = (hash ^ bits) * 16777619u;
+    }
+
+    /* Finalizer of murmur3, it mixes all bits */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash != 0 ? hash : 1;
+}
+
+/* Next random number in [0, 1) by xorshift32 */
+static float NextRandom(uint32_t &state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return float(state >> 8) / 16777216.0f;
+}
 
 Scene::Scene(const Vector &left_border, const Vector &right_border) :
+    light_tree_dirty(true),
+    footprints_key(0),
+    footprints_valid(false),
+    history_key(0),
+    history_view_key(0),
+    history_valid(false),
+    reused_count(0),
+    checkerboard_parity(0),
+    has_deadline(false),
     left_border(left_border),
     right_border(right_border),
     image_height(0),
-    image_width(0)
+    image_width(0),
+    buffer_first_row(0),
+    buffer_first_column(0)
 {}
 
+Scene::~Scene() {
+    for (auto figure : figures)
+        delete figure;
+}
+
+RenderSettings::RenderSettings(ArgumentsParser &argumentsParser) :
+    threads_number(argumentsParser.Get<int>("--threads")),
+    antialiasing(argumentsParser.Get<bool>("--antialiasing")),
+    shadow_threshold(argumentsParser.Get<float>("--shadow-threshold")),
+    light_samples(argumentsParser.Get<int>("--light-samples")),
+    light_cache_cell(argumentsParser.Get<float>("--light-cache-cell")),
+    light_cache_entries(argumentsParser.Get<int>("--light-cache-entries")),
+    band_height(argumentsParser.Get<int>("--band-height")),
+    async_output(argumentsParser.Get<bool>("--async-output")),
+    framebuffer_file(argumentsParser.Get<std::string>("--framebuffer-file")),
+    progressive(argumentsParser.Get<bool>("--progressive")),
+    preview_seconds(argumentsParser.Get<float>("--preview-seconds")),
+    preview_passes(argumentsParser.Get<int>("--preview-passes")),
+    max_reflections(std::max(0, std::min(argumentsParser.Get<int>("--max-reflections"), MAX_REFLECTIONS_LIMIT))),
+    aa_threshold(argumentsParser.Get<float>("--aa-threshold")),
+    time_budget(argumentsParser.Get<float>("--time-budget")),
+    checkpoint_file(argumentsParser.Get<std::string>("--checkpoint")),
+    checkpoint_seconds(argumentsParser.Get<float>("--checkpoint-seconds")),
+    resume(argumentsParser.Get<bool>("--resume")),
+    crop_x(0),
+    crop_y(0),
+    crop_width(0),
+    crop_height(0),
+    crop_full_output(argumentsParser.Get<bool>("--crop-full")),
+    incremental(argumentsParser.Get<bool>("--incremental")),
+    temporal(argumentsParser.Get<bool>("--temporal")),
+    preview_scale(std::max(1, argumentsParser.Get<int>("--preview-scale"))),
+    checkerboard(argumentsParser.Get<bool>("--checkerboard")),
+    post_antialiasing(argumentsParser.Get<bool>("--post-aa")),
+    verbose(true)
+{
+    /* Crop window "x,y,width,height" */
+    std::string crop = argumentsParser.Get<std::string>("--crop");
+    if (!crop.empty()) {
+        char comma1 = 0, comma2 = 0, comma3 = 0;
+        std::stringstream ss(crop);
+        ss >> crop_x >> comma1 >> crop_y >> comma2 >> crop_width >> comma3 >> crop_height;
+        if (ss.fail() || comma1 != ',' || comma2 != ',' || comma3 != ',' || crop_width <= 0 || crop_height <= 0) {
+            std::stringstream error;
+            error << "Bad crop window: " << crop << ", expected x,y,width,height";
+            throw std::runtime_error(error.str());
+        }
+    }
+}
+
+ShadowStats &ShadowStats::operator+=(const ShadowStats &stats) {
+    rays += stats.rays;
+    back_facing += stats.back_facing;
+    below_threshold += stats.below_threshold;
+    no_occluders += stats.no_occluders;
+    cache_hits += stats.cache_hits;
+    cache_misses += stats.cache_misses;
+    return *this;
+}
+
 void Scene::AddLight(const Vector &point) {
     lights.emplace_back(point);
+    light_tree_dirty = true;
+    light_cache.Clear();
+    footprints_valid = false;
+    history_valid = false;
 }
 
 void Scene::AddFigure(Figure *d) {
     figures.push_back(d);
+    figures_bounds.push_back(d->Bounds().Expand(BOUNDS_MARGIN));
+    light_cache.Clear();
+    footprints_valid = false;
+    history_valid = false;
+}
+
+void Scene::MoveFigure(size_t index, const Vector &offset) {
+    PlaceFigure(index, FigurePosition(index) + offset);
+}
+
+Vector Scene::FigurePosition(size_t index) const {
+    CheckFigureIndex(index);
+    return figures[index]->Position();
+}
+
+void Scene::PlaceFigure(size_t index, const Vector &position) {
+    CheckFigureIndex(index);
+
+    /* Tiles, that saw the old or the new place of figure, are traced again */
+    moved_regions.push_back(figures_bounds[index]);
+    figures[index]->MoveTo(position);
+    figures_bounds[index] = figures[index]->Bounds().Expand(BOUNDS_MARGIN);
+    moved_regions.push_back(figures_bounds[index]);
+    light_cache.Clear();
+
+    /* Shadows of figure are changed, so lighting of history is not valid */
+    history_valid = false;
+}
+
+void Scene::CheckFigureIndex(size_t index) const {
+    if (index >= figures.size()) {
+        std::stringstream ss;
+        ss << "Figure " << index << " does not exist, scene has " << figures.size() << " figures";
+        throw std::runtime_error(ss.str());
+    }
+}
+
+void Scene::SetFigureColor(size_t index, const Pixel &color) {
+    CheckFigureIndex(index);
+
+    recolored_regions.push_back(figures_bounds[index]);
+    figures[index]->DefaultColor(color);
+    history_valid = false;
 }
 
-void Scene::ConfigureCamera(Camera &camera, int pixel_height, int pixel_width) {
+void Scene::ConfigureCamera(Camera &camera, int pixel_width, int pixel_height) {
     this->camera = camera;
 
     image_width = pixel_width;
     image_height = pixel_height;
 
-    pixel_matrix.resize(pixel_height);
-    for (int i = 0; i < pixel_height; i++) {
-        pixel_matrix[i].resize(pixel_width);
-    }
+    /* Look at the picture */
+    half_width = image_width / 2;
+    half_height = image_height / 2;
+
+    float gip_y = camera.distance / float(sin(M_PI / 4.0f));
+    float gip_x = camera.distance / float(sin(M_PI / 4.0f));
+
+    float right_length = gip_x * float(cos(M_PI / 4.0f));
+    float up_length = gip_y * float(cos(M_PI / 4.0f));
+
+    screen_up = camera.up * up_length;
+    screen_right = camera.right * right_length;
+
+    vector_to_screen = camera.direction * camera.distance;
 }
 
 /*
@@ -40,100 +238,1424 @@ void Scene::ConfigureCamera(Camera &camera, int pixel_height, int pixel_width) {
  |         |         |
  |-------------------|
  */
+Vector Scene::PrimaryRayDirection(float x, float y) const {
+    Vector dir_y = screen_up    * (y / float(half_height));
+    Vector dir_x = screen_right * (x / float(half_width));
+
+    Vector direction = vector_to_screen + dir_x + dir_y;
+    direction.normalize();
+
+    return direction;
+}
+
+std::vector<RenderTile> Scene::MakeTiles(int tile_size, int first_row, int last_row) const {
+    std::vector<RenderTile> tiles;
+    for (int y = first_row; y < last_row; y += tile_size) {
+        for (int x = window.x0; x < window.x1; x += tile_size) {
+            tiles.emplace_back(x, y, std::min(x + tile_size, window.x1), std::min(y + tile_size, last_row));
+        }
+    }
+    return tiles;
+}
+
 void Scene::StartTraceRacing(ArgumentsParser &argumentsParser) {
+    StartTraceRacing(RenderSettings(argumentsParser));
+}
 
-    std::cout << "Start Trace" << std::endl;
+void Scene::StartTraceRacing(const RenderSettings &settings) {
+    PrepareRender(settings);
 
-    /* Look at the picture */
-    int width = image_width / 2;
-    int height = image_height / 2;
+    TimelineSpan span("StartTraceRacing", "trace");
 
-    float gip_y = camera.distance / float(sin(M_PI / 4.0f));
-    float gip_x = camera.distance / float(sin(M_PI / 4.0f));
+    AllocateFrameBuffer(window.y0, window.y1);
+    TraceRows(window.y0, window.y1, FullPass());
 
-    float right_length = gip_x * float(cos(M_PI / 4.0f));
-    float up_length = gip_y * float(cos(M_PI / 4.0f));
+    FinishRender();
+}
+
+void Scene::StartTraceRacing(const RenderSettings &settings, ImageWriter &writer, const std::string &filename) {
+    /* Frame buffer keeps the previous image, if nothing but figures was changed after it */
+    uint64_t view_key = ViewKey(settings);
+    bool reuse = settings.incremental && footprints_valid && footprints_key == view_key;
+    std::vector<BoundingBox> moved, recolored;
+    moved.swap(moved_regions);
+    recolored.swap(recolored_regions);
+
+    /* History of the previous frame is valid, if only camera was changed after it */
+    uint64_t settings_key = SettingsKey(settings);
+    bool reproject = (settings.temporal || settings.checkerboard) && history_valid && history_key == settings_key;
+    reused_count = 0;
+
+    PrepareRender(settings);
+
+    TimelineSpan span("StartTraceRacing", "trace");
+
+    /* Mapped frame buffer and checkpoint hold the whole image */
+    bool whole_image = !settings.framebuffer_file.empty() || !settings.checkpoint_file.empty();
+    int window_height = window.y1 - window.y0;
+    int band_height = settings.band_height > 0 && !whole_image ? settings.band_height : window_height;
+    if (settings.verbose && band_height < window_height)
+        std::cout << "Streaming bands of " << band_height << " rows to " << filename << std::endl;
+
+    /* Lattice of preview scale is traced and interpolated, if the image is in memory */
+    bool in_memory = band_height == window_height && !whole_image;
+    int scale = in_memory ? settings.preview_scale : 1;
 
-    Vector true_up = camera.up * up_length;
-    Vector true_right = camera.right * right_length;
+    /* Half of pixels is traced by checkerboard, the other half is taken from the previous frame or neighbours */
+    bool checkerboard = settings.checkerboard && in_memory && scale == 1;
+    int parity = checkerboard_parity;
+    if (checkerboard)
+        checkerboard_parity = 1 - parity;
 
-    Vector vector_to_screen = camera.direction * camera.distance;
-    Vector direction;
+    /* Hits of pixels are kept for the next frame, if the image is in memory */
+    bool temporal = (settings.temporal || checkerboard) && in_memory && scale == 1;
 
-    float shift_x[4] = {-0.5f, 0.5f, 0.5f, -0.5f};
-    float shift_y[4] = {0.5f, 0.5f, -0.5f, -0.5f};
+    /* Light cache keeps visibility of old figures, bands do not keep the image, so they are traced fully */
+    bool record = settings.incremental && !temporal && scale == 1 && in_memory &&
+                  !light_cache.Enabled();
 
-    Vector dir_y;
-    Vector dir_x;
+    /* Post antialiasing finds edges of figures by hits, if the image is in memory, and by colors only otherwise */
+    bool post_antialiasing = settings.post_antialiasing;
+    bool hits = temporal || scale > 1 || (post_antialiasing && in_memory);
+    size_t pixels = size_t(window.x1 - window.x0) * window_height;
+    std::vector<Color> antialiased;
 
-    Vector color;
+    /* Hits of tiles, that are kept by incremental render, are kept from the previous render too */
+    bool keep_hits = hits && record && reuse && frame_figures.size() == pixels;
+    if (!keep_hits) {
+        frame_points.clear();
+        frame_figures.clear();
+    }
+    if (hits) {
+        if (!keep_hits) {
+            frame_points.assign(pixels, Vector());
+            frame_figures.assign(pixels, nullptr);
+        }
+        thread_hits.assign(std::max(1, settings.threads_number), PrimaryHit());
+        reproject = reproject && history_points.size() == pixels;
+    }
 
-    int threads_number = static_cast<int>(argumentsParser.Get<int>("--threads"));
-    std::cout << "Threads number: " << threads_number << std::endl;
-    if (argumentsParser.Get<bool>("--antialiasing"))
-        std::cout << "Antialiasing enable" << std::endl;
+    if (record) {
+        std::vector<RenderTile> tiles = MakeTiles(TILE_SIZE, window.y0, window.y1);
+        if (reuse && tile_footprints.size() == tiles.size()) {
+            int traced = KeepCleanTiles(tiles, moved, recolored);
+            if (settings.verbose)
+                std::cout << "Incremental render: " << traced << " of " << tiles.size() << " tiles are traced" << std::endl;
+        } else {
+            tile_footprints.assign(tiles.size(), std::vector<uint64_t>());
+        }
+        thread_footprints.assign(std::max(1, settings.threads_number), FootprintRecorder());
+    }
+
+    /* Only crop window is written, or the whole image with black pixels outside of window */
+    bool full_output = settings.crop_full_output;
+    int output_y = full_output ? 0 : window.y0;
+    if (full_output)
+        writer.Open(filename, image_width, image_height);
     else
-        std::cout << "Antialiasing disabled" << std::endl;
+        writer.Open(filename, window.x1 - window.x0, window_height);
+
+    std::vector<Color> full_row;
+    if (full_output && (window.x1 - window.x0) < image_width)
+        full_row.assign(image_width, Color());
+
+    auto write_row = [&](int row, const Color *colors) {
+        if (!full_row.empty()) {
+            std::copy(colors, colors + (window.x1 - window.x0), full_row.begin() + window.x0);
+            colors = full_row.data();
+        }
+        writer.WriteRow(row - output_y, colors);
+    };
+
+    /* Rows of every finished line of tiles are written at once, while other tiles are traced */
+    std::mutex writer_mutex;
+    auto write_rows = [&](int first_row, int last_row) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        TimelineSpan write_span("write rows", "output", 0, first_row);
+        for (int row = first_row; row < last_row; row++)
+            write_row(row, frame_buffer.Row(row - buffer_first_row));
+    };
+
+    if (full_output && window_height < image_height) {
+        std::vector<Color> black_row(image_width, Color());
+        for (int row = 0; row < image_height; row++) {
+            if (row < window.y0 || row >= window.y1)
+                writer.WriteRow(row, black_row.data());
+        }
+    }
+
+    for (int y = window.y0; y < window.y1; y += band_height) {
+        int last_row = std::min(y + band_height, window.y1);
+
+        AllocateFrameBuffer(y, last_row);
+
+        if (temporal && reproject) {
+            reused_count = ReprojectHistory(history_view_key == view_key);
+            if (settings.verbose)
+                std::cout << "Temporal reprojection: " << reused_count << " of " << frame_points.size()
+                          << " pixels are reused" << std::endl;
+        }
+
+        if (scale > 1) {
+            TraceRows(y, last_row, RenderPass(scale, 0, 0, 1, false));
+            int traced = UpsampleLattice(scale);
+            if (settings.verbose)
+                std::cout << "Preview scale " << scale << ": " << traced << " of " << frame_points.size()
+                          << " pixels are traced at edges" << std::endl;
+        }
+
+        if (checkerboard) {
+            /* Reprojected pixels of the traced half are traced again, so every pixel is fresh in every other frame */
+            reused_pixels.resize(frame_points.size(), 0);
+            int width = window.x1 - window.x0;
+            for (int row = window.y0; row < window.y1; row++) {
+                for (int x = window.x0 + (window.x0 + row + parity) % 2; x < window.x1; x += 2)
+                    reused_pixels[size_t(row - window.y0) * width + (x - window.x0)] = 0;
+            }
+            int antialiasing_side_number = FullPass().antialiasing_side_number;
+            TraceRows(y, last_row, RenderPass(2, parity, 0, antialiasing_side_number, false));
+            TraceRows(y, last_row, RenderPass(2, 1 - parity, 1, antialiasing_side_number, false));
+            int traced = ReconstructCheckerboard(parity);
+            if (settings.verbose)
+                std::cout << "Checkerboard: " << traced << " of " << frame_points.size()
+                          << " pixels are traced at edges" << std::endl;
+        }
+
+        if (!settings.checkpoint_file.empty()) {
+            /* Checkpoint stores tiles in coordinates of frame buffer */
+            std::vector<RenderTile> tiles = MakeTiles(TILE_SIZE, window.y0, window.y1);
+            for (auto &tile : tiles)
+                tile = RenderTile(tile.x0 - window.x0, tile.y0 - window.y0, tile.x1 - window.x0, tile.y1 - window.y0);
+
+            checkpoint.reset(new Checkpoint(settings.checkpoint_file, settings.checkpoint_seconds));
+            int loaded = checkpoint->Start(frame_buffer, tiles, RenderKey(settings), settings.resume);
+            if (settings.verbose && settings.resume)
+                std::cout << "Resumed " << loaded << " tiles from " << settings.checkpoint_file << std::endl;
+        }
+
+        /*
+         * Post antialiasing needs the neighbour rows, so the band is written, when it is traced whole. Frame buffer
+         * keeps the traced colors, they are the history of the next frame and the kept tiles of incremental render
+         */
+        if (post_antialiasing) {
+            TraceRows(y, last_row, FullPass());
+            PostAntialiasing(y, last_row, antialiased);
+            TimelineSpan write_span("write rows", "output", 0, y);
+            int width = window.x1 - window.x0;
+            for (int row = y; row < last_row; row++)
+                write_row(row, &antialiased[size_t(row - y) * width]);
+        } else {
+            TraceRows(y, last_row, FullPass(), write_rows);
+        }
+    }
+
+    writer.Close();
+
+    /* The image is complete, the checkpoint is not needed */
+    if (checkpoint) {
+        checkpoint->Finish();
+        checkpoint.reset();
+    }
+
+    /* Colors and hits of this frame are the history of the next one */
+    if (temporal) {
+        int width = window.x1 - window.x0;
+        history_colors.resize(frame_points.size());
+        for (int y = 0; y < window_height; y++) {
+            const Color *row = frame_buffer.Row(y);
+            std::copy(row, row + width, history_colors.begin() + size_t(y) * width);
+        }
+        history_points.swap(frame_points);
+        history_figures.swap(frame_figures);
+        history_valid = true;
+        history_key = settings_key;
+        history_view_key = view_key;
+    }
+    /* Incremental render keeps hits of the frame for post antialiasing of its kept tiles */
+    if (!(record && post_antialiasing)) {
+        frame_points.clear();
+        frame_figures.clear();
+    }
+    reused_pixels.clear();
+    thread_hits.clear();
+
+    /* The last band is not the image, it must not be saved by SaveImage */
+    if (band_height < window_height)
+        AllocateFrameBuffer(0, 0);
+
+    if (record) {
+        thread_footprints.clear();
+        kept_tiles.clear();
+        footprints_valid = true;
+        footprints_key = view_key;
+    }
+
+    FinishRender();
+}
+
+void Scene::TraceRegion(const RenderSettings &settings, const RenderTile &region, std::vector<Color> &colors) {
+    RenderSettings region_settings = settings;
+    region_settings.crop_x = region.x0;
+    region_settings.crop_y = region.y0;
+    region_settings.crop_width = region.x1 - region.x0;
+    region_settings.crop_height = region.y1 - region.y0;
+    region_settings.framebuffer_file.clear();
+    region_settings.checkpoint_file.clear();
 
-#pragma omp parallel num_threads(threads_number)
-    {
-    #pragma omp for private(direction, dir_x, dir_y, color) schedule(dynamic, height / 4)
-    for (int y = -height; y < height; y++) {
-        for (int x = -width; x < width; x++) {
+    StartTraceRacing(region_settings);
 
-            color = Vector(0, 0, 0);
+    int width = window.x1 - window.x0;
+    colors.resize(size_t(width) * (window.y1 - window.y0));
+    for (int y = window.y0; y < window.y1; y++) {
+        const Color *row = frame_buffer.Row(y - buffer_first_row);
+        std::copy(row, row + width, colors.begin() + size_t(width) * (y - window.y0));
+    }
+}
+
+void Scene::StartProgressiveTraceRacing(const RenderSettings &settings, ImageWriter &writer, const std::string &filename) {
+    PrepareRender(settings);
+
+    TimelineSpan span("StartProgressiveTraceRacing", "trace");
+
+    if (window.x1 - window.x0 != image_width || window.y1 - window.y0 != image_height)
+        throw std::runtime_error("Crop window is not supported by progressive render and time budget");
+    if (settings.preview_scale > 1)
+        throw std::runtime_error("Preview scale is not supported by progressive render and time budget");
+
+    AllocateFrameBuffer(0, image_height);
+
+    auto start = std::chrono::steady_clock::now();
+    bool budget = settings.time_budget > 0;
+    if (budget) {
+        /* The rest of budget is left for output of image */
+        has_deadline = true;
+        deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(settings.time_budget * 0.95));
+        this->settings.max_reflections = std::min(settings.max_reflections, MAX_REFLECTIONS_LIMIT);
+        this->settings.aa_threshold = 0;
+    }
+
+    std::vector<RenderTile> tiles = MakeTiles(TILE_SIZE, 0, image_height);
+    std::vector<int> tile_passes(tiles.size(), 0);
+
+    std::vector<RenderPass> passes = ProgressivePasses(budget || settings.antialiasing);
+    int skipped_tiles = 0;
+
+    auto last_preview = start;
+    for (size_t i = 0; i < passes.size(); i++) {
+        auto pass_start = std::chrono::steady_clock::now();
+        skipped_tiles += TracePass(tiles, passes[i], int(i), tile_passes);
+        auto pass_end = std::chrono::steady_clock::now();
+
+        if (budget && i == 0) {
+            double first_pass_seconds = std::chrono::duration<double>(pass_end - pass_start).count();
+            double seconds_left = std::chrono::duration<double>(deadline - pass_end).count();
+
+            bool antialiasing;
+            if (ChooseQuality(first_pass_seconds, seconds_left, antialiasing))
+                TracePass(tiles, passes[0], 0, tile_passes);
+            if (!antialiasing)
+                passes = ProgressivePasses(false);
+        } else if (budget && passes[i].antialiasing_side_number > 1 && i + 1 < passes.size()) {
+            /* Adapt threshold of antialiasing to time, that is left for the rest passes */
+            double pass_seconds = std::chrono::duration<double>(pass_end - pass_start).count();
+            double seconds_left = std::chrono::duration<double>(deadline - pass_end).count();
+            double per_pass = seconds_left / double(passes.size() - i - 1);
+
+            float &threshold = this->settings.aa_threshold;
+            if (pass_seconds > per_pass)
+                threshold = threshold > 0 ? threshold * 2 : 4;
+            else if (pass_seconds < per_pass / 2 && threshold > 0)
+                threshold = threshold > 1 ? threshold / 2 : 0;
+        }
+
+        if (i + 1 == passes.size())
+            break;
+
+        float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - last_preview).count();
+        bool by_time = settings.preview_seconds > 0 && seconds >= settings.preview_seconds;
+        bool by_passes = settings.preview_passes > 0 && (i + 1) % settings.preview_passes == 0;
+        if (settings.progressive && (by_time || by_passes)) {
+            if (settings.verbose)
+                std::cout << "Preview after pass " << i + 1 << " of " << passes.size() << std::endl;
+            WritePreview(writer, filename, passes, tile_passes);
+            last_preview = std::chrono::steady_clock::now();
+        }
+    }
+
+    has_deadline = false;
+
+    if (budget && settings.verbose) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Time budget: traced in " << seconds << " s, skipped tiles of passes: " << skipped_tiles;
+        if (this->settings.aa_threshold > 0)
+            std::cout << ", final antialiasing threshold " << this->settings.aa_threshold;
+        std::cout << std::endl;
+    }
+
+    /* Post antialiasing is applied to the final image, if time budget was enough to trace all its pixels */
+    if (settings.post_antialiasing) {
+        bool complete = true;
+        for (int passes_done : tile_passes)
+            complete = complete && passes_done == int(passes.size());
+
+        if (complete) {
+            std::vector<Color> antialiased;
+            PostAntialiasing(0, image_height, antialiased);
+            for (int y = 0; y < image_height; y++)
+                std::copy(&antialiased[size_t(y) * image_width], &antialiased[size_t(y + 1) * image_width],
+                          frame_buffer.Row(y));
+        }
+        else if (settings.verbose)
+            std::cout << "Post antialiasing is skipped, the image is not traced whole" << std::endl;
+    }
+
+    WritePreview(writer, filename, passes, tile_passes);
 
-            int antialiasing_side_number = (argumentsParser.Get<bool>("--antialiasing")) ? 4 : 1;
+    FinishRender();
+}
+
+RenderPass Scene::FullPass() const {
+    return RenderPass(1, 0, 0, settings.antialiasing ? 4 : 1);
+}
+
+std::vector<RenderPass> Scene::ProgressivePasses(bool antialiasing) const {
+    std::vector<RenderPass> passes;
+
+    /* Every 8th pixel of every 8th row */
+    passes.emplace_back(8, 0, 0, 1, false);
+
+    /* Then the centers of gaps between traced pixels, the step is halved by every 3 passes */
+    for (int step = 8; step > 1; step /= 2) {
+        int half = step / 2;
+        passes.emplace_back(step, half, half, 1, false);
+        passes.emplace_back(step, half, 0, 1, false);
+        passes.emplace_back(step, 0, half, 1, !antialiasing && step == 2);
+    }
+
+    /* Antialiasing replaces colors of pixels, it is split to 4 passes for more previews */
+    if (antialiasing) {
+        const int offsets[4][2] = {{0, 0}, {1, 1}, {1, 0}, {0, 1}};
+        for (int i = 0; i < 4; i++)
+            passes.emplace_back(2, offsets[i][0], offsets[i][1], 4, i == 3);
+    }
+
+    return passes;
+}
+
+int Scene::TracePass(const std::vector<RenderTile> &tiles, const RenderPass &pass, int pass_index,
+                     std::vector<int> &tile_passes) {
+    int tiles_count = static_cast<int>(tiles.size());
+    std::atomic<int> skipped(0);
+
+#pragma omp parallel for num_threads(settings.threads_number) schedule(dynamic, 1)
+    for (int i = 0; i < tiles_count; i++) {
+        /* The tile, that missed some pass, is not traced by the next ones */
+        if (tile_passes[i] < pass_index || (has_deadline && std::chrono::steady_clock::now() >= deadline)) {
+            skipped++;
+            continue;
+        }
 
-            for (int i = 0; i < antialiasing_side_number; i++) {
-                dir_y = true_up    * ((y + shift_y[i]) / float(height));
-                dir_x = true_right * ((x + shift_x[i]) / float(width));
+        TraceTile(tiles[i], pass);
+        tile_passes[i] = std::max(tile_passes[i], pass_index + 1);
+        if (pass.last)
+            frame_buffer.MarkTileDone(tiles[i].x0, tiles[i].y0);
+    }
+
+    return skipped;
+}
+
+void Scene::WritePreview(ImageWriter &writer, const std::string &filename,
+                         const std::vector<RenderPass> &passes, const std::vector<int> &tile_passes) {
+    TimelineSpan span("write preview", "output");
+
+    int tiles_in_line = (image_width + TILE_SIZE - 1) / TILE_SIZE;
+    auto is_traced = [&](int x, int y) {
+        int passes_done = tile_passes[(y / TILE_SIZE) * tiles_in_line + x / TILE_SIZE];
+        for (int i = 0; i < passes_done; i++) {
+            if (passes[i].antialiasing_side_number == 1 && passes[i].Contains(x, y))
+                return true;
+        }
+        return false;
+    };
+
+    writer.Open(filename, image_width, image_height);
 
-                direction = vector_to_screen + dir_x + dir_y;
-                direction.normalize();
+    std::vector<Color> row(image_width);
+    for (int y = 0; y < image_height; y++) {
+        for (int x = 0; x < image_width; x++) {
+            int step = 1;
+            while (step <= 8 && !is_traced(x / step * step, y / step * step))
+                step *= 2;
 
-                Pixel pixel = Scene::GetColorOfRay(camera.position, direction);
+            /* The tile was not traced at all before deadline */
+            row[x] = step <= 8 ? frame_buffer.At(x / step * step, y / step * step) : Color();
+        }
+        writer.WriteRow(y, row.data());
+    }
 
-                color.x += pixel.value.Red; color.y += pixel.value.Green; color.z += pixel.value.Blue;
+    writer.Close();
+}
+
+bool Scene::ChooseQuality(double first_pass_seconds, double seconds_left, bool &antialiasing) {
+    /* Rays of the first pass by depth */
+    long long rays[MAX_REFLECTIONS_LIMIT + 1] = {};
+    long long total_rays = 0;
+    for (auto &stats : ray_stats) {
+        for (int depth = 0; depth <= MAX_REFLECTIONS_LIMIT; depth++) {
+            rays[depth] += stats.rays[depth];
+            total_rays += stats.rays[depth];
+        }
+    }
+
+    double pixels = double(image_width) * image_height;
+    double first_pass_pixels = std::max(1.0, pixels / 64);
+
+    /* Estimates are not exact, so only part of time is planned */
+    double planned = seconds_left * 0.8;
+
+    /* Time of one pixel with depth of reflections */
+    auto pixel_seconds = [&](int depth) {
+        long long rays_to_depth = 0;
+        for (int i = 0; i <= depth; i++)
+            rays_to_depth += rays[i];
+        return first_pass_seconds / first_pass_pixels * double(rays_to_depth) / double(std::max(1LL, total_rays));
+    };
+
+    int max_depth = settings.max_reflections;
+    int depth = max_depth;
+    while (depth > 0) {
+        double retrace = depth < max_depth ? first_pass_pixels : 0;
+        if (pixel_seconds(depth) * (pixels - first_pass_pixels + retrace) <= planned)
+            break;
+        depth--;
+    }
+    settings.max_reflections = depth;
+
+    double retrace = depth < max_depth ? first_pass_pixels : 0;
+    double geometry_seconds = pixel_seconds(depth) * (pixels - first_pass_pixels + retrace);
+    double aa_seconds_left = planned - geometry_seconds;
+
+    /* Antialiasing traces 4 rays per pixel, the adaptive one traces from 2 to 4 */
+    double full_aa_seconds = 4 * pixel_seconds(depth) * pixels;
+    if (aa_seconds_left >= full_aa_seconds) {
+        antialiasing = true;
+        settings.aa_threshold = 0;
+    } else if (aa_seconds_left >= full_aa_seconds / 2) {
+        antialiasing = true;
+
+        /* The initial threshold, it is adapted after every antialiasing pass */
+        settings.aa_threshold = 8;
+    } else {
+        antialiasing = false;
+    }
+
+    if (settings.verbose) {
+        std::cout << "Time budget: first pass " << first_pass_seconds << " s, "
+                  << "reflections depth " << depth << " of " << max_depth << ", ";
+        if (!antialiasing)
+            std::cout << "antialiasing disabled";
+        else if (settings.aa_threshold > 0)
+            std::cout << "adaptive antialiasing with threshold " << settings.aa_threshold;
+        else
+            std::cout << "antialiasing enable";
+        std::cout << ", estimated time of geometry " << geometry_seconds << " s" << std::endl;
+    }
+
+    return depth < max_depth;
+}
+
+RenderTile Scene::RenderWindow(const RenderSettings &settings) const {
+    RenderTile window(0, 0, image_width, image_height);
+    if (settings.crop_width > 0 && settings.crop_height > 0) {
+        window = RenderTile(std::max(0, settings.crop_x), std::max(0, settings.crop_y),
+                            std::min(image_width, settings.crop_x + settings.crop_width),
+                            std::min(image_height, settings.crop_y + settings.crop_height));
+        if (window.x0 >= window.x1 || window.y0 >= window.y1)
+            throw std::runtime_error("Crop window is outside of image");
+    }
+    return window;
+}
+
+void Scene::PrepareRender(const RenderSettings &settings) {
+    this->settings = settings;
+    window = RenderWindow(settings);
+
+    /* Any render changes frame buffer, the next incremental render has to trace everything */
+    footprints_valid = false;
+    history_valid = false;
+    moved_regions.clear();
+    recolored_regions.clear();
+
+    if (settings.verbose) {
+        std::cout << "Start Trace" << std::endl;
+        std::cout << "Threads number: " << settings.threads_number << std::endl;
+        if (settings.antialiasing)
+            std::cout << "Antialiasing enable" << std::endl;
+        else
+            std::cout << "Antialiasing disabled" << std::endl;
+    }
+
+    shadow_stats.assign(std::max(1, settings.threads_number), ShadowStats());
+    ray_stats.assign(std::max(1, settings.threads_number), RayStats());
+
+    /* Stored results are kept between renders, while the cell size is the same */
+    if (settings.light_cache_cell != light_cache.CellSize()) {
+        light_cache.Configure(settings.light_cache_cell, static_cast<size_t>(std::max(1, settings.light_cache_entries)));
+    }
+
+    if (settings.light_samples > 0 && light_tree_dirty) {
+        TimelineSpan tree_span("build light tree", "setup");
+
+        std::vector<Vector> positions;
+        for (auto &light : lights)
+            positions.push_back(light.source);
+        light_tree.Build(positions);
+        light_tree_dirty = false;
+    }
+}
+
+void Scene::AllocateFrameBuffer(int first_row, int last_row) {
+    buffer_first_row = first_row;
+    buffer_first_column = window.x0;
+
+    int width = window.x1 - window.x0;
+    if (!settings.framebuffer_file.empty() && first_row == window.y0 && last_row == window.y1) {
+        if (settings.verbose)
+            std::cout << "Frame buffer is mapped to " << settings.framebuffer_file << std::endl;
+        frame_buffer.MapFile(settings.framebuffer_file, width, last_row - first_row, TILE_SIZE);
+        return;
+    }
+
+    frame_buffer.Resize(width, last_row - first_row);
+}
+
+void Scene::TraceRows(int first_row, int last_row, const RenderPass &pass,
+                      const std::function<void(int, int)> &on_rows_ready) {
+    std::vector<RenderTile> tiles = MakeTiles(TILE_SIZE, first_row, last_row);
+    int tiles_count = static_cast<int>(tiles.size());
+
+    /* Number of finished tiles in every line of tiles */
+    int tiles_in_line = (window.x1 - window.x0 + TILE_SIZE - 1) / TILE_SIZE;
+    int lines_count = (last_row - first_row + TILE_SIZE - 1) / TILE_SIZE;
+    std::unique_ptr<std::atomic<int>[]> finished_in_line(new std::atomic<int>[lines_count]);
+    for (int i = 0; i < lines_count; i++)
+        finished_in_line[i] = 0;
+
+#pragma omp parallel for num_threads(settings.threads_number) schedule(dynamic, 1)
+    for (int i = 0; i < tiles_count; i++) {
+        /* Tiles of checkpoint are loaded to frame buffer already, clean tiles of incremental render are kept */
+        if ((!checkpoint || !checkpoint->Restored(i)) && (kept_tiles.empty() || !kept_tiles[i])) {
+            if (!thread_footprints.empty()) {
+                /* Footprint of tile is recorded from scratch: passed voxels, then hit voxels */
+                tile_footprints[i].assign(FOOTPRINT_HITS + FOOTPRINT_WORDS, 0);
+                FootprintRecorder &recorder = thread_footprints[omp_get_thread_num()];
+                recorder.footprint = tile_footprints[i].data();
+                std::fill(recorder.last_range, recorder.last_range + 6, -1);
             }
 
-            color = color / float(antialiasing_side_number);
+            TraceTile(tiles[i], pass);
 
-            pixel_matrix[y + height][x + width] = Pixel(color.x, color.y, color.z);
+            if (!thread_footprints.empty())
+                thread_footprints[omp_get_thread_num()].footprint = nullptr;
+            if (checkpoint)
+                checkpoint->MarkTileDone(i);
+        }
+
+        if (pass.last)
+            frame_buffer.MarkTileDone(tiles[i].x0 - buffer_first_column, tiles[i].y0 - first_row);
+
+        if (on_rows_ready) {
+            int line = (tiles[i].y0 - first_row) / TILE_SIZE;
+            if (finished_in_line[line].fetch_add(1) + 1 == tiles_in_line)
+                on_rows_ready(tiles[i].y0, tiles[i].y1);
         }
     }
+}
+
+void Scene::FinishRender() {
+    frame_buffer.MarkFinished();
+
+    if (settings.verbose) {
+        ShadowStats total;
+        for (auto &stats : shadow_stats)
+            total += stats;
+
+        std::cout << "Shadow rays: " << total.rays
+                  << ", skipped: back facing " << total.back_facing
+                  << ", below threshold " << total.below_threshold
+                  << ", no occluders " << total.no_occluders << std::endl;
+        if (light_cache.Enabled()) {
+            std::cout << "Light cache: hits " << total.cache_hits
+                      << ", misses " << total.cache_misses << std::endl;
+        }
+        std::cout << "End Trace" << std::endl;
     }
+}
+
+/* FNV-1a hash of keys of render */
+static void HashBytes(uint64_t &hash, const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+}
+
+static void HashVector(uint64_t &hash, const Vector &vector) {
+    const float coordinates[3] = {vector.x, vector.y, vector.z};
+    HashBytes(hash, coordinates, sizeof(coordinates));
+}
+
+uint64_t Scene::SettingsKey(const RenderSettings &settings) const {
+    uint64_t hash = 14695981039346656037ull;
+
+    RenderTile window = RenderWindow(settings);
+    const int sizes[13] = {image_width, image_height, settings.antialiasing, settings.light_samples, settings.max_reflections,
+                           window.x0, window.y0, window.x1, window.y1, settings.crop_full_output, settings.preview_scale,
+                           settings.checkerboard, settings.post_antialiasing};
+    HashBytes(hash, sizes, sizeof(sizes));
+    const float thresholds[3] = {settings.shadow_threshold, settings.light_cache_cell, settings.aa_threshold};
+    HashBytes(hash, thresholds, sizeof(thresholds));
+
+    HashVector(hash, left_border);
+    HashVector(hash, right_border);
+
+    for (auto &light : lights)
+        HashVector(hash, light.source);
 
-    std::cout << "End Trace" << std::endl;
+    return hash;
 }
 
-Pixel Scene::GetColorOfRay(const Vector &source, const Vector &direction, int reflect_count) {
+uint64_t Scene::ViewKey(const RenderSettings &settings) const {
+    uint64_t hash = SettingsKey(settings);
+
+    HashVector(hash, camera.position);
+    HashVector(hash, camera.direction);
+    HashVector(hash, camera.up);
+    HashVector(hash, camera.right);
+    HashBytes(hash, &camera.distance, sizeof(camera.distance));
+
+    return hash;
+}
+
+uint64_t Scene::RenderKey(const RenderSettings &settings) const {
+    uint64_t hash = ViewKey(settings);
+
+    /* Kind and bounds define the figure of every kind: sphere, box and torus */
+    for (size_t i = 0; i < figures.size(); i++) {
+        Figure *figure = figures[i];
+        const char *kind = typeid(*figure).name();
+        HashBytes(hash, kind, strlen(kind));
+        HashVector(hash, figures_bounds[i].min);
+        HashVector(hash, figures_bounds[i].max);
+
+        Color color(figure->DefaultColor());
+        const float material[7] = {color.r, color.g, color.b,
+                                   figure->IsReflectable() ? figure->ReflectCoefficient() : -1.0f,
+                                   figure->Refractable() ? figure->RefractableCoefficient() : -1.0f,
+                                   figure->Refractable() ? figure->RefractableEta() : -1.0f,
+                                   float(figure->IsConvex())};
+        HashBytes(hash, material, sizeof(material));
+    }
+
+    return hash;
+}
+
+/* Range of voxels [from, to] of footprint grid, that intersect box [min, max] */
+static void VoxelRange(const Vector &min, const Vector &max, const Vector &left_border, const Vector &right_border,
+                       int from[3], int to[3]) {
+    const float box_min[3] = {min.x - left_border.x, min.y - left_border.y, min.z - left_border.z};
+    const float box_max[3] = {max.x - left_border.x, max.y - left_border.y, max.z - left_border.z};
+    const float size[3] = {right_border.x - left_border.x, right_border.y - left_border.y, right_border.z - left_border.z};
+
+    /* Negative coordinates are truncated to 0 like floored ones are clamped */
+    for (int axis = 0; axis < 3; axis++) {
+        float scale = FOOTPRINT_GRID / size[axis];
+        from[axis] = std::max(0, std::min(FOOTPRINT_GRID - 1, int(box_min[axis] * scale)));
+        to[axis] = std::max(0, std::min(FOOTPRINT_GRID - 1, int(box_max[axis] * scale)));
+    }
+}
+
+static void CoarseRange(const int range[6], int coarse[6]) {
+    for (int i = 0; i < 6; i++)
+        coarse[i] = range[i] >> FOOTPRINT_COARSE_SHIFT;
+}
+
+/* Mark voxels of range [x0, y0, z0, x1, y1, z1] in grid of side, voxels of one row along x are bits of one word */
+static void MarkVoxels(uint64_t *footprint, int side, const int range[6]) {
+    uint64_t row_mask = ((uint64_t(1) << (range[3] - range[0] + 1)) - 1) << range[0];
+    for (int z = range[2]; z <= range[5]; z++) {
+        for (int y = range[1]; y <= range[4]; y++) {
+            size_t index = (size_t(z) * side + y) * side;
+            footprint[index / 64] |= row_mask << (index % 64);
+        }
+    }
+}
+
+static bool HasVoxels(const uint64_t *footprint, int side, const int range[6]) {
+    uint64_t row_mask = ((uint64_t(1) << (range[3] - range[0] + 1)) - 1) << range[0];
+    for (int z = range[2]; z <= range[5]; z++) {
+        for (int y = range[1]; y <= range[4]; y++) {
+            size_t index = (size_t(z) * side + y) * side;
+            if (footprint[index / 64] & (row_mask << (index % 64)))
+                return true;
+        }
+    }
+    return false;
+}
+
+static void MarkVoxel(uint64_t *footprint, int x, int y, int z) {
+    size_t index = (size_t(z) * FOOTPRINT_GRID + y) * FOOTPRINT_GRID + x;
+    footprint[index / 64] |= uint64_t(1) << (index % 64);
+}
+
+void Scene::MarkFootprint(const Vector &point, float radius) {
+    FootprintRecorder &recorder = thread_footprints[omp_get_thread_num()];
+    if (recorder.footprint == nullptr)
+        return;
+
+    int range[6];
+    Vector shift(radius, radius, radius);
+    VoxelRange(point - shift, point + shift, left_border, right_border, &range[0], &range[3]);
+
+    /* Steps near surface are short, they are in voxels of the previous step */
+    int *last = recorder.last_range;
+    if (range[0] >= last[0] && range[1] >= last[1] && range[2] >= last[2] &&
+        range[3] <= last[3] && range[4] <= last[4] && range[5] <= last[5])
+        return;
+    std::copy(range, range + 6, last);
+
+    /* Long steps far from figures mark a few coarse voxels instead of many fine ones */
+    const int coarse_side = 2 << FOOTPRINT_COARSE_SHIFT;
+    if (range[3] - range[0] > coarse_side || range[4] - range[1] > coarse_side || range[5] - range[2] > coarse_side) {
+        int coarse[6];
+        CoarseRange(range, coarse);
+        MarkVoxels(recorder.footprint + FOOTPRINT_WORDS, FOOTPRINT_COARSE_GRID, coarse);
+    } else {
+        MarkVoxels(recorder.footprint, FOOTPRINT_GRID, range);
+    }
+}
+
+void Scene::MarkFootprintHit(const Vector &point) {
+    FootprintRecorder &recorder = thread_footprints[omp_get_thread_num()];
+    if (recorder.footprint == nullptr)
+        return;
+
+    int from[3], to[3];
+    VoxelRange(point, point, left_border, right_border, from, to);
+    MarkVoxel(recorder.footprint + FOOTPRINT_HITS, from[0], from[1], from[2]);
+}
+
+void Scene::MarkFootprintRay(const Vector &source, const Vector &direction) {
+    FootprintRecorder &recorder = thread_footprints[omp_get_thread_num()];
+    if (recorder.footprint == nullptr)
+        return;
+
+    /* Voxels are walked one by one along the ray (Amanatides & Woo) */
+    const float origin[3] = {source.x - left_border.x, source.y - left_border.y, source.z - left_border.z};
+    const float size[3] = {right_border.x - left_border.x, right_border.y - left_border.y, right_border.z - left_border.z};
+    const float dir[3] = {direction.x, direction.y, direction.z};
+
+    int voxel[3], step[3];
+    float t_max[3], t_delta[3];
+    float t_exit = INF;
+    for (int axis = 0; axis < 3; axis++) {
+        float cell = size[axis] / FOOTPRINT_GRID;
+        voxel[axis] = std::max(0, std::min(FOOTPRINT_GRID - 1, int(std::floor(origin[axis] / cell))));
+
+        if (dir[axis] > 0) {
+            step[axis] = 1;
+            t_max[axis] = ((voxel[axis] + 1) * cell - origin[axis]) / dir[axis];
+            t_delta[axis] = cell / dir[axis];
+            t_exit = std::min(t_exit, (size[axis] - origin[axis]) / dir[axis]);
+        } else if (dir[axis] < 0) {
+            step[axis] = -1;
+            t_max[axis] = (voxel[axis] * cell - origin[axis]) / dir[axis];
+            t_delta[axis] = -cell / dir[axis];
+            t_exit = std::min(t_exit, -origin[axis] / dir[axis]);
+        } else {
+            step[axis] = 0;
+            t_max[axis] = INF;
+            t_delta[axis] = INF;
+        }
+    }
+
+    while (true) {
+        MarkVoxel(recorder.footprint, voxel[0], voxel[1], voxel[2]);
+
+        int axis = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+        if (t_max[axis] > t_exit)
+            break;
+
+        voxel[axis] += step[axis];
+        if (voxel[axis] < 0 || voxel[axis] >= FOOTPRINT_GRID)
+            break;
+        t_max[axis] += t_delta[axis];
+    }
+}
+
+int Scene::KeepCleanTiles(const std::vector<RenderTile> &tiles, const std::vector<BoundingBox> &moved,
+                          const std::vector<BoundingBox> &recolored) {
+    std::vector<std::array<int, 6>> moved_ranges, recolored_ranges;
+    for (auto &region : moved) {
+        std::array<int, 6> range;
+        VoxelRange(region.min, region.max, left_border, right_border, &range[0], &range[3]);
+        moved_ranges.push_back(range);
+    }
+    for (auto &region : recolored) {
+        std::array<int, 6> range;
+        VoxelRange(region.min, region.max, left_border, right_border, &range[0], &range[3]);
+        recolored_ranges.push_back(range);
+    }
+
+    /* Moved figures change rays, that passed their voxels, recolored ones change rays, that hit them */
+    int traced = 0;
+    kept_tiles.assign(tiles.size(), true);
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const uint64_t *footprint = tile_footprints[i].data();
+
+        bool dirty = false;
+        for (size_t r = 0; r < moved_ranges.size() && !dirty; r++) {
+            int coarse[6];
+            CoarseRange(moved_ranges[r].data(), coarse);
+            dirty = HasVoxels(footprint, FOOTPRINT_GRID, moved_ranges[r].data()) ||
+                    HasVoxels(footprint + FOOTPRINT_WORDS, FOOTPRINT_COARSE_GRID, coarse);
+        }
+        for (size_t r = 0; r < recolored_ranges.size() && !dirty; r++)
+            dirty = HasVoxels(footprint + FOOTPRINT_HITS, FOOTPRINT_GRID, recolored_ranges[r].data());
+
+        if (dirty) {
+            kept_tiles[i] = false;
+            traced++;
+        }
+    }
+    return traced;
+}
+
+/* Determinant of matrix with columns a, b, c */
+static float Determinant(const Vector &a, const Vector &b, const Vector &c) {
+    return a.x * (b.y * c.z - b.z * c.y) - b.x * (a.y * c.z - a.z * c.y) + c.x * (a.y * b.z - a.z * b.y);
+}
+
+static float ColorDifference(const Color &a, const Color &b) {
+    return std::max(std::fabs(a.r - b.r), std::max(std::fabs(a.g - b.g), std::fabs(a.b - b.b)));
+}
+
+bool Scene::SameSurface(const size_t *pixels, int count, int cell) const {
+    Figure *figure = frame_figures[pixels[0]];
+    for (int i = 1; i < count; i++) {
+        if (frame_figures[pixels[i]] != figure)
+            return false;
+    }
+    if (figure == nullptr)
+        return true;
+
+    /* Size of pixel at unit distance from camera */
+    float pixel_size = screen_right.length() / float(half_width) / vector_to_screen.length();
+
+    const Vector &origin = frame_points[pixels[0]];
+    Vector normal = figure->normal(origin);
+    float tolerance = UPSAMPLE_PLANE_TOLERANCE * cell * pixel_size * (origin - camera.position).length();
+    for (int i = 1; i < count; i++) {
+        if (std::fabs(Vector::dot(normal, frame_points[pixels[i]] - origin)) > tolerance)
+            return false;
+    }
+    return true;
+}
+
+int Scene::UpsampleLattice(int scale) {
+    TimelineSpan span("upsample", "trace");
+
+    int width = window.x1 - window.x0;
+    int height = window.y1 - window.y0;
+    reused_pixels.assign(size_t(width) * height, 0);
+
+    /* Lattice pixels are the ones with coordinates of image divisible by scale, like in RenderPass */
+    auto index_of = [&](int x, int y) {
+        return size_t(y - window.y0) * width + (x - window.x0);
+    };
+
+    /*
+     * The pixel is interpolated bilinearly by the lattice pixels around it, if they see the same figure (or
+     * nothing) and lie near the tangent plane of the first one, otherwise it could be edge of figure or its
+     * part, which covers other part, and it is traced
+     */
+    int traced = 0;
+#pragma omp parallel for num_threads(settings.threads_number) schedule(dynamic, 1) reduction(+:traced)
+    for (int y = window.y0; y < window.y1; y++) {
+        int y0 = y / scale * scale;
+        int y1 = y0 + scale < window.y1 ? y0 + scale : y0;
+
+        for (int x = window.x0; x < window.x1; x++) {
+            int x0 = x / scale * scale;
+            int x1 = x0 + scale < window.x1 ? x0 + scale : x0;
+            size_t index = index_of(x, y);
+
+            if (x == x0 && y == y0) {
+                reused_pixels[index] = 1;
+                continue;
+            }
+
+            /* Crop window could start between lattice pixels */
+            if (x0 < window.x0 || y0 < window.y0) {
+                traced++;
+                continue;
+            }
+
+            const int corners_x[4] = {x0, x1, x0, x1};
+            const int corners_y[4] = {y0, y0, y1, y1};
+            size_t corners[4];
+            for (int i = 0; i < 4; i++)
+                corners[i] = index_of(corners_x[i], corners_y[i]);
+            if (!SameSurface(corners, 4, scale)) {
+                traced++;
+                continue;
+            }
+
+            float fx = float(x - x0) / scale;
+            float fy = float(y - y0) / scale;
+            const float weights[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+            Color color;
+            for (int i = 0; i < 4; i++)
+                color += frame_buffer.Row(corners_y[i] - buffer_first_row)[corners_x[i] - window.x0] * weights[i];
+
+            frame_buffer.Row(y - buffer_first_row)[x - window.x0] = color;
+
+            /* Interpolated hit is used by post antialiasing, like traced ones */
+            Vector point;
+            for (int i = 0; i < 4; i++)
+                point = point + frame_points[corners[i]] * weights[i];
+            frame_figures[index] = frame_figures[corners[0]];
+            frame_points[index] = point;
+            reused_pixels[index] = 1;
+        }
+    }
+    return traced;
+}
+
+int Scene::ReconstructCheckerboard(int parity) {
+    TimelineSpan span("reconstruct", "trace");
+
+    int width = window.x1 - window.x0;
+    int traced = 0;
+
+    /*
+     * The other half is taken from the previous frame by reprojection, or it is interpolated by the pair of
+     * neighbours with closer colors, if the 4 neighbours lie on the same surface, otherwise it is traced
+     */
+#pragma omp parallel for num_threads(settings.threads_number) schedule(dynamic, 1) reduction(+:traced)
+    for (int y = window.y0; y < window.y1; y++) {
+        for (int x = window.x0; x < window.x1; x++) {
+            size_t index = size_t(y - window.y0) * width + (x - window.x0);
+            if ((x + y) % 2 == parity) {
+                reused_pixels[index] = 1;
+                continue;
+            }
+            if (reused_pixels[index])
+                continue;
+
+            if (x == window.x0 || x + 1 == window.x1 || y == window.y0 || y + 1 == window.y1) {
+                traced++;
+                continue;
+            }
+
+            const size_t neighbours[4] = {index - 1, index + 1, index - width, index + width};
+            if (!SameSurface(neighbours, 4, 2)) {
+                traced++;
+                continue;
+            }
+
+            const Color *row = frame_buffer.Row(y - buffer_first_row) + (x - window.x0);
+            const Color &left = row[-1], &right = row[1];
+            const Color &up = frame_buffer.Row(y - 1 - buffer_first_row)[x - window.x0];
+            const Color &down = frame_buffer.Row(y + 1 - buffer_first_row)[x - window.x0];
+            frame_buffer.Row(y - buffer_first_row)[x - window.x0] =
+                ColorDifference(left, right) <= ColorDifference(up, down) ? (left + right) / 2.0f : (up + down) / 2.0f;
+
+            /* Interpolated hit is the history of the next frame, like traced ones */
+            frame_figures[index] = frame_figures[neighbours[0]];
+            frame_points[index] = (frame_points[neighbours[0]] + frame_points[neighbours[1]] +
+                                   frame_points[neighbours[2]] + frame_points[neighbours[3]]) / 4.0f;
+            reused_pixels[index] = 1;
+        }
+    }
+    return traced;
+}
+
+void Scene::PostAntialiasing(int first_row, int last_row, std::vector<Color> &colors) {
+    TimelineSpan span("post antialiasing", "trace");
+
+    int width = window.x1 - window.x0;
+    int height = last_row - first_row;
+    size_t count = size_t(width) * height;
+
+    /* Colors are read from frame buffer, and antialiased ones are written to the copy */
+    colors.resize(count);
+    for (int y = 0; y < height; y++) {
+        const Color *row = frame_buffer.Row(y + first_row - buffer_first_row);
+        std::copy(row, row + width, colors.begin() + size_t(y) * width);
+    }
+
+    /* The loops of luma and edges have no branches, so they are vectorized */
+    std::vector<float> luma(count);
+    const float *channels = reinterpret_cast<const float*>(colors.data());
+#pragma omp simd
+    for (size_t i = 0; i < count; i++)
+        luma[i] = std::min(255.0f, 0.299f * channels[3 * i] + 0.587f * channels[3 * i + 1] + 0.114f * channels[3 * i + 2]);
+
+    /* Hits of pixels are known, if the whole window is in frame buffer */
+    bool hits = frame_figures.size() == count;
+    std::vector<float> depth(hits ? count : 0);
+    std::vector<uintptr_t> figure(hits ? count : 0);
+    if (hits) {
+        const float *points = reinterpret_cast<const float*>(frame_points.data());
+        float cx = camera.position.x, cy = camera.position.y, cz = camera.position.z;
+#pragma omp simd
+        for (size_t i = 0; i < count; i++) {
+            float dx = points[3 * i] - cx, dy = points[3 * i + 1] - cy, dz = points[3 * i + 2] - cz;
+            depth[i] = std::sqrt(dx * dx + dy * dy + dz * dz);
+        }
+        for (size_t i = 0; i < count; i++)
+            figure[i] = reinterpret_cast<uintptr_t>(frame_figures[i]);
+    }
+
+    std::vector<uint8_t> edges(count);
+#pragma omp parallel for num_threads(settings.threads_number) schedule(dynamic, 1)
+    for (int y = 0; y < height; y++) {
+        const float *m = &luma[size_t(y) * width];
+        const float *n = &luma[size_t(std::max(y - 1, 0)) * width];
+        const float *s = &luma[size_t(std::min(y + 1, height - 1)) * width];
+        uint8_t *edge = &edges[size_t(y) * width];
+
+#pragma omp simd
+        for (int x = 0; x < width; x++) {
+            int w = std::max(x - 1, 0), e = std::min(x + 1, width - 1);
+            float max_luma = std::max(std::max(m[x], std::max(n[x], s[x])), std::max(m[w], m[e]));
+            float min_luma = std::min(std::min(m[x], std::min(n[x], s[x])), std::min(m[w], m[e]));
+            float contrast = max_luma - min_luma;
+            edge[x] = contrast >= std::max(POST_AA_MIN_CONTRAST, max_luma * POST_AA_THRESHOLD);
+        }
+
+        if (hits) {
+            size_t row = size_t(y) * width;
+            size_t up = size_t(std::max(y - 1, 0)) * width, down = size_t(std::min(y + 1, height - 1)) * width;
+            const uintptr_t *fm = &figure[row], *fn = &figure[up], *fs = &figure[down];
+            const float *dm = &depth[row], *dn = &depth[up], *ds = &depth[down];
+
+#pragma omp simd
+            for (int x = 0; x < width; x++) {
+                int w = std::max(x - 1, 0), e = std::min(x + 1, width - 1);
+                bool other_figure = (fm[x] != fn[x]) | (fm[x] != fs[x]) | (fm[x] != fm[w]) | (fm[x] != fm[e]);
+                float max_depth = std::max(std::max(dm[x], std::max(dn[x], ds[x])), std::max(dm[w], dm[e]));
+                float min_depth = std::min(std::min(dm[x], std::min(dn[x], ds[x])), std::min(dm[w], dm[e]));
+                bool depth_jump = (fm[x] != 0) & (max_depth - min_depth > min_depth * POST_AA_DEPTH_RATIO);
+                edge[x] = edge[x] | uint8_t(other_figure | depth_jump);
+            }
+        }
+    }
+
+    /*
+     * Edge pixels are blended with the neighbour across the edge, like FXAA: the more the pixel is far from
+     * the middle of the edge step, the less it is blended, small details are blended by the local contrast
+     */
+    auto luma_at = [&](int x, int y) {
+        return luma[size_t(std::min(std::max(y, 0), height - 1)) * width + std::min(std::max(x, 0), width - 1)];
+    };
+
+#pragma omp parallel for num_threads(settings.threads_number) schedule(dynamic, 1)
+    for (int y = 0; y < height; y++) {
+        Color *output = &colors[size_t(y) * width];
+        for (int x = 0; x < width; x++) {
+            if (!edges[size_t(y) * width + x])
+                continue;
+
+            float m = luma_at(x, y);
+            float n = luma_at(x, y - 1), s = luma_at(x, y + 1), w = luma_at(x - 1, y), e = luma_at(x + 1, y);
+            float nw = luma_at(x - 1, y - 1), ne = luma_at(x + 1, y - 1);
+            float sw = luma_at(x - 1, y + 1), se = luma_at(x + 1, y + 1);
+            float contrast = std::max(std::max(m, std::max(n, s)), std::max(w, e)) -
+                             std::min(std::min(m, std::min(n, s)), std::min(w, e));
+            if (contrast <= 0)
+                continue;
+
+            /* Blending of details, that are smaller than pixel */
+            float average = (2 * (n + s + w + e) + nw + ne + sw + se) / 12;
+            float subpixel = std::min(1.0f, std::fabs(average - m) / contrast);
+            subpixel = (-2 * subpixel + 3) * subpixel * subpixel;
+            float blend = subpixel * subpixel * 0.75f;
+
+            /* Horizontal edge is crossed by vertical step, and goes along rows */
+            float edge_horizontal = std::fabs(nw - 2 * w + sw) + 2 * std::fabs(n - 2 * m + s) + std::fabs(ne - 2 * e + se);
+            float edge_vertical = std::fabs(nw - 2 * n + ne) + 2 * std::fabs(w - 2 * m + e) + std::fabs(sw - 2 * s + se);
+            bool horizontal = edge_horizontal >= edge_vertical;
+
+            /* The side of edge with steeper gradient */
+            float luma_before = horizontal ? n : w, luma_after = horizontal ? s : e;
+            bool before = std::fabs(luma_before - m) >= std::fabs(luma_after - m);
+            int step = before ? -1 : 1;
+            float side_average = 0.5f * (m + (before ? luma_before : luma_after));
+            float gradient = 0.25f * std::max(std::fabs(luma_before - m), std::fabs(luma_after - m));
+
+            /* Search both ends of edge, where the average of pixels at both sides of edge changes */
+            int along_x = horizontal ? 1 : 0, along_y = horizontal ? 0 : 1;
+            int across_x = horizontal ? 0 : step, across_y = horizontal ? step : 0;
+            float end_luma[2] = {0, 0};
+            int distance[2] = {POST_AA_SEARCH_STEPS, POST_AA_SEARCH_STEPS};
+            for (int side = 0; side < 2; side++) {
+                int direction = side == 0 ? -1 : 1;
+                for (int i = 1; i <= POST_AA_SEARCH_STEPS; i++) {
+                    int px = x + along_x * direction * i, py = y + along_y * direction * i;
+                    end_luma[side] = 0.5f * (luma_at(px, py) + luma_at(px + across_x, py + across_y)) - side_average;
+                    if (std::fabs(end_luma[side]) >= gradient) {
+                        distance[side] = i;
+                        break;
+                    }
+                }
+            }
+
+            /* The pixel is blended, if the nearer end of edge bends to its side */
+            int nearer = distance[0] < distance[1] ? 0 : 1;
+            bool good_span = (end_luma[nearer] < 0) != (m - side_average < 0);
+            float span_length = float(distance[0] + distance[1]);
+            float offset = 0.5f - float(distance[nearer]) / span_length;
+            if (good_span)
+                blend = std::max(blend, offset);
+
+            int nx = std::min(std::max(x + across_x, 0), width - 1);
+            int ny = std::min(std::max(y + across_y, 0), height - 1);
+            const Color &color = frame_buffer.At(x, y + first_row - buffer_first_row);
+            output[x] = color * (1 - blend) + frame_buffer.At(nx, ny + first_row - buffer_first_row) * blend;
+        }
+    }
+}
+
+/* Ray from source to source + ray hits figure before the end of ray, so figure covers its own point there */
+static bool FigureCoversPoint(Figure *figure, const Vector &source, const Vector &ray) {
+    float length = ray.length();
+    Vector direction = ray / length;
+
+    float t = 0;
+    for (int step = 0; step < MAX_TRACE_STEPS_COUNT && t < length - BOUNDS_MARGIN; step++) {
+        float dist = std::abs(figure->distance(source + direction * t));
+        if (dist < EPS)
+            return true;
+        t += dist;
+    }
+    return false;
+}
+
+int Scene::ReprojectHistory(bool same_view) {
+    TimelineSpan span("reproject", "trace");
+
+    int width = window.x1 - window.x0;
+    int height = window.y1 - window.y0;
+    size_t pixels = size_t(width) * height;
+
+    /* The same rays give the same colors, even reflected ones */
+    if (same_view) {
+        reused_pixels.assign(pixels, 1);
+        for (int y = 0; y < height; y++)
+            std::copy(history_colors.begin() + size_t(y) * width, history_colors.begin() + size_t(y + 1) * width,
+                      frame_buffer.Row(y + window.y0 - buffer_first_row));
+        frame_points = history_points;
+        frame_figures = history_figures;
+        return int(pixels);
+    }
+
+    reused_pixels.assign(pixels, 0);
+
+    /* Sample of pixel without antialiasing is shifted from its center, like in TraceTile */
+    float center_x = settings.antialiasing ? 0.0f : -0.5f;
+    float center_y = settings.antialiasing ? 0.0f : 0.5f;
+
+    /*
+     * Every history hit P goes to pixel of the current camera: vector_to_screen + screen_right * a +
+     * screen_up * b = k * (P - camera), k > 0. The nearest hit wins, like in z-buffer
+     */
+    std::vector<int> candidates(pixels, -1);
+    std::vector<float> depths(pixels, INF);
+    for (size_t i = 0; i < history_points.size(); i++) {
+        Figure *figure = history_figures[i];
+        if (figure == nullptr || figure->IsReflectable() || figure->Refractable())
+            continue;
+
+        Vector ray = history_points[i] - camera.position;
+        float det = Determinant(screen_right, screen_up, -ray);
+        if (std::fabs(det) < EPS)
+            continue;
+        float a = Determinant(-vector_to_screen, screen_up, -ray) / det;
+        float b = Determinant(screen_right, -vector_to_screen, -ray) / det;
+        float k = Determinant(screen_right, screen_up, -vector_to_screen) / det;
+        if (!(k > 0))
+            continue;
+
+        int pixel_x = int(std::floor(a * half_width - center_x + half_width + 0.5f));
+        int pixel_y = int(std::floor(b * half_height - center_y + half_height + 0.5f));
+        if (pixel_x < window.x0 || pixel_x >= window.x1 || pixel_y < window.y0 || pixel_y >= window.y1)
+            continue;
+
+        size_t index = size_t(pixel_y - window.y0) * width + (pixel_x - window.x0);
+        float depth = ray.length();
+        if (depth < depths[index]) {
+            depths[index] = depth;
+            candidates[index] = int(i);
+        }
+    }
+
+    /*
+     * Pixel is reused, if its neighbours got close colors of the same figure, so it is not at edge of figure
+     * or shadow, the surface looks at camera, and no other figure could be in front of it
+     */
+    int reused = 0;
+#pragma omp parallel for num_threads(settings.threads_number) schedule(dynamic, 1) reduction(+:reused)
+    for (int y = 1; y < height - 1; y++) {
+        for (int x = 1; x < width - 1; x++) {
+            size_t index = size_t(y) * width + x;
+            int candidate = candidates[index];
+            if (candidate < 0)
+                continue;
+
+            Figure *figure = history_figures[candidate];
+            const Color &color = history_colors[candidate];
+            const size_t neighbours[4] = {index - 1, index + 1, index - width, index + width};
+            bool valid = true;
+            for (int n = 0; n < 4 && valid; n++) {
+                int other = candidates[neighbours[n]];
+                valid = other >= 0 && history_figures[other] == figure &&
+                        ColorDifference(history_colors[other], color) <= TEMPORAL_COLOR_THRESHOLD;
+            }
+
+            const Vector &point = history_points[candidate];
+            Vector ray = point - camera.position;
+            valid = valid && Vector::dot(figure->normal(point), ray) < 0;
+            for (size_t i = 0; i < figures.size() && valid; i++)
+                valid = figures[i] == figure || !figures_bounds[i].IntersectRay(camera.position, ray, 1.0f);
+            valid = valid && (figure->IsConvex() || !FigureCoversPoint(figure, camera.position, ray));
+            if (!valid)
+                continue;
+
+            reused_pixels[index] = 1;
+            frame_buffer.Row(y + window.y0 - buffer_first_row)[x] = color;
+            frame_points[index] = point;
+            frame_figures[index] = figure;
+            reused++;
+        }
+    }
+    return reused;
+}
+
+void Scene::TraceTile(const RenderTile &tile, const RenderPass &pass) {
+    TimelineSpan span("tile", "trace", tile.x0, tile.y0);
+
+    static const float shift_x[4] = {-0.5f, 0.5f, 0.5f, -0.5f};
+    static const float shift_y[4] = {0.5f, 0.5f, -0.5f, -0.5f};
+
+    FrameBufferView view(frame_buffer, tile.x0 - buffer_first_column, tile.y0 - buffer_first_row,
+                         tile.x1 - tile.x0, tile.y1 - tile.y0);
+
+    /* The first pixels of pass in tile */
+    int first_y = tile.y0 + ((pass.offset_y - tile.y0 % pass.step) + pass.step) % pass.step;
+    int first_x = tile.x0 + ((pass.offset_x - tile.x0 % pass.step) + pass.step) % pass.step;
+    int antialiasing_side_number = pass.antialiasing_side_number;
+
+    /* Hits of primary rays are recorded for temporal reprojection of the next frame */
+    int window_width = window.x1 - window.x0;
+    PrimaryHit *hit = thread_hits.empty() ? nullptr : &thread_hits[omp_get_thread_num()];
+    auto finish_pixel = [&](int pixel_x, int pixel_y, const Color &color) {
+        view.At(pixel_x - tile.x0, pixel_y - tile.y0) = color;
+        if (hit != nullptr) {
+            size_t index = size_t(pixel_y - window.y0) * window_width + (pixel_x - window.x0);
+            frame_points[index] = hit->point;
+            frame_figures[index] = hit->figure;
+        }
+    };
+
+    for (int pixel_y = first_y; pixel_y < tile.y1; pixel_y += pass.step) {
+        int y = pixel_y - half_height;
+
+        for (int pixel_x = first_x; pixel_x < tile.x1; pixel_x += pass.step) {
+            int x = pixel_x - half_width;
+
+            if (!reused_pixels.empty() &&
+                reused_pixels[size_t(pixel_y - window.y0) * window_width + (pixel_x - window.x0)])
+                continue;
+
+            Color samples[4];
+            auto trace_sample = [&](int i) {
+                Vector direction = PrimaryRayDirection(x + shift_x[i], y + shift_y[i]);
+                Scene::GetColorOfRay(camera.position, direction, samples[i], settings.max_reflections);
+            };
+
+            if (antialiasing_side_number == 4 && settings.aa_threshold > 0) {
+                /* Adaptive antialiasing: the pixel is flat, if its diagonal samples are close */
+                trace_sample(0);
+                trace_sample(2);
+
+                float max_difference = std::max(std::fabs(samples[0].r - samples[2].r),
+                                                std::max(std::fabs(samples[0].g - samples[2].g),
+                                                         std::fabs(samples[0].b - samples[2].b)));
+                if (max_difference <= settings.aa_threshold) {
+                    finish_pixel(pixel_x, pixel_y, (samples[0] + samples[2]) / 2.0f);
+                    continue;
+                }
+
+                trace_sample(1);
+                trace_sample(3);
+            } else {
+                for (int i = 0; i < antialiasing_side_number; i++)
+                    trace_sample(i);
+            }
+
+            Color color;
+            for (int i = 0; i < antialiasing_side_number; i++)
+                color += samples[i];
+
+            finish_pixel(pixel_x, pixel_y, color / float(antialiasing_side_number));
+        }
+    }
+}
+
+bool Scene::GetColorOfRay(const Vector &source, const Vector &direction, Color &pixel, int reflect_count) {
+    ray_stats[omp_get_thread_num()].rays[settings.max_reflections - reflect_count]++;
+
     Vector intersect_point;
     Figure *intersect_figure = nullptr;
-    Pixel pixel;
 
     bool is_intersect = Scene::FigureIntersectWith(source, direction, intersect_point, intersect_figure);
+    if (!thread_hits.empty() && reflect_count == settings.max_reflections) {
+        PrimaryHit &hit = thread_hits[omp_get_thread_num()];
+        hit.point = intersect_point;
+        hit.figure = is_intersect ? intersect_figure : nullptr;
+    }
+
     if (not is_intersect) {
         /* If we intersect nothing, set Blue color of ray */
-        pixel = Pixel::Blue;
+        pixel = Color(Pixel::Blue);
     } else {
         assert(intersect_figure != nullptr);
 
-        pixel = intersect_figure->DefaultColor();
+        pixel = Color(intersect_figure->DefaultColor());
+        if (!thread_footprints.empty())
+            MarkFootprintHit(intersect_point);
         Vector norm = intersect_figure->normal(intersect_point);
 
         /* Get normal and look for light sources */
 
-        for (auto &light : lights) {
-            Vector dir_to_light = light.source - intersect_point;
-            dir_to_light.normalize();
+        int samples = settings.light_samples;
+        if (samples > 0 && size_t(samples) < lights.size()) {
+            /* Choose lights by importance, the random sequence depends only on the point */
+            uint32_t random_state = HashPoint(intersect_point);
+            for (int i = 0; i < samples; i++) {
+                float pdf;
+                int light = light_tree.Sample(intersect_point, norm, NextRandom(random_state), pdf);
+                if (light < 0)
+                    break;
 
-            is_intersect = Scene::FigureIntersectWith(intersect_point, dir_to_light);
-            if (is_intersect) // If we intersect something, it means no light here
-                continue;
-
-            float angle = dir_to_light.GetCosAngleWith(norm);
-            pixel += Pixel::White * (std::abs(angle) / 1.20);
+                ShadeByLight(light, intersect_point, norm, intersect_figure, 1.0f / (samples * pdf), pixel);
+            }
+        } else {
+            for (int light = 0; light < int(lights.size()); light++) {
+                ShadeByLight(light, intersect_point, norm, intersect_figure, 1.0f, pixel);
+            }
         }
 
         /* Check if intersect figure is reflectable */
@@ -144,8 +1666,8 @@ Pixel Scene::GetColorOfRay(const Vector &source, const Vector &direction, int re
 
             float k = intersect_figure->ReflectCoefficient();
 
-            Pixel after_reflect = GetColorOfRay(intersect_point, reflect, reflect_count - 1);
-            if (after_reflect != Pixel::Blue) {
+            Color after_reflect;
+            if (GetColorOfRay(intersect_point, reflect, after_reflect, reflect_count - 1)) {
                 pixel += after_reflect * k;
             }
         }
@@ -159,33 +1681,32 @@ Pixel Scene::GetColorOfRay(const Vector &source, const Vector &direction, int re
             Vector refract = Vector::refract(direction, norm, eta);
             refract.normalize();
 
-            Pixel after_reflect = GetColorOfRay(intersect_point, refract, reflect_count - 1);
-            if (after_reflect != Pixel::Blue) {
-                pixel += after_reflect * k;
+            Color after_refract;
+            if (GetColorOfRay(intersect_point, refract, after_refract, reflect_count - 1)) {
+                pixel += after_refract * k;
             }
         }
     }
 
-    return pixel;
+    return is_intersect;
 }
 
 void Scene::SaveImage(std::string &&filename) {
+    if (frame_buffer.Width() != image_width || frame_buffer.Height() != image_height ||
+        buffer_first_row != 0 || buffer_first_column != 0)
+        throw std::runtime_error("SaveImage: the image was not rendered whole");
+
     std::cout << "Start Draw" << std::endl;
 
-    BMP out;
-    out.SetSize(image_width, image_height);
+    TimelineSpan span("SaveImage", "output");
 
+    /* Rows are converted to 8 bit by writer, the image is not copied */
+    BmpImageWriter writer;
+    writer.Open(filename, image_width, image_height);
     for (int y = 0; y < image_height; y++) {
-        for (int x = 0; x < image_width; x++) {
-            out.SetPixel(x, y, pixel_matrix[y][x].value);
-        }
-    }
-
-    if (!out.WriteToFile(filename.c_str())) {
-        std::stringstream ss;
-        ss << "Error write to file: " << filename;
-        throw std::runtime_error(ss.str());
+        writer.WriteRow(y, frame_buffer.Row(y));
     }
+    writer.Close();
 
     std::cout << "End Draw" << std::endl;
 }
@@ -213,6 +1734,10 @@ bool Scene::FigureIntersectWith(const Vector &source,
         if (dist < EPS)
             dist = 0.1;
 
+        /* The step depends only on figures in the ball of dist around position */
+        if (!thread_footprints.empty())
+            MarkFootprint(current_position, dist);
+
         current_position = current_position + direction * dist;
         if (not IsPointIntoScene(current_position)) {
             result = nullptr;
@@ -240,7 +1765,78 @@ bool Scene::FigureIntersectWith(const Vector &source,
 bool Scene::FigureIntersectWith(const Vector &source, const Vector &direction) {
     Vector a;
     Figure *b = nullptr;
-    FigureIntersectWith(source, direction, a, b, false);
+    return FigureIntersectWith(source, direction, a, b, false);
+}
+
+void Scene::ShadeByLight(int light,
+                         const Vector &point,
+                         const Vector &norm,
+                         Figure *figure,
+                         float weight,
+                         Color &pixel) {
+    ShadowStats &stats = shadow_stats[omp_get_thread_num()];
+    stats.rays++;
+
+    Vector dir_to_light = lights[light].source - point;
+    dir_to_light.normalize();
+
+    float angle = dir_to_light.GetCosAngleWith(norm);
+
+    /* Light is behind the surface, the shadow ray goes into the figure and intersects it */
+    if (angle <= 0) {
+        stats.back_facing++;
+        return;
+    }
+
+    /* White light adds the same value to every channel */
+    float light_value = 255.0f * std::abs(angle) / 1.20f * weight;
+    Color light_color(light_value, light_value, light_value);
+    if (light_value < settings.shadow_threshold) {
+        stats.below_threshold++;
+        return;
+    }
+
+    if (not MayBeOccluded(point, dir_to_light, figure)) {
+        /* Figure, that is moved to the ray, makes the shadow */
+        if (!thread_footprints.empty())
+            MarkFootprintRay(point, dir_to_light);
+        stats.no_occluders++;
+        pixel += light_color;
+        return;
+    }
+
+    bool is_intersect;
+    if (light_cache.Enabled()) {
+        uint64_t key = light_cache.Key(point, norm, figure, light);
+        bool visible;
+        if (light_cache.Find(key, visible)) {
+            stats.cache_hits++;
+            is_intersect = not visible;
+        } else {
+            stats.cache_misses++;
+            is_intersect = Scene::FigureIntersectWith(point, dir_to_light);
+            light_cache.Insert(key, not is_intersect);
+        }
+    } else {
+        is_intersect = Scene::FigureIntersectWith(point, dir_to_light);
+    }
+
+    if (is_intersect) // If we intersect something, it means no light here
+        return;
+
+    pixel += light_color;
+}
+
+bool Scene::MayBeOccluded(const Vector &source, const Vector &direction, Figure *source_figure) {
+    for (size_t i = 0; i < figures.size(); i++) {
+        if (figures[i] == source_figure && source_figure->IsConvex())
+            continue;
+
+        if (figures_bounds[i].IntersectRay(source, direction))
+            return true;
+    }
+
+    return false;
 }
 
 bool Scene::IsPointIntoScene(const Vector &point) {
@@ -0,0 +1,203 @@
+#include "SceneCache.h"
+#include "ImageWriter.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Alignment of columns in binary file */
+#define SCENE_COLUMN_ALIGNMENT 64
+
+static uint64_t AlignColumn(uint64_t offset) {
+    return (offset + SCENE_COLUMN_ALIGNMENT - 1) / SCENE_COLUMN_ALIGNMENT * SCENE_COLUMN_ALIGNMENT;
+}
+
+SceneCache::SceneCache(const std::string &directory) : directory(directory) {
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::stringstream ss;
+        ss << "Error create scene cache directory: " << directory;
+        throw std::runtime_error(ss.str());
+    }
+}
+
+uint64_t SceneCache::Hash(const void *data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+std::string SceneCache::EntryPath(uint64_t hash) const {
+    std::stringstream ss;
+    ss << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".rtscene";
+    return ss.str();
+}
+
+std::unique_ptr<Scene> SceneCache::Load(const std::string &filename, Camera &camera, bool verbose) {
+    auto start = std::chrono::steady_clock::now();
+
+    /* The key is the content, so the file is read anyway, but it is not parsed on hit */
+    std::vector<char> text = SceneFile::Read(filename);
+    uint64_t hash = Hash(text.data(), text.size());
+    std::string path = EntryPath(hash);
+
+    std::unique_ptr<Scene> scene = LoadEntry(path, hash, camera);
+    bool hit = scene != nullptr;
+    if (!hit) {
+        SceneDescription description = SceneFile::Parse(text.data(), text.size(), filename, camera);
+        StoreEntry(path, hash, description);
+
+        scene.reset(new Scene(description.bounds_min, description.bounds_max));
+        description.AddTo(*scene);
+        camera = description.camera;
+    }
+
+    if (verbose) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Scene cache " << (hit ? "hit" : "miss") << ": " << path << ", "
+                  << scene->FiguresCount() << " figures loaded in " << elapsed.count() << " ms" << std::endl;
+    }
+    return scene;
+}
+
+/* Bytes [offset, offset + length) lie in file of size, the sum is not computed, so it could not wrap around */
+static bool InFile(uint64_t offset, uint64_t length, uint64_t size) {
+    return offset <= size && length <= size - offset;
+}
+
+std::unique_ptr<Scene> SceneCache::LoadEntry(const std::string &path, uint64_t hash, Camera &camera) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat file_stat = {};
+    if (fstat(fd, &file_stat) != 0 || size_t(file_stat.st_size) < sizeof(SceneCacheHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = size_t(file_stat.st_size);
+    void *memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+        return nullptr;
+
+    const uint8_t *data = static_cast<const uint8_t*>(memory);
+    const SceneCacheHeader *header = static_cast<const SceneCacheHeader*>(memory);
+
+    /* Every column must lie in file, the broken entry is written again */
+    uint64_t count = header->figures_count;
+    bool valid = memcmp(header->magic, "RTSCENE", 8) == 0 && header->version == SCENE_CACHE_VERSION &&
+                 header->header_size == sizeof(SceneCacheHeader) && header->source_hash == hash &&
+                 header->file_size == size && count <= size && header->lights_count <= size &&
+                 InFile(header->lights_offset, header->lights_count * 3 * sizeof(float), size);
+    for (int i = 0; valid && i < SCENE_FLOAT_COLUMNS; i++)
+        valid = InFile(header->float_columns_offset[i], count * sizeof(float), size);
+    for (int i = 0; valid && i < SCENE_BYTE_COLUMNS; i++)
+        valid = InFile(header->byte_columns_offset[i], count, size);
+
+    std::unique_ptr<Scene> scene;
+    if (valid) {
+        SceneFigures figures;
+        figures.count = size_t(count);
+        for (int i = 0; i < SCENE_FLOAT_COLUMNS; i++)
+            figures.float_columns[i] = reinterpret_cast<const float*>(data + header->float_columns_offset[i]);
+        for (int i = 0; i < SCENE_BYTE_COLUMNS; i++)
+            figures.byte_columns[i] = data + header->byte_columns_offset[i];
+
+        const float *bounds = header->bounds;
+        scene.reset(new Scene(Vector(bounds[0], bounds[1], bounds[2]), Vector(bounds[3], bounds[4], bounds[5])));
+        figures.AddTo(*scene);
+
+        const float *lights = reinterpret_cast<const float*>(data + header->lights_offset);
+        for (uint64_t i = 0; i < header->lights_count; i++)
+            scene->AddLight(Vector(lights[3 * i], lights[3 * i + 1], lights[3 * i + 2]));
+
+        const float *c = header->camera;
+        Camera file_camera(Vector(c[0], c[1], c[2]), Vector(c[3], c[4], c[5]), Vector(c[6], c[7], c[8]),
+                           Vector(c[9], c[10], c[11]), c[12]);
+        SceneFile::ApplyCamera(file_camera, int(header->camera_parts), camera);
+    }
+
+    munmap(memory, size);
+    return scene;
+}
+
+void SceneCache::StoreEntry(const std::string &path, uint64_t hash, const SceneDescription &description) {
+    uint64_t count = description.FiguresCount();
+
+    SceneCacheHeader header = {};
+    memcpy(header.magic, "RTSCENE", 8);
+    header.version = SCENE_CACHE_VERSION;
+    header.header_size = sizeof(SceneCacheHeader);
+    header.source_hash = hash;
+    header.figures_count = count;
+    header.lights_count = description.lights.size();
+
+    const Vector corners[2] = {description.bounds_min, description.bounds_max};
+    for (int i = 0; i < 2; i++) {
+        header.bounds[3 * i] = corners[i].x;
+        header.bounds[3 * i + 1] = corners[i].y;
+        header.bounds[3 * i + 2] = corners[i].z;
+    }
+
+    const Camera &camera = description.camera;
+    const Vector vectors[4] = {camera.position, camera.direction, camera.up, camera.right};
+    for (int i = 0; i < 4; i++) {
+        header.camera[3 * i] = vectors[i].x;
+        header.camera[3 * i + 1] = vectors[i].y;
+        header.camera[3 * i + 2] = vectors[i].z;
+    }
+    header.camera[12] = camera.distance;
+    header.camera_parts = uint32_t(description.camera_parts);
+
+    uint64_t offset = AlignColumn(sizeof(SceneCacheHeader));
+    for (int i = 0; i < SCENE_FLOAT_COLUMNS; i++) {
+        header.float_columns_offset[i] = offset;
+        offset = AlignColumn(offset + count * sizeof(float));
+    }
+    for (int i = 0; i < SCENE_BYTE_COLUMNS; i++) {
+        header.byte_columns_offset[i] = offset;
+        offset = AlignColumn(offset + count);
+    }
+    header.lights_offset = offset;
+    header.file_size = offset + description.lights.size() * 3 * sizeof(float);
+
+    std::vector<float> lights;
+    for (auto &light : description.lights) {
+        lights.push_back(light.x);
+        lights.push_back(light.y);
+        lights.push_back(light.z);
+    }
+
+    /* Other process could read the entry, so it appears at once by rename */
+    std::stringstream temporary;
+    temporary << path << ".tmp." << getpid();
+
+    OutputFile file;
+    file.Open(temporary.str());
+    file.Resize(header.file_size);
+    file.WriteAt(reinterpret_cast<const uint8_t*>(&header), sizeof(header), 0);
+    for (int i = 0; i < SCENE_FLOAT_COLUMNS; i++)
+        file.WriteAt(reinterpret_cast<const uint8_t*>(description.float_columns[i].data()), count * sizeof(float),
+                     header.float_columns_offset[i]);
+    for (int i = 0; i < SCENE_BYTE_COLUMNS; i++)
+        file.WriteAt(description.byte_columns[i].data(), count, header.byte_columns_offset[i]);
+    file.WriteAt(reinterpret_cast<const uint8_t*>(lights.data()), lights.size() * sizeof(float), header.lights_offset);
+    file.Close();
+
+    if (rename(temporary.str().c_str(), path.c_str()) != 0) {
+        unlink(temporary.str().c_str());
+        std::stringstream ss;
+        ss << "Error write scene cache: " << path;
+        throw std::runtime_error(ss.str());
+    }
+}
@@ -0,0 +1,468 @@
+#include "SceneFile.h"
+#include "Figures.h"
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+SceneFigures::SceneFigures() : count(0), float_columns(), byte_columns() {}
+
+void SceneFigures::AddTo(Scene &scene) const {
+    const float *x = float_columns[COLUMN_X], *y = float_columns[COLUMN_Y], *z = float_columns[COLUMN_Z];
+    const float *size_x = float_columns[COLUMN_SIZE_X];
+    const float *size_y = float_columns[COLUMN_SIZE_Y];
+    const float *size_z = float_columns[COLUMN_SIZE_Z];
+    const uint8_t *kinds = byte_columns[COLUMN_KIND], *flags = byte_columns[COLUMN_FLAGS];
+
+    for (size_t i = 0; i < count; i++) {
+        Vector center(x[i], y[i], z[i]);
+
+        FigureBaseImpl *figure;
+        if (kinds[i] == SCENE_SPHERE)
+            figure = new Sphere(center, size_x[i]);
+        else if (kinds[i] == SCENE_BOX)
+            figure = new Box(center, Vector(size_x[i], size_y[i], size_z[i]));
+        else
+            figure = new Torus(center, size_x[i], size_y[i]);
+
+        if (flags[i] & SCENE_FIGURE_COLOR)
+            figure->DefaultColor(Pixel(byte_columns[COLUMN_RED][i], byte_columns[COLUMN_GREEN][i],
+                                       byte_columns[COLUMN_BLUE][i]));
+        if (flags[i] & SCENE_FIGURE_REFLECT)
+            figure->MakeReflectable(float_columns[COLUMN_REFLECT_K][i]);
+        if (flags[i] & SCENE_FIGURE_REFRACT)
+            figure->Refractable(float_columns[COLUMN_REFRACT_K][i], float_columns[COLUMN_REFRACT_ETA][i]);
+
+        scene.AddFigure(figure);
+    }
+}
+
+SceneDescription::SceneDescription() :
+    bounds_min(-300, -300, -300),
+    bounds_max(300, 300, 300),
+    camera_parts(0)
+{}
+
+SceneFigures SceneDescription::Figures() const {
+    SceneFigures figures;
+    figures.count = FiguresCount();
+    for (int i = 0; i < SCENE_FLOAT_COLUMNS; i++)
+        figures.float_columns[i] = float_columns[i].data();
+    for (int i = 0; i < SCENE_BYTE_COLUMNS; i++)
+        figures.byte_columns[i] = byte_columns[i].data();
+    return figures;
+}
+
+void SceneDescription::AddTo(Scene &scene) const {
+    Figures().AddTo(scene);
+
+    for (auto &light : lights)
+        scene.AddLight(light);
+}
+
+/* Attributes of figure, only the given ones are applied */
+struct SceneMaterial {
+    SceneMaterial() : flags(0), reflect_k(0), refract_k(0), refract_eta(1) {}
+
+    /* Attributes of other are put over these ones */
+    void Merge(const SceneMaterial &other) {
+        if (other.flags & SCENE_FIGURE_COLOR)
+            color = other.color;
+        if (other.flags & SCENE_FIGURE_REFLECT)
+            reflect_k = other.reflect_k;
+        if (other.flags & SCENE_FIGURE_REFRACT) {
+            refract_k = other.refract_k;
+            refract_eta = other.refract_eta;
+        }
+        flags |= other.flags;
+    }
+
+    uint8_t flags;
+    Pixel color;
+    float reflect_k;
+    float refract_k, refract_eta;
+};
+
+/* Exact powers of ten, bigger ones are computed */
+static const double POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double PowerOfTen(int exponent) {
+    if (exponent < 23)
+        return POWERS_OF_TEN[exponent];
+    return std::pow(10.0, exponent);
+}
+
+/*
+ * Single pass parser, the tokens are not copied: words are compared in place,
+ * and numbers are converted while they are read
+ */
+class SceneParser {
+public:
+    SceneParser(const char *text, size_t size, const std::string &name, const Camera &camera) :
+        position(text), end(text + size), line_start(text), line(1), name(name) {
+        description.camera = camera;
+    }
+
+    SceneDescription Parse() {
+        while (position < end) {
+            SkipSpaces();
+            if (!AtLineEnd())
+                Statement();
+            NextLine();
+        }
+        return std::move(description);
+    }
+
+private:
+    struct Word {
+        const char *begin;
+        size_t size;
+        int column;
+
+        bool Is(const char *word) const {
+            return strlen(word) == size && memcmp(begin, word, size) == 0;
+        }
+
+        std::string String() const {
+            return std::string(begin, size);
+        }
+    };
+
+    void Statement() {
+        Word keyword = ReadWord("statement");
+
+        if (keyword.Is("sphere")) {
+            Vector center = ReadVector();
+            float radius = ReadPositive("radius");
+            AddFigure(SCENE_SPHERE, center, Vector(radius, 0, 0));
+        } else if (keyword.Is("box")) {
+            Vector center = ReadVector();
+            float x = ReadPositive("half size");
+            float y = ReadPositive("half size");
+            float z = ReadPositive("half size");
+            AddFigure(SCENE_BOX, center, Vector(x, y, z));
+        } else if (keyword.Is("torus")) {
+            Vector center = ReadVector();
+            float R = ReadPositive("radius");
+            float r = ReadPositive("radius");
+            AddFigure(SCENE_TORUS, center, Vector(R, r, 0));
+        } else if (keyword.Is("light")) {
+            description.lights.push_back(ReadVector());
+        } else if (keyword.Is("material")) {
+            Word material_name = ReadWord("material name");
+            std::string key = material_name.String();
+            if (materials.count(key) > 0)
+                Error(material_name.column, "material '" + key + "' is already defined");
+            materials[key] = ReadAttributes();
+        } else if (keyword.Is("bounds")) {
+            int column = Column();
+            Vector bounds_min = ReadVector();
+            Vector bounds_max = ReadVector();
+            if (bounds_min.x >= bounds_max.x || bounds_min.y >= bounds_max.y || bounds_min.z >= bounds_max.z)
+                Error(column, "the first corner of bounds must be less than the second one");
+            description.bounds_min = bounds_min;
+            description.bounds_max = bounds_max;
+        } else if (keyword.Is("camera")) {
+            CameraStatement();
+        } else {
+            Error(keyword.column, "unknown statement '" + keyword.String() + "'");
+        }
+
+        SkipSpaces();
+        if (!AtLineEnd())
+            Error(Column(), "unexpected '" + ReadToken() + "' at the end of statement");
+    }
+
+    void CameraStatement() {
+        SkipSpaces();
+        while (!AtLineEnd()) {
+            Word key = ReadWord("camera parameter");
+            Camera &camera = description.camera;
+            if (key.Is("position")) {
+                camera.position = ReadVector();
+                description.camera_parts |= SCENE_CAMERA_POSITION;
+            } else if (key.Is("direction")) {
+                camera.direction = ReadVector();
+                description.camera_parts |= SCENE_CAMERA_DIRECTION;
+            } else if (key.Is("up")) {
+                camera.up = ReadVector();
+                description.camera_parts |= SCENE_CAMERA_UP;
+            } else if (key.Is("right")) {
+                camera.right = ReadVector();
+                description.camera_parts |= SCENE_CAMERA_RIGHT;
+            } else if (key.Is("distance")) {
+                camera.distance = ReadPositive("distance");
+                description.camera_parts |= SCENE_CAMERA_DISTANCE;
+            } else {
+                Error(key.column, "unknown camera parameter '" + key.String() + "'");
+            }
+            SkipSpaces();
+        }
+    }
+
+    void AddFigure(SceneFigureKind kind, const Vector &center, const Vector &size) {
+        SceneMaterial material = ReadAttributes();
+
+        const float floats[SCENE_FLOAT_COLUMNS] = {center.x, center.y, center.z, size.x, size.y, size.z,
+                                                   material.reflect_k, material.refract_k, material.refract_eta};
+        for (int i = 0; i < SCENE_FLOAT_COLUMNS; i++)
+            description.float_columns[i].push_back(floats[i]);
+
+        const uint8_t bytes[SCENE_BYTE_COLUMNS] = {uint8_t(kind), material.flags, material.color.value.Red,
+                                                   material.color.value.Green, material.color.value.Blue};
+        for (int i = 0; i < SCENE_BYTE_COLUMNS; i++)
+            description.byte_columns[i].push_back(bytes[i]);
+    }
+
+    SceneMaterial ReadAttributes() {
+        SceneMaterial material;
+
+        SkipSpaces();
+        while (!AtLineEnd()) {
+            Word key = ReadWord("attribute");
+            if (key.Is("color")) {
+                material.flags |= SCENE_FIGURE_COLOR;
+                uint8_t r = ReadChannel();
+                uint8_t g = ReadChannel();
+                uint8_t b = ReadChannel();
+                material.color = Pixel(r, g, b);
+            } else if (key.Is("reflect")) {
+                material.flags |= SCENE_FIGURE_REFLECT;
+                material.reflect_k = ReadNumber();
+            } else if (key.Is("refract")) {
+                material.flags |= SCENE_FIGURE_REFRACT;
+                material.refract_k = ReadNumber();
+                material.refract_eta = ReadPositive("coefficient of refraction");
+            } else if (key.Is("material")) {
+                Word material_name = ReadWord("material name");
+                auto it = materials.find(material_name.String());
+                if (it == materials.end())
+                    Error(material_name.column, "unknown material '" + material_name.String() + "'");
+                material.Merge(it->second);
+            } else {
+                Error(key.column, "unknown attribute '" + key.String() + "'");
+            }
+            SkipSpaces();
+        }
+
+        return material;
+    }
+
+    Vector ReadVector() {
+        float x = ReadNumber();
+        float y = ReadNumber();
+        float z = ReadNumber();
+        return Vector(x, y, z);
+    }
+
+    float ReadPositive(const char *what) {
+        int column = Column();
+        float value = ReadNumber();
+        if (!(value > 0))
+            Error(column, std::string(what) + " must be positive");
+        return value;
+    }
+
+    uint8_t ReadChannel() {
+        int column = Column();
+        float value = ReadNumber();
+        if (!(value >= 0 && value <= 255) || value != std::floor(value))
+            Error(column, "color channel must be integer 0..255");
+        return uint8_t(value);
+    }
+
+    /* Decimal number with optional sign, fraction and exponent */
+    float ReadNumber() {
+        SkipSpaces();
+        const char *start = position;
+
+        bool negative = false;
+        if (position < end && (*position == '-' || *position == '+')) {
+            negative = *position == '-';
+            position++;
+        }
+
+        /* The digits after 19th do not fit to mantissa, they change only exponent */
+        uint64_t mantissa = 0;
+        int exponent = 0;
+        int digits = 0;
+        for (; position < end && IsDigit(*position); position++, digits++) {
+            if (mantissa < 1000000000000000000ull)
+                mantissa = mantissa * 10 + (*position - '0');
+            else
+                exponent++;
+        }
+        if (position < end && *position == '.') {
+            position++;
+            for (; position < end && IsDigit(*position); position++, digits++) {
+                if (mantissa < 1000000000000000000ull) {
+                    mantissa = mantissa * 10 + (*position - '0');
+                    exponent--;
+                }
+            }
+        }
+        if (digits == 0)
+            Expected(start, "number");
+
+        if (position < end && (*position == 'e' || *position == 'E')) {
+            position++;
+            bool negative_exponent = false;
+            if (position < end && (*position == '-' || *position == '+')) {
+                negative_exponent = *position == '-';
+                position++;
+            }
+            if (position == end || !IsDigit(*position))
+                Expected(start, "number");
+
+            int value = 0;
+            for (; position < end && IsDigit(*position); position++) {
+                if (value < 10000)
+                    value = value * 10 + (*position - '0');
+            }
+            exponent += negative_exponent ? -value : value;
+        }
+        if (!AtSeparator())
+            Expected(start, "number");
+
+        double result = double(mantissa);
+        if (exponent < 0)
+            result /= PowerOfTen(-exponent);
+        else if (exponent > 0)
+            result *= PowerOfTen(exponent);
+
+        if (std::isinf(float(result))) {
+            position = start;
+            Error(Column(), "number is too big");
+        }
+        return float(negative ? -result : result);
+    }
+
+    Word ReadWord(const char *what) {
+        SkipSpaces();
+        const char *start = position;
+        if (position == end || !IsLetter(*position))
+            Expected(start, what);
+
+        while (position < end && (IsLetter(*position) || IsDigit(*position) || *position == '-'))
+            position++;
+        if (!AtSeparator())
+            Expected(start, what);
+
+        Word word;
+        word.begin = start;
+        word.size = size_t(position - start);
+        word.column = int(start - line_start) + 1;
+        return word;
+    }
+
+    /* The token for error message, it is read till separator */
+    std::string ReadToken() {
+        const char *start = position;
+        while (position < end && !AtSeparator())
+            position++;
+        return std::string(start, size_t(position - start));
+    }
+
+    void SkipSpaces() {
+        while (position < end && (*position == ' ' || *position == '\t' || *position == '\r'))
+            position++;
+    }
+
+    /* End of statement: end of line, comment or end of text */
+    bool AtLineEnd() const {
+        return position == end || *position == '\n' || *position == '#';
+    }
+
+    bool AtSeparator() const {
+        return AtLineEnd() || *position == ' ' || *position == '\t' || *position == '\r';
+    }
+
+    void NextLine() {
+        while (position < end && *position != '\n')
+            position++;
+        if (position < end) {
+            position++;
+            line_start = position;
+            line++;
+        }
+    }
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsLetter(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    int Column() {
+        SkipSpaces();
+        return int(position - line_start) + 1;
+    }
+
+    void Expected(const char *start, const char *what) {
+        position = start;
+        std::string token = AtLineEnd() ? "end of line" : "'" + ReadToken() + "'";
+        Error(int(start - line_start) + 1, std::string("expected ") + what + ", got " + token);
+    }
+
+    void Error(int column, const std::string &message) {
+        std::stringstream ss;
+        ss << name << ":" << line << ":" << column << ": " << message;
+        throw std::runtime_error(ss.str());
+    }
+
+    const char *position;
+    const char *end;
+    const char *line_start;
+    int line;
+
+    std::string name;
+    SceneDescription description;
+    std::map<std::string, SceneMaterial> materials;
+};
+
+std::vector<char> SceneFile::Read(const std::string &filename) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file) {
+        std::stringstream ss;
+        ss << "Error read scene file: " << filename;
+        throw std::runtime_error(ss.str());
+    }
+
+    std::vector<char> text(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    if (!file.read(text.data(), std::streamsize(text.size()))) {
+        std::stringstream ss;
+        ss << "Error read scene file: " << filename;
+        throw std::runtime_error(ss.str());
+    }
+    return text;
+}
+
+SceneDescription SceneFile::Load(const std::string &filename, const Camera &camera) {
+    std::vector<char> text = Read(filename);
+    return Parse(text.data(), text.size(), filename, camera);
+}
+
+SceneDescription SceneFile::Parse(const char *text, size_t size, const std::string &name, const Camera &camera) {
+    return SceneParser(text, size, name, camera).Parse();
+}
+
+void SceneFile::ApplyCamera(const Camera &file_camera, int parts, Camera &camera) {
+    if (parts & SCENE_CAMERA_POSITION)
+        camera.position = file_camera.position;
+    if (parts & SCENE_CAMERA_DIRECTION)
+        camera.direction = file_camera.direction;
+    if (parts & SCENE_CAMERA_UP)
+        camera.up = file_camera.up;
+    if (parts & SCENE_CAMERA_RIGHT)
+        camera.right = file_camera.right;
+    if (parts & SCENE_CAMERA_DISTANCE)
+        camera.distance = file_camera.distance;
+}
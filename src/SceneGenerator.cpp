@@ -0,0 +1,105 @@
+#include "SceneGenerator.h"
+#include <cmath>
+#include <sstream>
+
+SceneGeneratorConfig::SceneGeneratorConfig() :
+    seed(1),
+    figures_count(100),
+    lights_count(3),
+    region_min(-100, -100, 60),
+    region_max(180, 200, 280),
+    density(0.05f),
+    reflective_fraction(0.2f),
+    refractive_fraction(0.0f),
+    sphere_weight(1), box_weight(1), torus_weight(1)
+{}
+
+SceneGenerator::SceneGenerator(const SceneGeneratorConfig &config) :
+    config(config),
+    state(config.seed != 0 ? config.seed : 1) // xorshift state must not be zero
+{}
+
+float SceneGenerator::Random() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    /* Take 24 high bits, it is exactly representable by float */
+    return float(state >> 8) / 16777216.0f;
+}
+
+float SceneGenerator::Random(float a, float b) {
+    return a + (b - a) * Random();
+}
+
+Vector SceneGenerator::RandomPoint() {
+    float x = Random(config.region_min.x, config.region_max.x);
+    float y = Random(config.region_min.y, config.region_max.y);
+    float z = Random(config.region_min.z, config.region_max.z);
+    return Vector(x, y, z);
+}
+
+Pixel SceneGenerator::RandomColor() {
+    static Pixel palette[] = {Pixel::Red, Pixel::Green, Pixel::Blue, Pixel::Gray, Pixel::LightPink, Pixel::White};
+    int index = std::min(5, int(Random() * 6));
+    return palette[index] * Random(0.25f, 1.0f);
+}
+
+void SceneGenerator::Generate(Scene &scene) {
+    Vector size = config.region_max - config.region_min;
+    float region_volume = std::abs(size.x * size.y * size.z);
+
+    /* The average volume of one figure */
+    float figure_volume = config.density * region_volume / std::max(1, config.figures_count);
+
+    float weights_sum = config.sphere_weight + config.box_weight + config.torus_weight;
+    if (weights_sum <= 0)
+        throw std::runtime_error("Scene generator: sum of shape weights must be positive");
+
+    for (int i = 0; i < config.figures_count; i++) {
+        float kind = Random() * weights_sum;
+        Vector center = RandomPoint();
+
+        FigureBaseImpl *figure;
+        if (kind < config.sphere_weight) {
+            float radius = std::cbrt(3 * figure_volume / float(4 * M_PI));
+            figure = new Sphere(center, radius * Random(0.6f, 1.4f));
+        } else if (kind < config.sphere_weight + config.box_weight) {
+            float side = std::cbrt(figure_volume) / 2;
+            figure = new Box(center, Vector(side * Random(0.6f, 1.4f),
+                                            side * Random(0.6f, 1.4f),
+                                            side * Random(0.6f, 1.4f)));
+        } else {
+            /* Torus volume is 2 * pi^2 * R * r^2, take R = 3 * r */
+            float r = std::cbrt(figure_volume / float(6 * M_PI * M_PI));
+            figure = new Torus(center, 3 * r * Random(0.8f, 1.2f), r);
+        }
+
+        figure->DefaultColor(RandomColor());
+
+        float material = Random();
+        if (material < config.reflective_fraction) {
+            figure->MakeReflectable(Random(0.1f, 0.8f));
+        } else if (material < config.reflective_fraction + config.refractive_fraction) {
+            figure->Refractable(Random(0.3f, 0.7f), Random(1.01f, 1.1f));
+        }
+
+        scene.AddFigure(figure);
+    }
+
+    for (int i = 0; i < config.lights_count; i++) {
+        scene.AddLight(RandomPoint());
+    }
+}
+
+void SceneGenerator::ParseShapeMix(const std::string &mix, SceneGeneratorConfig &config) {
+    std::stringstream ss(mix);
+    char delimiter1 = 0, delimiter2 = 0;
+
+    ss >> config.sphere_weight >> delimiter1 >> config.box_weight >> delimiter2 >> config.torus_weight;
+    if (ss.fail() || delimiter1 != ':' || delimiter2 != ':') {
+        std::stringstream error;
+        error << "Bad shape mix: " << mix << ", expected sphere:box:torus, for example 2:1:1";
+        throw std::runtime_error(error.str());
+    }
+}
@@ -0,0 +1,98 @@
+#include "Timeline.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+static int64_t SteadyMicroseconds() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Timeline::Timeline() : enabled(false), origin(SteadyMicroseconds()) {}
+
+Timeline &Timeline::Instance() {
+    static Timeline timeline;
+    return timeline;
+}
+
+void Timeline::Enable() {
+    enabled = true;
+}
+
+int64_t Timeline::Now() const {
+    return SteadyMicroseconds() - origin;
+}
+
+Timeline::ThreadSpans &Timeline::CurrentThreadSpans() {
+    static thread_local ThreadSpans *current = nullptr;
+    if (current == nullptr) {
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        current = new ThreadSpans();
+        current->thread_id = static_cast<int>(threads.size());
+        threads.push_back(current);
+    }
+    return *current;
+}
+
+void Timeline::AddSpan(const char *name, const char *category, int64_t start, int64_t end, int arg_x, int arg_y) {
+    Span span{name, category, start, end, arg_x, arg_y};
+    CurrentThreadSpans().spans.push_back(span);
+}
+
+void Timeline::WriteToFile(const std::string &filename) {
+    std::ofstream out(filename);
+    if (!out) {
+        std::stringstream ss;
+        ss << "Error write to file: " << filename;
+        throw std::runtime_error(ss.str());
+    }
+
+    std::lock_guard<std::mutex> lock(threads_mutex);
+
+    int pid = static_cast<int>(getpid());
+    bool first = true;
+
+    out << "{\"traceEvents\":[\n";
+    for (auto thread : threads) {
+        if (!first)
+            out << ",\n";
+        first = false;
+
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << thread->thread_id
+            << ",\"args\":{\"name\":\"thread " << thread->thread_id << "\"}}";
+
+        for (auto &span : thread->spans) {
+            out << ",\n{\"name\":\"" << span.name << "\",\"cat\":\"" << span.category
+                << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << thread->thread_id
+                << ",\"ts\":" << span.start << ",\"dur\":" << span.end - span.start;
+            if (span.arg_x >= 0)
+                out << ",\"args\":{\"x\":" << span.arg_x << ",\"y\":" << span.arg_y << "}";
+            out << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+/* TimelineSpan implementation */
+
+TimelineSpan::TimelineSpan(const char *name, const char *category, int arg_x, int arg_y) :
+    name(name),
+    category(category),
+    arg_x(arg_x),
+    arg_y(arg_y),
+    start(-1)
+{
+    Timeline &timeline = Timeline::Instance();
+    if (timeline.Enabled())
+        start = timeline.Now();
+}
+
+TimelineSpan::~TimelineSpan() {
+    if (start < 0)
+        return;
+
+    Timeline &timeline = Timeline::Instance();
+    timeline.AddSpan(name, category, start, timeline.Now(), arg_x, arg_y);
+}